@@ -0,0 +1,140 @@
+// Author: Justin Tromp
+// Date: 05/25/2020
+// Description: Alphabet policies of the text mode shared by keygen and otp. A policy is described by three macros:
+// <POLICY>_SIZE (number of symbols), <POLICY>_SYMBOL(i) (symbol at index i) and <POLICY>_INDEX(c) (index of
+// character c, -1 if it is not in the alphabet). ALPHABET_POLICY turns them into lookup tables filled in by the
+// compiler and into check, encrypt and decrypt kernels that use only those tables, so every alphabet gets its own
+// kernel without a branch or a division per character:
+//   <name>Index    character to index (characters outside the alphabet map to 0)
+//   <name>Invalid  1 for characters outside the alphabet
+//   <name>Wrap     sum of two indexes, or difference offset by the size, to the symbol of its remainder. This is
+//                  the modular addition of encryption and subtraction of decryption in one table.
+// Messages and keys in any policy but UPPER27 start with the policy's marker, so a get knows how to decrypt a message
+// and a key of one alphabet is never used with another.
+// Adding an alphabet takes its three macros, an ALPHABET_POLICY line and an entry in alphabetPolicies.
+
+#ifndef ALPHABET_H
+#define ALPHABET_H
+
+#include <string.h>
+
+// Expands entry(policy, n) for the 256 values of n from start, separated by commas, to fill a table.
+#define ALPHABET_REPEAT4(entry, policy, n) \
+    entry(policy, (n)), entry(policy, (n) + 1), entry(policy, (n) + 2), entry(policy, (n) + 3)
+#define ALPHABET_REPEAT16(entry, policy, n) \
+    ALPHABET_REPEAT4(entry, policy, (n)), ALPHABET_REPEAT4(entry, policy, (n) + 4), \
+    ALPHABET_REPEAT4(entry, policy, (n) + 8), ALPHABET_REPEAT4(entry, policy, (n) + 12)
+#define ALPHABET_REPEAT64(entry, policy, n) \
+    ALPHABET_REPEAT16(entry, policy, (n)), ALPHABET_REPEAT16(entry, policy, (n) + 16), \
+    ALPHABET_REPEAT16(entry, policy, (n) + 32), ALPHABET_REPEAT16(entry, policy, (n) + 48)
+#define ALPHABET_REPEAT256(entry, policy, n) \
+    ALPHABET_REPEAT64(entry, policy, (n)), ALPHABET_REPEAT64(entry, policy, (n) + 64), \
+    ALPHABET_REPEAT64(entry, policy, (n) + 128), ALPHABET_REPEAT64(entry, policy, (n) + 192)
+
+// Table entries for character or sum n.
+#define ALPHABET_INDEX_ENTRY(policy, n) (policy##_INDEX(n) < 0 ? 0 : policy##_INDEX(n))
+#define ALPHABET_INVALID_ENTRY(policy, n) (policy##_INDEX(n) < 0)
+#define ALPHABET_WRAP_ENTRY(policy, n) policy##_SYMBOL((n) % policy##_SIZE)
+
+// Defines the tables and kernels of a policy. The kernels process length characters and return -1 if any character
+// of the input or key is outside the alphabet, 0 otherwise.
+#define ALPHABET_POLICY(policy, name) \
+    static const unsigned char name##Index[256] = { ALPHABET_REPEAT256(ALPHABET_INDEX_ENTRY, policy, 0) }; \
+    static const unsigned char name##Invalid[256] = { ALPHABET_REPEAT256(ALPHABET_INVALID_ENTRY, policy, 0) }; \
+    static const char name##Wrap[256] = { ALPHABET_REPEAT256(ALPHABET_WRAP_ENTRY, policy, 0) }; \
+    \
+    static int name##Check(const char* text, int length) { \
+        const unsigned char* input = (const unsigned char*) text; \
+        unsigned char invalid = 0; \
+        int i; \
+        for (i = 0; i < length; i++) { \
+            invalid = invalid | name##Invalid[input[i]]; \
+        } \
+        return invalid ? -1 : 0; \
+    } \
+    \
+    static int name##Encrypt(char* output, const char* message, const char* key, int length) { \
+        const unsigned char* input = (const unsigned char*) message; \
+        const unsigned char* pad = (const unsigned char*) key; \
+        unsigned char invalid = 0; \
+        int i; \
+        for (i = 0; i < length; i++) { \
+            invalid = invalid | name##Invalid[input[i]] | name##Invalid[pad[i]]; \
+            output[i] = name##Wrap[name##Index[input[i]] + name##Index[pad[i]]]; \
+        } \
+        return invalid ? -1 : 0; \
+    } \
+    \
+    static int name##Decrypt(char* output, const char* encrypted, const char* key, int length) { \
+        const unsigned char* input = (const unsigned char*) encrypted; \
+        const unsigned char* pad = (const unsigned char*) key; \
+        unsigned char invalid = 0; \
+        int i; \
+        for (i = 0; i < length; i++) { \
+            invalid = invalid | name##Invalid[input[i]] | name##Invalid[pad[i]]; \
+            output[i] = name##Wrap[name##Index[input[i]] + policy##_SIZE - name##Index[pad[i]]]; \
+        } \
+        return invalid ? -1 : 0; \
+    }
+
+// Capital letters and space, the original alphabet. Space follows Z.
+#define UPPER27_SIZE 27
+#define UPPER27_SYMBOL(i) ((i) == 26 ? ' ' : 'A' + (i))
+#define UPPER27_INDEX(c) ((c) == ' ' ? 26 : ((c) >= 'A' && (c) <= 'Z' ? (c) - 'A' : -1))
+
+// Printable ASCII, space through tilde.
+#define PRINT95_SIZE 95
+#define PRINT95_SYMBOL(i) (' ' + (i))
+#define PRINT95_INDEX(c) ((c) >= ' ' && (c) <= '~' ? (c) - ' ' : -1)
+
+ALPHABET_POLICY(UPPER27, upper27)
+ALPHABET_POLICY(PRINT95, print95)
+
+// A policy as selected at run time. Marker is the first byte of messages in the policy, 0 for unmarked UPPER27
+// messages and keys. otp uses 1 for binary mode, so markers start at 2. Symbols holds the alphabet in index order.
+struct alphabetPolicy {
+    const char* name;
+    int size;
+    char marker;
+    const char* symbols;
+    int (*check)(const char* text, int length);
+    int (*encrypt)(char* output, const char* message, const char* key, int length);
+    int (*decrypt)(char* output, const char* encrypted, const char* key, int length);
+};
+
+#define ALPHABET_COUNT 2
+
+static const struct alphabetPolicy alphabetPolicies[ALPHABET_COUNT] = {
+    { "upper27", UPPER27_SIZE, '\0', upper27Wrap, upper27Check, upper27Encrypt, upper27Decrypt },
+    { "print95", PRINT95_SIZE, '\x02', print95Wrap, print95Check, print95Encrypt, print95Decrypt }
+};
+
+// Finds a policy by name.
+// Pre-conditions: Must be passed a name.
+// Post-conditions: Returns the policy or NULL if there is none of that name.
+static inline const struct alphabetPolicy* findAlphabet(const char* name) {
+    int i;
+    for (i = 0; i < ALPHABET_COUNT; i++) {
+        if (strcmp(alphabetPolicies[i].name, name) == 0) {
+            return &alphabetPolicies[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Finds the policy of a message or key from its first byte.
+// Pre-conditions: Must be passed the first byte of a text message or key.
+// Post-conditions: Returns the policy marked by it, or UPPER27 for an unmarked message or key.
+static inline const struct alphabetPolicy* findAlphabetByMarker(char marker) {
+    int i;
+    for (i = 1; i < ALPHABET_COUNT; i++) {
+        if (alphabetPolicies[i].marker == marker) {
+            return &alphabetPolicies[i];
+        }
+    }
+
+    return &alphabetPolicies[0];
+}
+
+#endif
@@ -0,0 +1,35 @@
+// Author: Justin Tromp
+// Date: 05/25/2020
+// Description: Big-endian integer encoding shared by the otp_pack archive format and the otp_d request trace, so
+// both files can be read on any machine.
+
+#ifndef BIGENDIAN_H
+#define BIGENDIAN_H
+
+#include <stdint.h>
+
+// Stores value as a big-endian integer of size bytes in buffer.
+// Pre-conditions: Buffer must have at least size bytes available.
+// Post-conditions: Buffer holds the encoded value.
+static inline void putUnsigned(unsigned char* buffer, uint64_t value, int size) {
+    int i;
+    for (i = size - 1; i >= 0; i--) {
+        buffer[i] = (unsigned char) (value & 0xFF);
+        value = value >> 8;
+    }
+}
+
+// Reads a big-endian integer of size bytes from buffer and returns it.
+// Pre-conditions: Buffer must hold at least size bytes.
+// Post-conditions: Decoded value is returned.
+static inline uint64_t getUnsigned(const unsigned char* buffer, int size) {
+    uint64_t value = 0;
+    int i;
+    for (i = 0; i < size; i++) {
+        value = (value << 8) | buffer[i];
+    }
+
+    return value;
+}
+
+#endif
@@ -0,0 +1,118 @@
+// Author: Justin Tromp
+// Date: 05/25/2020
+// Description: CRC32C (Castagnoli) checksum shared by otp and otp_d to check that drops arrive intact. On x86-64
+// processors with SSE4.2 the crc32 instruction is used, otherwise a slicing-by-8 table lookup.
+// Drops carry their checksum as 8 hex digits: otp_d keeps it in the CRC32C_XATTR extended attribute of the drop file
+// and sends it after the size in the get response.
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// Extended attribute holding the checksum of a drop file.
+#define CRC32C_XATTR "user.otp.crc32c"
+
+// Reflected CRC32C polynomial.
+#define CRC32C_POLYNOMIAL 0x82f63b78
+
+// Tables for the software version, filled on first use. Table k advances a byte k positions further.
+static uint32_t crc32cTable[8][256];
+static int crc32cTableReady = 0;
+
+// Fills the slicing-by-8 tables.
+// Pre-conditions: None.
+// Post-conditions: crc32cTable is ready for use.
+static void crc32cInitTable(void) {
+    int i;
+    int k;
+    for (i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLYNOMIAL : 0);
+        }
+        crc32cTable[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++) {
+        for (k = 1; k < 8; k++) {
+            crc32cTable[k][i] = (crc32cTable[k - 1][i] >> 8) ^ crc32cTable[0][crc32cTable[k - 1][i] & 0xff];
+        }
+    }
+    crc32cTableReady = 1;
+}
+
+// Advances a raw (not inverted) CRC32C over length bytes with table lookups, eight bytes at a time.
+// Pre-conditions: Must be passed the running value and a buffer of at least length bytes.
+// Post-conditions: Returns the advanced value.
+static uint32_t crc32cSoftware(uint32_t crc, const unsigned char* data, size_t length) {
+    if (!crc32cTableReady) {
+        crc32cInitTable();
+    }
+
+    while (length >= 8) {
+        uint32_t low;
+        uint32_t high;
+        memcpy(&low, data, 4);
+        memcpy(&high, data + 4, 4);
+        low = low ^ crc;
+        crc = crc32cTable[7][low & 0xff] ^ crc32cTable[6][(low >> 8) & 0xff] ^
+              crc32cTable[5][(low >> 16) & 0xff] ^ crc32cTable[4][low >> 24] ^
+              crc32cTable[3][high & 0xff] ^ crc32cTable[2][(high >> 8) & 0xff] ^
+              crc32cTable[1][(high >> 16) & 0xff] ^ crc32cTable[0][high >> 24];
+        data = data + 8;
+        length = length - 8;
+    }
+    while (length > 0) {
+        crc = (crc >> 8) ^ crc32cTable[0][(crc ^ *data) & 0xff];
+        data++;
+        length--;
+    }
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+// Advances a raw CRC32C over length bytes with the SSE4.2 crc32 instruction, eight bytes at a time.
+// Pre-conditions: Processor must support SSE4.2. Must be passed the running value and a buffer of length bytes.
+// Post-conditions: Returns the advanced value.
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(uint32_t crc, const unsigned char* data, size_t length) {
+    uint64_t wide = crc;
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        wide = _mm_crc32_u64(wide, word);
+        data = data + 8;
+        length = length - 8;
+    }
+
+    crc = (uint32_t) wide;
+    while (length > 0) {
+        crc = _mm_crc32_u8(crc, *data);
+        data++;
+        length--;
+    }
+
+    return crc;
+}
+#endif
+
+// Continues a CRC32C with length more bytes. Start with 0, and pass the result of the previous call to continue, so a
+// message can be checksummed in pieces as it streams.
+// Pre-conditions: Must be passed the checksum so far and a buffer of at least length bytes.
+// Post-conditions: Returns the checksum including the new bytes.
+static uint32_t crc32cUpdate(uint32_t crc, const void* data, size_t length) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return ~crc32cHardware(~crc, (const unsigned char*) data, length);
+    }
+#endif
+    return ~crc32cSoftware(~crc, (const unsigned char*) data, length);
+}
+
+#endif
@@ -3,7 +3,12 @@
 // Description: Keygen: Allows for creation of a randomly generated key used to encrypt and decrypt
 // text/files. The key files generated from keygen.c can be used with otp_d and otp. Must pass
 // a command line argument for the size of the key, which will consist of randomly generated characters
-// of that length (capital letters or a space are all possible).
+// of that length (capital letters or a space are all possible). With -a, the characters are drawn from another
+// alphabet (see alphabet.h, e.g. print95 for printable ASCII) and preceded by its marker, so otp only uses the key
+// with that alphabet. With -b, a
+// binary key of that many random bytes (without a trailing newline) is generated instead for use with the binary
+// mode of otp.
+// Valid arguments: [-b | -a <alphabet>] <key_length>
 // References: Previous Assignments
 // https://www.geeksforgeeks.org/generating-random-number-range-c/
 
@@ -12,45 +17,61 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
+#include "alphabet.h"
 
-// Takes an unsigned int value as parameter and generates a string of characters
-// (capital letters and spaces) randomly of the provided length. This string is returned.
-// Pre-conditions: Must be passed a valid keyLength value as parameter.
+// Takes an unsigned int value as parameter and generates a string of characters of the alphabet
+// randomly of the provided length, after the alphabets marker if it has one. This string is returned.
+// Pre-conditions: Must be passed a valid keyLength value and an alphabet as parameters.
 // Post-conditions: Returns a randomly generated key of length provided.
-char* generateRandomString (unsigned int keyLength) {
-    int lowerLimit = 65;
-    // 90 is end of capital characters in ASCII table, 91 will signify a space.
-    int upperLimit = 91;
-
+char* generateRandomString (unsigned int keyLength, const struct alphabetPolicy* alphabet) {
     char* createdKey = malloc(sizeof(char) * (keyLength + 5));
     memset(createdKey, '\0', (keyLength + 5));
 
+    char* symbols = createdKey;
+    if (alphabet->marker != '\0') {
+        *symbols = alphabet->marker;
+        symbols++;
+    }
+
     int i;
-    // Loop number of times as keyLength to generate a random value within the range of
-    // possible values.
+    // Loop number of times as keyLength to pick a random symbol of the alphabet.
     for (i = 0; i < keyLength; i++) {
-        // Determine random value in range of limits
-        int value = (rand() % (upperLimit - lowerLimit + 1)) + lowerLimit;
-
-        char c = ' ';
-        // Get character
-        if (value != 91) {
-            c = value;
-        }
-        else {
-            c = 32;
-        }
-
-        // Set character in string
-        createdKey[i] = c;
+        symbols[i] = alphabet->symbols[rand() % alphabet->size];
     }
 
     // Add newline character to end of generated string
-    createdKey[keyLength] = '\n';
+    symbols[keyLength] = '\n';
 
     return createdKey;
 }
 
+// Writes keyLength random bytes read from /dev/urandom to stdout.
+// Pre-conditions: Must be passed the number of bytes to generate.
+// Post-conditions: Binary key is output to stdout. If no random source is available, an error is output to stderr
+// and keygen exits.
+void generateBinaryKey(unsigned int keyLength) {
+    FILE* randomSource = fopen("/dev/urandom", "r");
+    if (randomSource == NULL) {
+        fprintf(stderr, "Could not open random source.\n");
+        exit(1);
+    }
+
+    unsigned char buffer[65536];
+    // Copy random bytes in chunks until the key is complete
+    while (keyLength > 0) {
+        size_t chunk = keyLength < sizeof(buffer) ? keyLength : sizeof(buffer);
+        if (fread(buffer, 1, chunk, randomSource) != chunk) {
+            fprintf(stderr, "Could not read random source.\n");
+            exit(1);
+        }
+        fwrite(buffer, 1, chunk, stdout);
+        keyLength = keyLength - chunk;
+    }
+
+    fflush(stdout);
+    fclose(randomSource);
+}
+
 // Main function gathers the arguments from command line and performs error checking.
 // Using the provided command line argument of length of key, a randomly generated key
 // of that size is generated and output to stdout.
@@ -58,6 +79,24 @@ int main(int argc, char const *argv[]) {
     // Use current system time as seed for random generation
     srand(time(0));
 
+    // A leading -b selects a binary key, -a another alphabet
+    int binaryKey = 0;
+    const struct alphabetPolicy* alphabet = &alphabetPolicies[0];
+    if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+        binaryKey = 1;
+        argv++;
+        argc--;
+    }
+    else if (argc > 2 && strcmp(argv[1], "-a") == 0) {
+        alphabet = findAlphabet(argv[2]);
+        if (alphabet == NULL) {
+            fprintf(stderr, "Unknown alphabet %s.\n", argv[2]);
+            exit(1);
+        }
+        argv = argv + 2;
+        argc = argc - 2;
+    }
+
     // If argc is less than or more than 2, output error message for incorrect number of arguments and exit.
     if (argc < 2) {
         fprintf(stderr, "Must provide a command line argument for key length.\n");
@@ -81,8 +120,13 @@ int main(int argc, char const *argv[]) {
     // Get the keylength from the arguments provided
     keyLength = atoi(argv[1]);
 
+    if (binaryKey) {
+        generateBinaryKey(keyLength);
+        return 0;
+    }
+
     char* key = NULL;
-    key = generateRandomString(keyLength);
+    key = generateRandomString(keyLength, alphabet);
 
     // If there is a key generated, then output the key to stdout
     if (key != NULL) {
@@ -3,13 +3,26 @@
 // Description: otp acts as the client to otp_d and can perform a get or post request. With a get request,
 // otp requests an encrypted file for a user and decrypts it with a key. With a post request, otp encrypts
 // a file with a key and sends the encrypted text to be written to a file by otp_d.
-// Valid post arguments: post <username> <file_to_encrypt> <key> <port>
-// Valid get arguments: get <username> <key> <port>
+// Valid post arguments: [-a <alphabet>] post <username> <file_to_encrypt> <key> <port>
+// Valid binary post arguments: -b post <username> <file_to_encrypt> <binary_key> <port>
+// Valid resumable post arguments: [-b | -a <alphabet>] chunk <username> <file_to_encrypt> <key> <port>
+// Valid fan-out post arguments: [-b | -a <alphabet>] fan <username>,<username>... <file_to_encrypt> <key> <port>
+// Valid get arguments: get <username> <key> <port> [output_file]
+// Valid route arguments: route <username> <port>
+// Valid agent arguments: agent <socket_path> <port> [warm_seconds]
+// With OTP_AGENT set to the socket path of a running agent, commands are forwarded to it. The agent keeps key files
+// mapped and connections to otp_d open, so each command skips that setup. Only the user running the agent may use it.
+// Text messages use capital letters and space unless another alphabet (see alphabet.h) is chosen with -a. The key
+// must have been generated for the same alphabet (keygen -a marks it), gets find the alphabet from the message itself.
+// Wherever a port is expected, <host>:<port> or the name of a cluster membership file (one <port> or <host>:<port>
+// per line) may be given instead. With a membership file, each user is routed to its owning otp_d by consistent
+// hashing.
 // References: Previous Assignments
 // https://www.zentut.com/c-tutorial/c-file-exists/
 // https://www.thinkage.ca/gcos/expl/c/lib/fopen.html
 // https://beej.us/guide/bgnet/html/#setsockoptman
 
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,304 +32,810 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <dirent.h>
-
-// Sends message over a valid/open socket connection.
-// Pre-conditions: Must have a valid/open socket and a string message to be sent passed as parameters.
-// Post-conditions: Message in parameter is sent over socket connection to otp_d.
-void sendMessage(int socket, char* message) {
+#include <sys/stat.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include "crc32c.h"
+#include "alphabet.h"
+
+// Size of the pieces in which a get receives, decrypts and writes the message.
+#define STREAM_CHUNK_SIZE 65536
+
+// First byte of a message encrypted in binary mode. It can never start a text message, and is not used as the
+// marker of an alphabet (see alphabet.h).
+#define MODE_BINARY '\x01'
+
+// Number of connections a chunked upload makes before giving up (running the command again still resumes it).
+#define CHUNK_ATTEMPTS 5
+
+// Longest recipient list a fan-out post can send to one otp_d (the user field of the handshake).
+#define FANOUT_LIST_MAX 1024
+
+// Cluster routing: points each otp_d node gets on the consistent hash ring and maximum number of nodes.
+#define VIRTUAL_NODES 160
+#define MAX_MEMBERS 256
+
+// Agent: key pads kept mapped, connections kept open per otp_d, default seconds a connection is kept before it is
+// replaced (below otp_d's default handshake deadline), and limits of a forwarded request.
+#define AGENT_KEYS 32
+#define AGENT_POOL_SIZE 4
+#define AGENT_WARM_SECONDS 5
+#define AGENT_REQUEST_MAX 8192
+#define AGENT_ARGUMENTS 16
+
+// Vector of bytes processed at once by the binary mode XOR kernel.
+typedef unsigned char xorVector __attribute__((vector_size(32)));
+
+// otp_d node address and a point it owns on the consistent hash ring.
+struct clusterMember {
+    char host[256];
+    int port;
+};
+
+struct ringPoint {
+    unsigned long long hash;
+    int member;
+};
+
+// Nodes a target argument routes users to: a single otp_d (no ring) or the members of a cluster and their points
+// on the ring, sorted by hash.
+struct clusterRoute {
+    struct clusterMember* members;
+    int count;
+    struct ringPoint* ring;
+};
+
+// Key file mapped by the agent, identified by path and checked against the file before each use.
+struct keyPad {
+    char path[1024];
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    time_t modified;
+    char* data;
+    long lastUsed;
+};
+
+// Connection the agent opened ahead of time, shared with request processes, which claim it atomically. Epoch tells
+// request processes whether the socket existed when they were forked.
+struct warmConnection {
+    int socket;
+    int claimed;
+    long opened;
+    long epoch;
+};
+
+// Agent state. Request processes are forked from the agent and inherit the pads and the pool.
+struct keyPad agentKeys[AGENT_KEYS];
+long agentKeyClock = 0;
+struct clusterMember agentNodes[MAX_MEMBERS];
+int agentNodeCount = 0;
+struct warmConnection* agentPool = NULL;
+long agentPoolEpoch = 0;
+long agentForkEpoch = 0;
+int agentListenSocket = -1;
+long agentWarmSeconds = AGENT_WARM_SECONDS;
+
+// Sends length bytes of buffer over a valid/open socket connection.
+// Pre-conditions: Must have a valid/open socket and a buffer of at least length bytes passed as parameters.
+// Post-conditions: Buffer contents are sent over socket connection to otp_d. Returns 0 if all of it was sent,
+// otherwise -1.
+int sendBuffer(int socket, char* buffer, int length) {
     int charsSent = 0;
-    int charsLeft = strlen(message);
+    int charsLeft = length;
     int charsSentTotal = 0;
 
-    // Loop until the entire message is sent
+    // Loop until the entire buffer is sent
     while(charsLeft > 0) {
-        // Send all or part of message if necessary over socket connection
-        charsSent = send(socket, message, charsLeft, 0);
+        // Send all or part of buffer if necessary over socket connection
+        charsSent = send(socket, buffer + charsSentTotal, charsLeft, 0);
+
+        // If number of characters sent is -1, then stop. Nothing was sent.
+        if (charsSent == -1) {
+            return -1;
+        }
 
         // Determine number of characters left to be sent and how many characters have been sent total
         charsLeft = charsLeft - charsSent;
         charsSentTotal = charsSentTotal + charsSent;
+    }
 
-        // If number of characters sent is -1, then break out of loop. Nothing was sent.
-        if (charsSent == -1) {
+    return 0;
+}
+
+// Receives length bytes over a valid/open socket connection into buffer, looping over short receives.
+// Pre-conditions: Must be passed a valid/open socket and a buffer of at least length bytes.
+// Post-conditions: Returns the number of bytes received, which is less than length only if the connection closed.
+int receiveFully(int socket, char* buffer, int length) {
+    int bytesRead = 0;
+
+    // Loop until the requested number of bytes has arrived or the connection is closed
+    while (bytesRead < length) {
+        int valread = recv(socket, buffer + bytesRead, length - bytesRead, 0);
+        if (valread <= 0) {
             break;
         }
+        bytesRead = bytesRead + valread;
     }
+
+    return bytesRead;
 }
 
-// Receives encrypted message from otp_d over valid/open socket connection.
-// Pre-conditions: Must be passed a valid/open socket connection as parameter.
-// Post-conditions: Receives the encrypted message from otp_d over socket connection and returns it at end
-// of function.
-char* receiveEncryptedMessage(int socket) {
-    char fileSize[20];
-    memset(fileSize, '\0', 20);
+// Opens a file from the current working directory for reading.
+// Pre-conditions: Must be passed the name of a file.
+// Post-conditions: Returns the opened file or NULL if it could not be opened.
+FILE* openWorkingFile(char* fileName) {
+    char dirPath[256];
+    memset(dirPath, '\0', 256);
+    // Get the current working directory
+    getcwd(dirPath, 256);
 
-    // Receives the size of the file that is expected to be sent by otp_d.
-    recv(socket, fileSize, 20, 0);
+    // Determine path to file and open it to be read from
+    char pathName[256];
+    memset(pathName, '\0', 256);
+    strcat(pathName, dirPath);
+    strcat(pathName, "/");
+    strcat(pathName, fileName);
 
-    // Convert string size of file to integer value.
-    int fileSizeInt = 0;
-    fileSizeInt = atoi(fileSize);
+    // In an agent request, keys are read from the pads the agent mapped
+    int i;
+    for (i = 0; i < AGENT_KEYS; i++) {
+        if (agentKeys[i].data != NULL && strcmp(agentKeys[i].path, pathName) == 0) {
+            return fmemopen(agentKeys[i].data, agentKeys[i].size, "r");
+        }
+    }
 
-    // Set aside memory for the encrypted message to be received based on the size of file expected.
-    char* encryptedMessage = malloc(sizeof(char) * (fileSizeInt + 5));
-    memset(encryptedMessage, '\0', (fileSizeInt + 5));
+    return fopen(pathName, "r");
+}
 
-    int valread = 0;
-    int bytesRead = 0;
-    // Set read buffer to receive messages from otp_d server
-    char* readBuffer = malloc(sizeof(char) * 1028);
-    memset(readBuffer, '\0', 1028);
+// Reads the text line at the current position of a file, up to its newline, the end of the file or limit
+// characters, checking that only characters of the alphabet are encountered. The line is read in chunks, so it may
+// be of any size.
+// Pre-conditions: Must be passed the alphabet, an open file and the most characters to read (-1 for no limit).
+// Post-conditions: Returns the number of characters read. If one is outside the alphabet, an error is output to
+// stderr and otp exits.
+long long scanTextLine(const struct alphabetPolicy* alphabet, FILE* file, long long limit) {
+    char* buffer = malloc(STREAM_CHUNK_SIZE);
+    long long length = 0;
+    int ended = 0;
+
+    while (!ended && (limit < 0 || length < limit)) {
+        int wanted = limit < 0 || limit - length > STREAM_CHUNK_SIZE ? STREAM_CHUNK_SIZE : (int) (limit - length);
+        int bytesRead = (int) fread(buffer, 1, wanted, file);
+        char* newline = memchr(buffer, '\n', bytesRead);
+        if (newline != NULL) {
+            bytesRead = newline - buffer;
+            ended = 1;
+        }
+        if (bytesRead < wanted) {
+            ended = 1;
+        }
 
-    // Loop until all of message is received from otp_d. Message will be received in chunks of 1024.
-    while (bytesRead < fileSizeInt) {
-        // Clear buffer
-        memset(readBuffer, '\0', 1028);
+        // If the line has a character outside the alphabet, send error message and exit 1
+        if (alphabet->check(buffer, bytesRead) != 0) {
+            fprintf(stderr, "Input provided has an invalid character.\n");
+            exit(1);
+        }
+        length = length + bytesRead;
+    }
+    free(buffer);
 
-        // Get encrypted message from the server
-        valread = recv(socket, readBuffer, 1024, 0);
+    return length;
+}
 
-        strcat(encryptedMessage, readBuffer);
-        bytesRead = bytesRead + valread;
+// Opens the key of a text message and moves past its marker, checking that it was generated for the alphabet.
+// Pre-conditions: Must be passed the alphabet and the name of a key.
+// Post-conditions: Returns the key positioned at its first symbol. Errors are output to stderr and exit otp.
+FILE* openTextKey(const struct alphabetPolicy* alphabet, char* key) {
+    FILE* keyFilePointer = openWorkingFile(key);
+    if (keyFilePointer == NULL) {
+        fprintf(stderr, "Key or file to encrypt could not be opened.\n");
+        exit(1);
     }
 
-    // Free buffer
-    free(readBuffer);
+    // A key of another alphabet would leave the pad using only some of the alphabets values
+    int keyMarker = fgetc(keyFilePointer);
+    if (keyMarker == EOF || findAlphabetByMarker((char) keyMarker) != alphabet) {
+        fprintf(stderr, "Key was not generated for the %s alphabet.\n", alphabet->name);
+        exit(1);
+    }
+    if (alphabet->marker == '\0') {
+        ungetc(keyMarker, keyFilePointer);
+    }
 
-    return encryptedMessage;
+    return keyFilePointer;
 }
 
-// Check the characters of the message provided to ensure that only capital letters or spaces are encountered.
-// Pre-conditions: Must be passed a string message as parameter.
-// Post-conditions: If message has an invalid character, output error message to stderr and exit otp.
-void checkCharacters(char* message) {
-    int i;
-    // Loop through message
-    for (i = 0; i < strlen(message) - 1; i++) {
-        // If end of message is encountered, exit loop.
-        if (message[i] == '\n') {
-            break;
-        }
-        // If the message is not a capital letter or space, send error message and exit 1
-        else if (!(((int)message[i] >= 65 && (int)message[i] <= 90) || (int)message[i] == 32)) {
-            fprintf(stderr, "Input provided has an invalid character.\n");
-            exit(1);
-        }
+// Checks a text message and its key before anything is sent: the message (the first line of the file) and the
+// key symbols it uses must be in the alphabet and the key must be at least as long as the message. Both are read
+// in chunks, so messages of any size can be posted.
+// Pre-conditions: Must be passed the alphabet, the name of a key and the name of the file to encrypt.
+// Post-conditions: Returns the size of the encrypted message as sent, its marker included. Errors are output to
+// stderr and exit otp.
+long long checkTextMessage(const struct alphabetPolicy* alphabet, char* key, char* fileName) {
+    FILE* textFilePointer = fopen(fileName, "r");
+    if (textFilePointer == NULL) {
+        fprintf(stderr, "Key or file to encrypt could not be opened.\n");
+        exit(1);
     }
-}
+    FILE* keyFilePointer = openTextKey(alphabet, key);
 
-// Encrypts message in a file based on provided key.
-// Pre-conditions: Must be passed a valid name of a file and the name of a key as parameters.
-// Post-conditions: The message in the provided file is retrieved and encrypted by the provided key. The
-// encrypted message is then returned by the function.
-char* encryptMessage(char* key, char* fileName) {
-    char dirPath[256];
-    // Get the current working directory
-    getcwd(dirPath, 256);
+    long long messageLen = scanTextLine(alphabet, textFilePointer, -1);
 
-    // Set file pointers
-    FILE* keyFilePointer;
-    FILE* textFilePointer;
+    // Throw error if key file is not equal to or larger than the message to be encrypted
+    if (scanTextLine(alphabet, keyFilePointer, messageLen) < messageLen) {
+        fprintf(stderr, "Key must be the same size or larger than the file being encrypted.\n");
+        exit(1);
+    }
 
-    // Create path to file for key and use the path created to open that file to be read from.
-    char pathName[256];
-    memset(pathName, '\0', 256);
-    strcat(pathName, dirPath);
-    strcat(pathName, "/");
-    strcat(pathName, key);
-    keyFilePointer = fopen(pathName, "r");
+    fclose(keyFilePointer);
+    fclose(textFilePointer);
 
-    // Create a path to file for fileName and use the path created to open that file to be read from.
-    memset(pathName, '\0', 256);
-    strcat(pathName, dirPath);
-    strcat(pathName, "/");
-    strcat(pathName, fileName);
-    textFilePointer = fopen(fileName, "r");
+    return messageLen + (alphabet->marker != '\0');
+}
 
-    char keyLineRead[100000];
-    memset(keyLineRead, '\0', 100000);
-    // Read line from key file to encrypt with
-    fgets(keyLineRead, 100000, keyFilePointer);
+// Encrypts a text message checked by checkTextMessage with its key and sends it to otp_d as it is encrypted.
+// Messages of any alphabet but the original one start with the alphabets marker. A resumed chunked upload starts at
+// offset within the message (the marker, if any, is its first byte).
+// Pre-conditions: Must be passed a valid/open socket connection, the alphabet, the names of the key and the file to
+// encrypt, the size checkTextMessage returned and the offset to start at.
+// Post-conditions: The encrypted message is sent over the socket connection to otp_d. Returns 0 if all of it was
+// sent, otherwise -1.
+int sendTextMessage(int socket, const struct alphabetPolicy* alphabet, char* key, char* fileName,
+                    long long totalSize, long long offset) {
+    FILE* textFilePointer = fopen(fileName, "r");
+    if (textFilePointer == NULL) {
+        fprintf(stderr, "Key or file to encrypt could not be opened.\n");
+        exit(1);
+    }
+    FILE* keyFilePointer = openTextKey(alphabet, key);
 
-    char messageLineRead[100000];
-    memset(messageLineRead, '\0', 100000);
-    // Read line from message/text file to be encrypted
-    fgets(messageLineRead, 100000, textFilePointer);
+    int result = 0;
+    long long markerLen = alphabet->marker != '\0';
+    if (offset == 0 && markerLen == 1) {
+        result = sendBuffer(socket, (char*) &alphabet->marker, 1);
+        offset = 1;
+    }
+    // The key holds the marker too, so its position is the offset within the message
+    fseeko(textFilePointer, offset - markerLen, SEEK_SET);
+    fseeko(keyFilePointer, offset, SEEK_SET);
+
+    char* messageBuffer = malloc(STREAM_CHUNK_SIZE);
+    char* keyBuffer = malloc(STREAM_CHUNK_SIZE);
+
+    // Encrypt and send one chunk at a time
+    long long left = totalSize - offset;
+    while (result == 0 && left > 0) {
+        int wanted = left < STREAM_CHUNK_SIZE ? (int) left : STREAM_CHUNK_SIZE;
+        if (fread(messageBuffer, 1, wanted, textFilePointer) != wanted ||
+            fread(keyBuffer, 1, wanted, keyFilePointer) != wanted ||
+            alphabet->encrypt(messageBuffer, messageBuffer, keyBuffer, wanted) != 0) {
+            fprintf(stderr, "Key or file to encrypt changed while it was being sent.\n");
+            exit(1);
+        }
+
+        result = sendBuffer(socket, messageBuffer, wanted);
+        left = left - wanted;
+    }
 
-    // Close files after read
     fclose(keyFilePointer);
     fclose(textFilePointer);
+    free(messageBuffer);
+    free(keyBuffer);
 
-    // Get message and key lengths and compare sizes
-    int keyLen = strlen(keyLineRead);
-    int messageLen = strlen(messageLineRead);
+    return result;
+}
 
-    // Throw error if key file is not equal to or larger than the message to be encrypted
-    if (keyLen < messageLen) {
-        fprintf(stderr, "Key must be the same size or larger than the file being encrypted.\n");
+// XORs length bytes of input with the key into output. The bulk of the data is processed 32 bytes at a time with
+// vector operations; on x86-64 an AVX2 version is selected at runtime when the processor supports it.
+// Pre-conditions: All three buffers must hold at least length bytes. Output may be the same buffer as input.
+// Post-conditions: Output holds input XOR key.
+#if defined(__x86_64__)
+__attribute__((target_clones("avx2", "default")))
+#endif
+void xorChunk(unsigned char* output, unsigned char* input, unsigned char* key, int length) {
+    int i = 0;
+
+    // Whole vectors first, loaded and stored through memcpy as buffers need not be aligned
+    for (; i + (int) sizeof(xorVector) <= length; i += sizeof(xorVector)) {
+        xorVector data;
+        xorVector pad;
+        memcpy(&data, input + i, sizeof(xorVector));
+        memcpy(&pad, key + i, sizeof(xorVector));
+        data = data ^ pad;
+        memcpy(output + i, &data, sizeof(xorVector));
+    }
+
+    // Remaining bytes
+    for (; i < length; i++) {
+        output[i] = input[i] ^ key[i];
+    }
+}
+
+// Receives the encrypted message from otp_d and decrypts it as it arrives. Each received chunk is decrypted with
+// the matching range of the key, which is read alongside it, and the plaintext is written straight to output, so
+// memory use stays constant regardless of the size of the message. A message starting with MODE_BINARY was
+// encrypted byte-wise with XOR and is written out exactly as the original bytes; any other message is text in the
+// alphabet its first byte marks (capital letters and space if unmarked) and is followed by a newline. A message
+// with a checksum is decrypted into an unlinked temporary file and only written to output once the checksum
+// matched, so a corrupted message is never output.
+// Pre-conditions: Must be passed a valid/open socket connection, the name of a key file and an open output stream.
+// Post-conditions: The decrypted message is written to output. If no message is available nothing is written.
+// Errors are output to stderr and exit otp.
+void receiveDecryptedMessage(int socket, char* key, FILE* output) {
+    char fileSize[21];
+    memset(fileSize, '\0', 21);
+
+    // Receives the size of the file that is expected to be sent by otp_d. If no file is found, otp_d only sends
+    // "0", so the rest of the size field is only waited for when a real size (never starting with 0) arrives.
+    int valread = recv(socket, fileSize, 20, 0);
+    if (valread <= 0 || fileSize[0] == '0') {
+        return;
+    }
+    receiveFully(socket, fileSize + valread, 20 - valread);
+
+    // Convert string size of file to integer value. The last byte is the newline added by otp_d. Drops with a stored
+    // checksum have it after the size, and it is checked as the message streams through.
+    long long fileSizeInt = 0;
+    unsigned int expectedCrc = 0;
+    int hasChecksum = sscanf(fileSize, "%lld %8x", &fileSizeInt, &expectedCrc) == 2;
+    uint32_t crc = 0;
+    if (fileSizeInt <= 0) {
+        return;
+    }
+
+    // Key size is found by seeking, as a key pad from the agent has no descriptor
+    FILE* keyFilePointer = openWorkingFile(key);
+    if (keyFilePointer == NULL || fseeko(keyFilePointer, 0, SEEK_END) != 0) {
+        fprintf(stderr, "Key file could not be opened.\n");
         exit(1);
     }
+    long long keySize = ftello(keyFilePointer);
+    rewind(keyFilePointer);
+
+    // Buffers for the received chunk, the matching key range and the plaintext
+    char* readBuffer = malloc(sizeof(char) * STREAM_CHUNK_SIZE);
+    char* keyBuffer = malloc(sizeof(char) * STREAM_CHUNK_SIZE);
+    char* plainBuffer = malloc(sizeof(char) * STREAM_CHUNK_SIZE);
+
+    // Plaintext waits in a temporary file until it is verified
+    FILE* plainOutput = output;
+    if (hasChecksum) {
+        plainOutput = tmpfile();
+        if (plainOutput == NULL) {
+            fprintf(stderr, "Could not create a temporary file for the message.\n");
+            exit(1);
+        }
+    }
 
-    // Check that key file and message do not have any out of place characters that are not allowed.
-    // Outputs error to stderr if found and exits with 1.
-    checkCharacters(keyLineRead);
-    checkCharacters(messageLineRead);
+    long long bytesLeft = fileSizeInt;
+    long long encryptedLeft = fileSizeInt - 1;
+    int binaryMode = -1;
+    const struct alphabetPolicy* alphabet = NULL;
 
-    // Allocate memory for encrypted message. This variable will be returned by the function
-    // if successful.
-    int sizeMsg = strlen(messageLineRead);
-    char* encryptedMessage = malloc(sizeof(char) * sizeMsg);
-    memset(encryptedMessage, '\0', sizeMsg);
+    // Loop until all of message is received from otp_d, decrypting whatever has arrived on each pass
+    while (bytesLeft > 0) {
+        int wanted = bytesLeft < STREAM_CHUNK_SIZE ? (int) bytesLeft : STREAM_CHUNK_SIZE;
+        valread = recv(socket, readBuffer, wanted, 0);
 
-    int i;
-    // Encrypt message and store in new variable
-    for (i = 0; i < messageLen - 1; i++) {
-        int asciiMsgChar = 0;
-        int asciiKeyChar = 0;
-        // Get ascii values of characters for key and message to encrypt
-        // If the current position is a space, set to value of 91
-        if (keyLineRead[i] == ' ') {
-            asciiKeyChar = 91 - 65;
-        }
-        // Otherwise, set value of the capital letter
-        else {
-            asciiKeyChar = (int) keyLineRead[i] - 65;
+        if (valread <= 0) {
+            fprintf(stderr, "Connection closed before the message was received.\n");
+            exit(1);
+        }
+        bytesLeft = bytesLeft - valread;
+        if (hasChecksum) {
+            crc = crc32cUpdate(crc, readBuffer, valread);
+        }
+
+        // Only the encrypted characters are decrypted, the trailing newline is dropped
+        char* encrypted = readBuffer;
+        int encryptedCount = encryptedLeft < valread ? (int) encryptedLeft : valread;
+        encryptedLeft = encryptedLeft - encryptedCount;
+        if (encryptedCount == 0) {
+            continue;
+        }
+
+        // The first byte tells which mode (and alphabet) the message was encrypted in
+        if (binaryMode == -1) {
+            binaryMode = encrypted[0] == MODE_BINARY;
+            if (!binaryMode) {
+                alphabet = findAlphabetByMarker(encrypted[0]);
+            }
+            if (binaryMode || alphabet->marker != '\0') {
+                encrypted++;
+                encryptedCount--;
+            }
+
+            // The key must have been generated for the messages alphabet, its marker is skipped like the messages
+            if (!binaryMode) {
+                int keyMarker = fgetc(keyFilePointer);
+                if (findAlphabetByMarker((char) keyMarker) != alphabet) {
+                    fprintf(stderr, "Key was not generated for the %s alphabet.\n", alphabet->name);
+                    exit(1);
+                }
+                if (alphabet->marker == '\0') {
+                    ungetc(keyMarker, keyFilePointer);
+                }
+            }
+
+            // Throw error if key file is not equal to or larger than the message to be decrypted. Text keys end
+            // with a newline and carry the same marker as the message, binary keys and messages are raw bytes.
+            long long needed = fileSizeInt;
+            if (binaryMode) {
+                needed = fileSizeInt - 2;
+            }
+            if (keySize < needed) {
+                fprintf(stderr, "Key must be the same size or larger than the file being decrypted.\n");
+                exit(1);
+            }
+        }
+        if (encryptedCount == 0) {
+            continue;
+        }
+
+        // Read the key range matching this chunk
+        if (fread(keyBuffer, 1, encryptedCount, keyFilePointer) != encryptedCount) {
+            fprintf(stderr, "Key must be the same size or larger than the file being decrypted.\n");
+            exit(1);
         }
 
-        // If the current position is a space, set to value of 91
-        if (messageLineRead[i] == ' ') {
-            asciiMsgChar = 91 - 65;
+        if (binaryMode) {
+            xorChunk((unsigned char*) plainBuffer, (unsigned char*) encrypted, (unsigned char*) keyBuffer,
+                     encryptedCount);
         }
-        // Otherwise, set the value of the capital letter
         else {
-            asciiMsgChar = (int) messageLineRead[i] - 65;
+            // Decrypt chunk, checking that both only contain characters of the alphabet
+            if (memchr(keyBuffer, '\n', encryptedCount) != NULL) {
+                fprintf(stderr, "Key must be the same size or larger than the file being decrypted.\n");
+                exit(1);
+            }
+            if (alphabet->decrypt(plainBuffer, encrypted, keyBuffer, encryptedCount) != 0) {
+                fprintf(stderr, "Input provided has an invalid character.\n");
+                exit(1);
+            }
         }
+        fwrite(plainBuffer, 1, encryptedCount, plainOutput);
+    }
 
-        // Determine new character value based on encryption technique (otp)
-        int newChar = (asciiKeyChar + asciiMsgChar) % 27;
+    if (binaryMode != 1) {
+        fprintf(plainOutput, "\n");
+    }
 
-        // Determine new ASCII character
-        newChar = 65 + newChar;
+    if (hasChecksum && crc != expectedCrc) {
+        fprintf(stderr, "Message failed its integrity check (CRC32C %08x, expected %08x).\n", crc, expectedCrc);
+        exit(1);
+    }
 
-        // If the new ASCII value is 91, set to space ASCII of 32 as 91 will represent a space
-        if (newChar == 91) {
-            newChar = 32;
-        }
-        // If the character found is larger than 91, then wrap around to the beginning of the capital letter ASCII
-        // values.
-        else if (newChar > 91) {
-            newChar = newChar - 27;
+    // Release the verified message
+    if (plainOutput != output) {
+        size_t bytesRead = 0;
+        rewind(plainOutput);
+        while ((bytesRead = fread(plainBuffer, 1, STREAM_CHUNK_SIZE, plainOutput)) > 0) {
+            if (fwrite(plainBuffer, 1, bytesRead, output) != bytesRead) {
+                break;
+            }
         }
+        fclose(plainOutput);
+    }
+    if (fflush(output) != 0 || ferror(output)) {
+        fprintf(stderr, "Could not write the decrypted message.\n");
+        exit(1);
+    }
+
+    // Close key file and free buffers
+    fclose(keyFilePointer);
+    free(readBuffer);
+    free(keyBuffer);
+    free(plainBuffer);
+}
+
+// Checks that a binary key is at least as large as the file to be encrypted with it.
+// Pre-conditions: Must be passed the names of the key and the file to encrypt.
+// Post-conditions: If either file cannot be opened or the key is too small, an error is output to stderr and otp
+// exits.
+void checkBinaryKey(char* key, char* fileName) {
+    struct stat keyAttributes;
+    struct stat fileAttributes;
 
-        // Set character
-        encryptedMessage[i] = (char) newChar;
+    if (stat(key, &keyAttributes) != 0 || stat(fileName, &fileAttributes) != 0) {
+        fprintf(stderr, "Key or file to encrypt could not be opened.\n");
+        exit(1);
     }
 
-    return encryptedMessage;
+    // Throw error if key file is not equal to or larger than the file being encrypted
+    if (keyAttributes.st_size < fileAttributes.st_size) {
+        fprintf(stderr, "Key must be the same size or larger than the file being encrypted.\n");
+        exit(1);
+    }
 }
 
-// Decrypt the provided message passed as a parameter and return it. Message is decrypted based on provided key.
-// Pre-conditions: The parameter of the name of a key file and a string of the encrypted message.
-// Post-conditions: If successful, the encrypted message is decrypted and returned by function. Errors
-// are returned to stderr where applicable.
-char* decryptMessage(char* key, char* encryptedMessage) {
-    char dirPath[256];
-    memset(dirPath, '\0', 256);
-    // Get the current working directory
-    getcwd(dirPath, 256);
+// Encrypts a file of arbitrary bytes with a binary key and sends it to otp_d as it is encrypted. The message is
+// marked with MODE_BINARY so the recipient decrypts it as raw bytes. A resumed chunked upload starts at offset
+// within the message (the marker is its first byte).
+// Pre-conditions: Must be passed a valid/open socket connection, the names of a key checked by checkBinaryKey
+// and of the file to encrypt, and the offset to start at.
+// Post-conditions: The marker and the encrypted file are sent over the socket connection to otp_d. Returns 0 if all
+// of it was sent, otherwise -1.
+int sendBinaryMessage(int socket, char* key, char* fileName, long long offset) {
+    FILE* keyFilePointer = openWorkingFile(key);
+    FILE* textFilePointer = fopen(fileName, "r");
+
+    if (keyFilePointer == NULL || textFilePointer == NULL) {
+        fprintf(stderr, "Key or file to encrypt could not be opened.\n");
+        exit(1);
+    }
 
-    // Declare pointer for key file to be opened
-    FILE* keyFilePointer;
+    unsigned char* messageBuffer = malloc(STREAM_CHUNK_SIZE);
+    unsigned char* keyBuffer = malloc(STREAM_CHUNK_SIZE);
+    unsigned char marker = MODE_BINARY;
 
-    // Determine path to key file and open key file to be read from
-    char pathName[256];
-    memset(pathName, '\0', 256);
-    strcat(pathName, dirPath);
-    strcat(pathName, "/");
-    strcat(pathName, key);
-    keyFilePointer = fopen(pathName, "r");
+    int result = 0;
+    if (offset == 0) {
+        result = sendBuffer(socket, (char*) &marker, 1);
+    }
+    else {
+        fseeko(keyFilePointer, offset - 1, SEEK_SET);
+        fseeko(textFilePointer, offset - 1, SEEK_SET);
+    }
 
-    char keyLineRead[100000];
-    memset(keyLineRead, '\0', 100000);
-    // Read line from key file to encrypt with
-    fgets(keyLineRead, 100000, keyFilePointer);
+    // Encrypt and send one chunk at a time
+    size_t bytesRead = 0;
+    while (result == 0 && (bytesRead = fread(messageBuffer, 1, STREAM_CHUNK_SIZE, textFilePointer)) > 0) {
+        if (fread(keyBuffer, 1, bytesRead, keyFilePointer) != bytesRead) {
+            fprintf(stderr, "Key must be the same size or larger than the file being encrypted.\n");
+            exit(1);
+        }
+
+        xorChunk(messageBuffer, messageBuffer, keyBuffer, bytesRead);
+        result = sendBuffer(socket, (char*) messageBuffer, bytesRead);
+    }
 
-    // Close file after read
     fclose(keyFilePointer);
+    fclose(textFilePointer);
+    free(messageBuffer);
+    free(keyBuffer);
 
-    // Get message and key lengths and compare sizes
-    int keyLen = strlen(keyLineRead);
-    int messageLen = strlen(encryptedMessage);
+    return result;
+}
 
-    // Throw error if key file is not equal to or larger than the message to be decrypted
-    if (keyLen < messageLen) {
-        fprintf(stderr, "Key must be the same size or larger than the file being decrypted.\n");
-        exit(1);
+// Hashes a string onto the 64 bit ring used for cluster routing (FNV-1a followed by a final avalanche mix so that
+// similar names such as virtual node labels spread evenly).
+// Pre-conditions: Must be passed a string.
+// Post-conditions: Returns the hash of the string.
+unsigned long long hashString(char* string) {
+    unsigned long long hash = 14695981039346656037ULL;
+    while (*string != '\0') {
+        hash = (hash ^ (unsigned char) *string) * 1099511628211ULL;
+        string++;
     }
 
-    // Check that key file and message do not have any out of place characters that are not allowed.
-    // Outputs error to stderr if found and exits with 1. This should not occur, but is an extra check.
-    checkCharacters(keyLineRead);
-    checkCharacters(encryptedMessage);
+    hash = (hash ^ (hash >> 33)) * 0xff51afd7ed558ccdULL;
+    hash = (hash ^ (hash >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+    return hash ^ (hash >> 33);
+}
 
-    // Set aside location in memory for decrypted message. This will be returned after decryption.
-    char* decryptedMessage = malloc(sizeof(char) * (messageLen + 5));
-    memset(decryptedMessage, '\0', (messageLen + 5));
+// Orders ring points by hash for qsort.
+// Pre-conditions: Both parameters point to ringPoint structures.
+// Post-conditions: Returns negative, zero or positive.
+int compareRingPoints(const void* first, const void* second) {
+    const struct ringPoint* a = first;
+    const struct ringPoint* b = second;
+
+    if (a->hash != b->hash) {
+        return a->hash < b->hash ? -1 : 1;
+    }
+    return a->member - b->member;
+}
+
+// Parses an otp_d address given as <port> (on this host) or <host>:<port>.
+// Pre-conditions: Must be passed the address text and a member to fill in.
+// Post-conditions: Returns 0 and fills in member if the address is valid, otherwise -1.
+int parseMember(char* text, struct clusterMember* member) {
+    char* portText = text;
+    memset(member->host, '\0', 256);
+    strcpy(member->host, "127.0.0.1");
+
+    char* colon = strrchr(text, ':');
+    if (colon != NULL) {
+        if (colon == text || colon - text >= 256) {
+            return -1;
+        }
+        memcpy(member->host, text, colon - text);
+        member->host[colon - text] = '\0';
+        portText = colon + 1;
+    }
 
     int i;
-    // Decrypt message and store in new variable
-    for (i = 0; i < messageLen - 1; i++) {
-        int asciiMsgChar = 0;
-        int asciiKeyChar = 0;
-        // Get ascii values of characters for key and message to encrypt
-        // If the current position is a space, set to value of 91
-        if (keyLineRead[i] == ' ') {
-            asciiKeyChar = 91 - 65;
-        }
-        // Otherwise perform calculation to determine what character based on an encountered capital letter.
-        else {
-            asciiKeyChar = (int) keyLineRead[i] - 65;
+    // Check if all values in port are integers
+    for (i = 0; i < strlen(portText); i++) {
+        if (!isdigit(portText[i])) {
+            return -1;
         }
+    }
+
+    member->port = atoi(portText);
+    if (strlen(portText) == 0 || member->port <= 0 || member->port > 65535) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Loads a cluster membership file. Each non-empty line not starting with # names one otp_d node as <port> or
+// <host>:<port>. Every node must be listed in the same order by all clients.
+// Pre-conditions: Must be passed the name of the file and an array of MAX_MEMBERS members.
+// Post-conditions: Returns the number of members loaded. Errors are output to stderr and exit otp.
+int loadCluster(char* fileName, struct clusterMember* members) {
+    FILE* clusterFile = fopen(fileName, "r");
+    if (clusterFile == NULL) {
+        fprintf(stderr, "Port must be a port number, host:port or a cluster membership file.\n");
+        exit(1);
+    }
 
-        // If the current position is a space, set to value of 91
-        if (encryptedMessage[i] == ' ') {
-            asciiMsgChar = 91 - 65;
+    int count = 0;
+    char line[300];
+    while (fgets(line, 300, clusterFile) != NULL) {
+        // Strip newline and surrounding blanks
+        line[strcspn(line, "\r\n")] = '\0';
+        char* text = line;
+        while (*text == ' ' || *text == '\t') {
+            text++;
         }
-        // Otherwise perform calculation to determine what character based on an encountered capital letter.
-        else {
-            asciiMsgChar = (int) encryptedMessage[i] - 65;
+        char* end = text + strlen(text);
+        while (end > text && (end[-1] == ' ' || end[-1] == '\t')) {
+            end--;
         }
+        *end = '\0';
 
-        // Determine new character value based on encryption technique (otp)
-        int newChar = (asciiMsgChar - asciiKeyChar) % 27;
+        if (*text == '\0' || *text == '#') {
+            continue;
+        }
+        if (count == MAX_MEMBERS || parseMember(text, &members[count]) != 0) {
+            fprintf(stderr, "Invalid cluster member %s in %s.\n", text, fileName);
+            exit(1);
+        }
+        count++;
+    }
+    fclose(clusterFile);
+
+    if (count == 0) {
+        fprintf(stderr, "Cluster membership file %s lists no members.\n", fileName);
+        exit(1);
+    }
+
+    return count;
+}
 
-        // Determine new ASCII character
-        newChar = 65 + newChar;
+// Places every member on the consistent hash ring at VIRTUAL_NODES points, labelled <host>:<port>#<n>.
+// Pre-conditions: Must be passed the members and their count.
+// Post-conditions: Returns the count * VIRTUAL_NODES ring points sorted by hash, to be freed by the caller.
+struct ringPoint* buildRing(struct clusterMember* members, int count) {
+    struct ringPoint* ring = malloc(sizeof(struct ringPoint) * count * VIRTUAL_NODES);
 
-        // If the new ASCII value is 64, set to space ASCII of 32 as 64 represents space
-        if (newChar == 64 || newChar == 91) {
-            newChar = 32;
+    int i;
+    int j;
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < VIRTUAL_NODES; j++) {
+            char label[300];
+            snprintf(label, 300, "%s:%d#%d", members[i].host, members[i].port, j);
+            ring[i * VIRTUAL_NODES + j].hash = hashString(label);
+            ring[i * VIRTUAL_NODES + j].member = i;
         }
-        // Otherwise treat as a capital letter and add 27 to determine the decrypted character.
-        else if (newChar < 65) {
-            newChar = newChar + 27;
+    }
+    qsort(ring, count * VIRTUAL_NODES, sizeof(struct ringPoint), compareRingPoints);
+
+    return ring;
+}
+
+// Loads the nodes of a target argument, which is a port on this host, a <host>:<port> address or the name of a
+// cluster membership file. The ring of a cluster is built here once, so routing many users only searches it.
+// Pre-conditions: Must be passed the target argument and a route to fill in.
+// Post-conditions: Route holds the nodes, to be released with freeRoute. Errors are output to stderr and exit otp.
+void loadRoute(char* target, struct clusterRoute* route) {
+    struct stat targetAttributes;
+
+    // A plain address unless a file of that name exists
+    if (stat(target, &targetAttributes) != 0) {
+        int i;
+        int isNumber = 1;
+        for (i = 0; i < strlen(target); i++) {
+            isNumber = isNumber && isdigit(target[i]);
         }
 
-        // Set decrypted character to decryptedMessage
-        decryptedMessage[i] = (char) newChar;
+        if (isNumber || strchr(target, ':') != NULL) {
+            route->members = malloc(sizeof(struct clusterMember));
+            route->count = 1;
+            route->ring = NULL;
+
+            // Keep the original message for plain port arguments
+            if (parseMember(target, route->members) != 0 && isNumber) {
+                fprintf(stderr, "Port number must be in a valid range of values (1 through 65535).\n");
+                exit(1);
+            }
+            else if (parseMember(target, route->members) != 0) {
+                fprintf(stderr, "Address must be given as host:port with a valid port.\n");
+                exit(1);
+            }
+            return;
+        }
     }
 
-    return decryptedMessage;
+    route->members = malloc(sizeof(struct clusterMember) * MAX_MEMBERS);
+    route->count = loadCluster(target, route->members);
+    route->ring = buildRing(route->members, route->count);
 }
 
-// Initiate a socket connection based on port value passed as parameter.
-// Pre-conditions: Must be passed a valid port integer value as parameter.
+// Releases the nodes and ring of a route.
+// Pre-conditions: Route must have been filled in by loadRoute.
+// Post-conditions: Memory held by the route is freed.
+void freeRoute(struct clusterRoute* route) {
+    free(route->members);
+    free(route->ring);
+}
+
+// Finds the member owning a user with consistent hashing. The user belongs to the first ring point at or after the
+// hash of its name, so adding or removing one of N members only moves about 1/N of the users.
+// Pre-conditions: Must be passed a route filled in by loadRoute and the users name.
+// Post-conditions: Returns the index of the owning member.
+int routeUser(struct clusterRoute* route, char* user) {
+    if (route->ring == NULL) {
+        return 0;
+    }
+
+    // Binary search for the first point at or after the users hash, wrapping around to the first point
+    int pointCount = route->count * VIRTUAL_NODES;
+    unsigned long long userHash = hashString(user);
+    int low = 0;
+    int high = pointCount;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (route->ring[middle].hash < userHash) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+
+    return route->ring[low == pointCount ? 0 : low].member;
+}
+
+// Determines which otp_d to contact for a user. The target argument is a port on this host, a <host>:<port>
+// address or the name of a cluster membership file, in which case the user is routed to its owning node.
+// Pre-conditions: Must be passed the target argument, the users name and a member to fill in.
+// Post-conditions: Member holds the address to connect to. Errors are output to stderr and exit otp.
+void resolveTarget(char* target, char* user, struct clusterMember* result) {
+    struct clusterRoute route;
+    loadRoute(target, &route);
+    *result = route.members[routeUser(&route, user)];
+    freeRoute(&route);
+}
+
+// Initiate a socket connection to the otp_d at the host and port passed as parameters.
+// Pre-conditions: Must be passed a host name or address and a valid port integer value as parameters.
 // Post-conditions: Connection is established with otp_d if successful and socket connection value is returned.
 // If unsuccessful a corresponding message is output to stderr.
-int initiateConnection(int port) {
-    struct sockaddr_in serv_addr;
+int initiateConnection(char* host, int port) {
+    // In an agent request, use a connection the agent already opened
+    int i;
+    for (i = 0; agentPool != NULL && i < agentNodeCount * AGENT_POOL_SIZE; i++) {
+        struct warmConnection* slot = &agentPool[i];
+        struct clusterMember* node = &agentNodes[i / AGENT_POOL_SIZE];
+        if (node->port == port && strcmp(node->host, host) == 0 && slot->socket >= 0 &&
+            slot->epoch <= agentForkEpoch && __atomic_exchange_n(&slot->claimed, 1, __ATOMIC_ACQ_REL) == 0) {
+            return slot->socket;
+        }
+    }
+
+    struct addrinfo hints;
+    struct addrinfo* serv_addr = NULL;
     int clientSocket;
+    char portText[10];
 
     // Attempt to create the socket, if failed output error to stderr and exit.
     if ((clientSocket = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
@@ -324,33 +843,275 @@ int initiateConnection(int port) {
         exit(1);
     }
 
-    // Set sin_family and sin_port (based on provided port value) of the socket
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(port);
-
-    // Attempt to convert address string to AF_INET network address
+    // Attempt to resolve the host and port to an AF_INET network address
     // structure. If unsuccessful, outputs error to stderr and exits.
-    if(inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr) <= 0) {
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    sprintf(portText, "%d", port);
+    if (getaddrinfo(host, portText, &hints, &serv_addr) != 0) {
         fprintf(stderr, "Invalid address\n");
         exit(1);
     }
 
     // Attempt connection with given attributes. If unsuccessful return error to stderr and exit.
     // If successful, clientSocket is ready for use and is returned.
-    if (connect(clientSocket, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+    if (connect(clientSocket, serv_addr->ai_addr, serv_addr->ai_addrlen) < 0) {
         fprintf(stderr, "Connection Failed\n");
         exit(1);
     }
+    freeaddrinfo(serv_addr);
 
     return clientSocket;
 }
 
-// Takes 5 arguments for a post request and 4 arguments for a get request. The main function primarily acts in
+// Connects to otp_d and performs the handshake, sending the command and then the user and waiting for each to be
+// acknowledged.
+// Pre-conditions: Must be passed the otp_d node, the command and the users name.
+// Post-conditions: Returns the connected socket. Exits if the connection fails.
+int openSession(struct clusterMember* target, char* command, char* user) {
+    // Initiate connection with server through port provided
+    int socket = initiateConnection(target->host, target->port);
+    char readBuffer[17];
+
+    // Send command message and wait for acceptance message (command)
+    send(socket, command, strlen(command), 0);
+    memset(readBuffer, '\0', 17);
+    int received = recv(socket, readBuffer, 16, 0);
+
+    // A warm connection of the agent may have been closed by otp_d already, the next one (and finally a new
+    // connection, once the pool is used up) is tried instead
+    int attempt;
+    for (attempt = 0; received <= 0 && agentPool != NULL && attempt < AGENT_POOL_SIZE; attempt++) {
+        close(socket);
+        socket = initiateConnection(target->host, target->port);
+        send(socket, command, strlen(command), 0);
+        memset(readBuffer, '\0', 17);
+        received = recv(socket, readBuffer, 16, 0);
+    }
+
+    // Send user and wait for acceptance message (user)
+    send(socket, user, strlen(user), 0);
+    memset(readBuffer, '\0', 17);
+    recv(socket, readBuffer, 13, 0);
+
+    return socket;
+}
+
+// Derives the id of a chunked upload from the user, the message and key files and the mode, so running the same
+// command again after an interruption resumes the same upload while any change to the files starts a new one.
+// Pre-conditions: Must be passed the users name, the file to encrypt and key names, the marker of the message
+// (0 for an unmarked text message) and a buffer of 17 characters.
+// Post-conditions: Upload id is stored in the buffer as 16 hex digits.
+void makeUploadId(char* user, char* fileName, char* key, int mode, char* uploadId) {
+    struct stat fileAttributes;
+    struct stat keyAttributes;
+    memset(&fileAttributes, 0, sizeof(fileAttributes));
+    memset(&keyAttributes, 0, sizeof(keyAttributes));
+    stat(fileName, &fileAttributes);
+    stat(key, &keyAttributes);
+
+    char* description = malloc(strlen(user) + strlen(fileName) + strlen(key) + 128);
+    sprintf(description, "%s|%s|%lld|%ld|%s|%lld|%ld|%d", user, fileName, (long long) fileAttributes.st_size,
+            (long) fileAttributes.st_mtime, key, (long long) keyAttributes.st_size, (long) keyAttributes.st_mtime,
+            mode);
+    sprintf(uploadId, "%016llx", hashString(description));
+    free(description);
+}
+
+// Receives one newline terminated reply from otp_d.
+// Pre-conditions: Must be passed a valid/open socket connection and a buffer of max bytes.
+// Post-conditions: Reply is stored without its newline. Returns -1 if the connection closed first.
+int receiveReply(int socket, char* reply, int max) {
+    int length = 0;
+    while (length < max - 1) {
+        if (recv(socket, reply + length, 1, 0) != 1) {
+            return -1;
+        }
+        if (reply[length] == '\n') {
+            break;
+        }
+        length++;
+    }
+    reply[length] = '\0';
+
+    return 0;
+}
+
+// Performs one attempt of a chunked upload on a connection that finished the chunk handshake. otp_d answers the
+// upload header with the offset it already holds and the message is sent from there, or with "COMPLETE" if an
+// earlier attempt already published it.
+// Pre-conditions: Must be passed a valid/open socket, the upload id and total message size, the alphabet of a text
+// message (NULL in binary mode) and the key and file names.
+// Post-conditions: Returns 1 once otp_d published the message, 0 if the attempt was interrupted and may be retried
+// and -1 if the upload was rejected.
+int sendChunkedMessage(int socket, char* uploadId, long long totalSize, const struct alphabetPolicy* alphabet,
+                       char* key, char* fileName, char* user) {
+    char reply[64];
+    char header[64];
+    long long offset = 0;
+
+    sprintf(header, "%s %lld\n", uploadId, totalSize);
+    if (sendBuffer(socket, header, strlen(header)) != 0 || receiveReply(socket, reply, 64) != 0) {
+        return 0;
+    }
+    if (strncmp(reply, "QUOTA_EXCEEDED", 14) == 0) {
+        fprintf(stderr, "Post rejected: mailbox quota exceeded for %s.\n", user);
+        return -1;
+    }
+    if (strcmp(reply, "COMPLETE") == 0) {
+        return 1;
+    }
+    if (sscanf(reply, "OFFSET %lld", &offset) != 1 || offset < 0 || offset > totalSize) {
+        return 0;
+    }
+    if (offset > 0) {
+        fprintf(stderr, "Resuming upload %s at %lld of %lld bytes.\n", uploadId, offset, totalSize);
+    }
+
+    int result = 0;
+    if (alphabet != NULL) {
+        result = sendTextMessage(socket, alphabet, key, fileName, totalSize, offset);
+    }
+    else {
+        result = sendBinaryMessage(socket, key, fileName, offset);
+    }
+
+    if (result != 0 || receiveReply(socket, reply, 64) != 0 || strcmp(reply, "COMPLETE") != 0) {
+        return 0;
+    }
+
+    return 1;
+}
+
+// Sends a post or fan-out message on a connection that finished its handshake and waits for otp_d to accept it.
+// Pre-conditions: Must be passed a valid/open socket, the alphabet of a text message (NULL in binary mode), its
+// size as checkTextMessage returned, the key and file names, and the user (or recipients) for messages.
+// Post-conditions: Message is sent. If otp_d rejects it, the reason is output to stderr and otp exits.
+void sendPost(int socket, const struct alphabetPolicy* alphabet, long long textSize, char* key, char* fileName,
+              char* user) {
+    char readBuffer[15];
+
+    // Send encrypted message to server over provided socket. A rejected post may have the connection closed
+    // under it, so a broken pipe must not kill otp before the reason is read.
+    signal(SIGPIPE, SIG_IGN);
+    if (alphabet == NULL) {
+        sendBinaryMessage(socket, key, fileName, 0);
+    }
+    else {
+        sendTextMessage(socket, alphabet, key, fileName, textSize, 0);
+    }
+
+    // Signal end of message and wait for otp_d to finish with it. otp_d only replies if the post is rejected
+    // or, for a fan-out, not stored for every recipient (in which case no recipient keeps it).
+    shutdown(socket, SHUT_WR);
+    memset(readBuffer, '\0', 15);
+    recv(socket, readBuffer, 14, 0);
+    if (strcmp(readBuffer, "QUOTA_EXCEEDED") == 0) {
+        fprintf(stderr, "Post rejected: mailbox quota exceeded for %s.\n", user);
+        exit(1);
+    }
+    else if (strcmp(readBuffer, "STORE_FULL") == 0) {
+        fprintf(stderr, "Post rejected: server memory store is full.\n");
+        exit(1);
+    }
+    else if (strcmp(readBuffer, "WRITE_FAILED") == 0) {
+        fprintf(stderr, "Post rejected: server could not write the message.\n");
+        exit(1);
+    }
+    else if (strcmp(readBuffer, "FANOUT_FAILED") == 0) {
+        fprintf(stderr, "Post could not be stored for every one of %s, none of them received it.\n", user);
+        exit(1);
+    }
+}
+
+// Posts one message to several users, uploading it once to each otp_d that owns any of them. Recipients are routed
+// like single users (see resolveTarget), over a route loaded once for all of them, and grouped by node, each group
+// is sent as a fan command whose user is the comma separated list of its recipients.
+// Pre-conditions: Must be passed the comma separated recipients, the port argument, the alphabet of a text message
+// (NULL in binary mode) and its size, and the key and file names.
+// Post-conditions: Every node has received the message for its recipients. Exits on error.
+void sendFanout(char* recipientList, char* target, const struct alphabetPolicy* alphabet, long long textSize,
+                char* key, char* fileName) {
+    struct clusterMember* nodes = malloc(sizeof(struct clusterMember) * MAX_MEMBERS);
+    char** groups = malloc(sizeof(char*) * MAX_MEMBERS);
+    int nodeCount = 0;
+
+    struct clusterRoute route;
+    loadRoute(target, &route);
+
+    char* list = strdup(recipientList);
+    char* recipient = strtok(list, ",");
+    while (recipient != NULL) {
+        struct clusterMember owner = route.members[routeUser(&route, recipient)];
+
+        // Add the recipient to the group of its node
+        int i;
+        for (i = 0; i < nodeCount; i++) {
+            if (strcmp(nodes[i].host, owner.host) == 0 && nodes[i].port == owner.port) {
+                break;
+            }
+        }
+        if (i == nodeCount) {
+            nodes[nodeCount] = owner;
+            groups[nodeCount] = calloc(1, FANOUT_LIST_MAX);
+            nodeCount++;
+        }
+        if (strlen(groups[i]) + strlen(recipient) + 2 > FANOUT_LIST_MAX) {
+            fprintf(stderr, "Too many recipients for one otp_d, the list must be under %d characters.\n",
+                    FANOUT_LIST_MAX);
+            exit(1);
+        }
+        if (groups[i][0] != '\0') {
+            strcat(groups[i], ",");
+        }
+        strcat(groups[i], recipient);
+
+        recipient = strtok(NULL, ",");
+    }
+
+    int i;
+    for (i = 0; i < nodeCount; i++) {
+        int socket = openSession(&nodes[i], "fan", groups[i]);
+        sendPost(socket, alphabet, textSize, key, fileName, groups[i]);
+        close(socket);
+        free(groups[i]);
+    }
+
+    free(list);
+    free(groups);
+    free(nodes);
+    freeRoute(&route);
+}
+
+// Takes 5 arguments for a post, chunk or fan request (preceded by -b for binary mode), 4 (or 5 with an output file)
+// arguments for a get request and 3 for a route request. A chunk request is a post that survives lost connections:
+// it is retried up to CHUNK_ATTEMPTS times, and running the same command again resumes where the upload stopped.
+// A fan request posts one message to a comma separated list of users. The main function primarily acts in
 // validating arguments received by command line and then acts as a driver function to call the relevant functions
 // required for a post process and a get process, depending on which is requested.
-int main(int argc, char* argv[]) {
+int runOtp(int argc, char* argv[]) {
+    // A leading -b selects binary mode for a post, -a the alphabet of a text post. Gets detect the mode and
+    // alphabet from the message itself.
+    int binaryMode = 0;
+    const struct alphabetPolicy* alphabet = &alphabetPolicies[0];
+    if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+        binaryMode = 1;
+        argv++;
+        argc--;
+    }
+    else if (argc > 2 && strcmp(argv[1], "-a") == 0) {
+        alphabet = findAlphabet(argv[2]);
+        if (alphabet == NULL) {
+            fprintf(stderr, "Unknown alphabet %s.\n", argv[2]);
+            exit(1);
+        }
+        argv = argv + 2;
+        argc = argc - 2;
+    }
+
     //Check to see that correct number of arguments are included, if not throw error
-    if (argc < 5 || argc > 6) {
+    if ((argc < 5 || argc > 6) && !(argc == 4 && strcmp(argv[1], "route") == 0)) {
         fprintf(stderr, "Invalid number of arguments provided. Must provide 4 with get or 5 with post.\n");
         exit(1);
     }
@@ -361,7 +1122,7 @@ int main(int argc, char* argv[]) {
     int portPos = 0;
 
     // Check if post set position of port and key/filename arguments.
-    if (strcmp(argv[1], "post") == 0) {
+    if (strcmp(argv[1], "post") == 0 || strcmp(argv[1], "chunk") == 0 || strcmp(argv[1], "fan") == 0) {
         portPos = 5;
 
         key = argv[4];
@@ -373,77 +1134,497 @@ int main(int argc, char* argv[]) {
 
         key = argv[3];
     }
-
-    int i;
-    // Check if all values in port argument are integers and output error/exit if not
-    for (i = 0; i < strlen(argv[portPos]); i++) {
-        if (!isdigit(argv[portPos][i])) {
-            fprintf(stderr, "Port number argument can only be an integer value.\n");
-            exit(1);
-        }
+    //Check if route and set position of port argument.
+    else if (strcmp(argv[1], "route") == 0) {
+        portPos = 3;
     }
-
-    //Set port from command argument
-    int port = atoi(argv[portPos]);
-
-    //If port number is invalid range, throw error
-    if (port <= 0 || port > 65535) {
-        fprintf(stderr, "Port number must be in a valid range of values (1 through 65535).\n");
+    else {
+        fprintf(stderr, "Command must be get, post, chunk, fan or route.\n");
         exit(1);
     }
 
-    char* encryptedMsg = NULL;
-    // If post command, encrypt message based on key
-    if (strcmp(argv[1], "post") == 0) {
-        encryptedMsg = encryptMessage(key, fileName);
+    // Determine the otp_d to use from the port argument, routing the user when it is a cluster membership file
+    struct clusterMember target;
+    resolveTarget(argv[portPos], user, &target);
+
+    // Route only reports the owning node
+    if (strcmp(argv[1], "route") == 0) {
+        printf("%s:%d\n", target.host, target.port);
+        return 0;
     }
 
-    // Initiate connection with server through port provided
-    int socket = initiateConnection(port);
+    // If post or chunk command, check the message and key before connecting. Messages are encrypted as they are sent.
+    long long textSize = 0;
+    int posting = portPos == 5;
+    if (binaryMode) {
+        alphabet = NULL;
+    }
+    if (posting && binaryMode) {
+        checkBinaryKey(key, fileName);
+    }
+    else if (posting) {
+        textSize = checkTextMessage(alphabet, key, fileName);
+    }
 
-    // Send command message
-    send(socket, argv[1], strlen(argv[1]), 0);
+    // Fan-out posts make one connection per node of their recipients
+    if (strcmp(argv[1], "fan") == 0) {
+        sendFanout(user, argv[portPos], alphabet, textSize, key, fileName);
+        return 0;
+    }
 
-    // Buffer receives message
-    char* readBuffer = malloc(sizeof(char) * 1024);
-    memset(readBuffer, '\0', sizeof(char) * 1024);
+    // Chunked uploads reconnect as often as needed and never use the single connection below
+    if (strcmp(argv[1], "chunk") == 0) {
+        struct stat fileAttributes;
+        char uploadId[17];
+        long long totalSize = 0;
+        if (binaryMode) {
+            stat(fileName, &fileAttributes);
+            totalSize = fileAttributes.st_size + 1;
+        }
+        else {
+            totalSize = textSize;
+        }
+        makeUploadId(user, fileName, key, binaryMode ? MODE_BINARY : alphabet->marker, uploadId);
+
+        signal(SIGPIPE, SIG_IGN);
+        int attempt;
+        for (attempt = 0; attempt < CHUNK_ATTEMPTS; attempt++) {
+            int socket = openSession(&target, "chunk", user);
+            int result = sendChunkedMessage(socket, uploadId, totalSize, alphabet, key, fileName, user);
+            close(socket);
+            if (result == 1) {
+                return 0;
+            }
+            if (result == -1) {
+                exit(1);
+            }
+            sleep(1);
+        }
 
-    // Wait for acceptance message (command)
-    recv(socket, readBuffer, 16, 0);
+        fprintf(stderr, "Upload %s interrupted, run the same command again to resume it.\n", uploadId);
+        exit(1);
+    }
 
-    // Send user
-    send(socket, user, strlen(user), 0);
+    // Connect to otp_d and send the command and user
+    int socket = openSession(&target, argv[1], user);
 
-    // Buffer reset to receive message again
+    // Buffer receives message
+    char* readBuffer = malloc(sizeof(char) * 1024);
     memset(readBuffer, '\0', sizeof(char) * 1024);
 
-    // Wait for acceptance message (user)
-    recv(socket, readBuffer, 13, 0);
-
     // If operating in post mode, send encrypted message
     if (strcmp(argv[1], "post") == 0) {
-        // Send encrypted message to server over provided socket
-        sendMessage(socket, encryptedMsg);
+        sendPost(socket, alphabet, textSize, key, fileName, user);
     }
-    // If operating in get mode, receive encrypted message and decrypt it
+    // If operating in get mode, receive encrypted message and decrypt it to stdout or the output file provided
     else if (strcmp(argv[1], "get") == 0) {
-        encryptedMsg = receiveEncryptedMessage(socket);
-
-        // If the encrypted message is not empty, then decrypt the message and output to stdout.
-        if (strcmp(encryptedMsg, "") != 0) {
-            char *decryptedMsg = NULL;
-            // Decrypt message based on key
-            decryptedMsg = decryptMessage(key, encryptedMsg);
+        FILE* output = stdout;
+        if (argc == 6) {
+            output = fopen(argv[5], "w");
+            if (output == NULL) {
+                fprintf(stderr, "Could not open output file %s.\n", argv[5]);
+                exit(1);
+            }
+        }
 
-            printf("%s\n", decryptedMsg);
+        receiveDecryptedMessage(socket, key, output);
 
-            free(decryptedMsg);
+        if (output != stdout) {
+            fclose(output);
         }
     }
 
     // Free read buffer memory before exit
     free(readBuffer);
-    free(encryptedMsg);
 
     return 0;
-}
\ No newline at end of file
+}
+
+// Loads a key pad into the agent, mapping the key file the first time it is used and again whenever it changes.
+// When the table is full the least recently used pad is replaced.
+// Pre-conditions: Must be passed the path of a key as openWorkingFile builds it.
+// Post-conditions: Key is mapped in agentKeys if it could be opened.
+void loadKeyPad(char* path) {
+    struct stat keyAttributes;
+    if (strlen(path) >= sizeof(agentKeys[0].path) || stat(path, &keyAttributes) != 0 || keyAttributes.st_size == 0) {
+        return;
+    }
+
+    int i;
+    int slot = 0;
+    for (i = 0; i < AGENT_KEYS; i++) {
+        if (agentKeys[i].data != NULL && strcmp(agentKeys[i].path, path) == 0) {
+            slot = i;
+            break;
+        }
+        if (agentKeys[i].lastUsed < agentKeys[slot].lastUsed) {
+            slot = i;
+        }
+    }
+    agentKeyClock++;
+
+    struct keyPad* pad = &agentKeys[slot];
+    if (pad->data != NULL && strcmp(pad->path, path) == 0 && pad->device == keyAttributes.st_dev &&
+        pad->inode == keyAttributes.st_ino && pad->size == keyAttributes.st_size &&
+        pad->modified == keyAttributes.st_mtime) {
+        pad->lastUsed = agentKeyClock;
+        return;
+    }
+
+    // Replace whatever the slot held
+    if (pad->data != NULL) {
+        munmap(pad->data, pad->size);
+        pad->data = NULL;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    char* data = mmap(NULL, keyAttributes.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return;
+    }
+
+    strcpy(pad->path, path);
+    pad->device = keyAttributes.st_dev;
+    pad->inode = keyAttributes.st_ino;
+    pad->size = keyAttributes.st_size;
+    pad->modified = keyAttributes.st_mtime;
+    pad->data = data;
+    pad->lastUsed = agentKeyClock;
+}
+
+// Connects to an otp_d without exiting on failure, for the agent's pool.
+// Pre-conditions: Must be passed a host and port.
+// Post-conditions: Returns the connected socket or -1.
+int connectNode(char* host, int port) {
+    struct addrinfo hints;
+    struct addrinfo* serv_addr = NULL;
+    char portText[10];
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    sprintf(portText, "%d", port);
+    if (getaddrinfo(host, portText, &hints, &serv_addr) != 0) {
+        return -1;
+    }
+
+    int clientSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (clientSocket >= 0 && connect(clientSocket, serv_addr->ai_addr, serv_addr->ai_addrlen) < 0) {
+        close(clientSocket);
+        clientSocket = -1;
+    }
+    freeaddrinfo(serv_addr);
+
+    return clientSocket;
+}
+
+// Keeps the agent's pool of connections warm. The agent's copies of connections claimed by requests are closed,
+// connections older than agentWarmSeconds (before otp_d's handshake deadline would close them) or already closed
+// by otp_d are dropped, and every empty slot gets a new connection.
+// Pre-conditions: Agent pool must exist. Only called by the agent process.
+// Post-conditions: Every reachable node has AGENT_POOL_SIZE unclaimed connections.
+void refillAgentPool() {
+    long now = time(NULL);
+    int i;
+
+    for (i = 0; i < agentNodeCount * AGENT_POOL_SIZE; i++) {
+        struct warmConnection* slot = &agentPool[i];
+
+        // Claimed by a request since the last pass
+        if (slot->socket >= 0 && __atomic_load_n(&slot->claimed, __ATOMIC_ACQUIRE)) {
+            close(slot->socket);
+            slot->socket = -1;
+        }
+
+        // Stale, take it back before a request can claim it
+        if (slot->socket >= 0) {
+            struct pollfd check = { slot->socket, POLLIN, 0 };
+            int closed = poll(&check, 1, 0) > 0;
+            if ((closed || now - slot->opened >= agentWarmSeconds) &&
+                __atomic_exchange_n(&slot->claimed, 1, __ATOMIC_ACQ_REL) == 0) {
+                close(slot->socket);
+                slot->socket = -1;
+            }
+        }
+
+        if (slot->socket < 0) {
+            struct clusterMember* node = &agentNodes[i / AGENT_POOL_SIZE];
+            slot->socket = connectNode(node->host, node->port);
+            slot->opened = now;
+            agentPoolEpoch++;
+            slot->epoch = agentPoolEpoch;
+            __atomic_store_n(&slot->claimed, slot->socket < 0, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+// Runs in a request process as it exits: makes sure its output reached the caller's descriptors, then sends the
+// exit status to the waiting otp.
+void reportAgentStatus(int status, void* connection) {
+    unsigned char code = (unsigned char) status;
+
+    fflush(stdout);
+    fflush(stderr);
+    send((int) (long) connection, &code, 1, MSG_NOSIGNAL);
+}
+
+// Serves one request forwarded by otp. The request carries the caller's working directory and arguments, and the
+// caller's stdout and stderr are passed along with it. The key it names is loaded as a pad, then a process forked
+// from the agent runs the command exactly as otp would, with the pads and the warm connections at hand.
+// Pre-conditions: Must be passed a connection accepted on the agent socket.
+// Post-conditions: A request process is running, or the connection is closed if the request was malformed.
+void serveAgentRequest(int connection) {
+    char* request = malloc(AGENT_REQUEST_MAX);
+    char control[CMSG_SPACE(sizeof(int) * 2)];
+    struct iovec part = { request, AGENT_REQUEST_MAX - 1 };
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    ssize_t length = recvmsg(connection, &message, 0);
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    if (length <= 0 || header == NULL || header->cmsg_type != SCM_RIGHTS ||
+        header->cmsg_len != CMSG_LEN(sizeof(int) * 2)) {
+        close(connection);
+        free(request);
+        return;
+    }
+    int descriptors[2];
+    memcpy(descriptors, CMSG_DATA(header), sizeof(descriptors));
+    request[length] = '\0';
+
+    // Working directory followed by the arguments, each NUL terminated
+    char* arguments[AGENT_ARGUMENTS + 1];
+    int argumentCount = 0;
+    char* cwd = request;
+    char* position = request + strlen(request) + 1;
+    arguments[argumentCount++] = "otp";
+    while (position < request + length && argumentCount < AGENT_ARGUMENTS) {
+        arguments[argumentCount++] = position;
+        position = position + strlen(position) + 1;
+    }
+    arguments[argumentCount] = NULL;
+
+    // The key is the argument after the user and (when posting) the file
+    int first = 1;
+    if (argumentCount > 1 && strcmp(arguments[1], "-b") == 0) {
+        first = 2;
+    }
+    else if (argumentCount > 1 && strcmp(arguments[1], "-a") == 0) {
+        first = 3;
+    }
+    int keyPosition = -1;
+    if (argumentCount > first + 2 && strcmp(arguments[first], "get") == 0) {
+        keyPosition = first + 2;
+    }
+    else if (argumentCount > first + 3 && strcmp(arguments[first], "route") != 0) {
+        keyPosition = first + 3;
+    }
+    if (keyPosition != -1) {
+        char keyPath[AGENT_REQUEST_MAX + 1];
+        snprintf(keyPath, sizeof(keyPath), "%s/%s", cwd, arguments[keyPosition]);
+        loadKeyPad(keyPath);
+    }
+
+    pid_t requestPID = fork();
+    if (requestPID == 0) {
+        close(agentListenSocket);
+        dup2(descriptors[0], 1);
+        dup2(descriptors[1], 2);
+        close(descriptors[0]);
+        close(descriptors[1]);
+        signal(SIGCHLD, SIG_DFL);
+        on_exit(reportAgentStatus, (void*) (long) connection);
+        agentForkEpoch = agentPoolEpoch;
+
+        if (chdir(cwd) != 0) {
+            fprintf(stderr, "Could not change to directory %s.\n", cwd);
+            exit(1);
+        }
+        exit(runOtp(argumentCount, arguments));
+    }
+
+    close(descriptors[0]);
+    close(descriptors[1]);
+    close(connection);
+    free(request);
+}
+
+// Runs the otp agent. It listens on a Unix socket for requests forwarded by otp (see forwardToAgent) and keeps key
+// pads mapped and AGENT_POOL_SIZE connections open to each otp_d of target (a port, host:port or cluster membership
+// file), so a request skips starting a process, reading its key and connecting. The socket is only accessible to the
+// user running the agent, and requests from processes of other users are refused.
+// Pre-conditions: Must be passed the socket path and the otp_d target.
+// Post-conditions: Runs until terminated. Exits if the socket cannot be created.
+void runAgent(char* socketPath, char* target) {
+    struct stat targetAttributes;
+    if (stat(target, &targetAttributes) == 0) {
+        agentNodeCount = loadCluster(target, agentNodes);
+    }
+    else {
+        resolveTarget(target, "", &agentNodes[0]);
+        agentNodeCount = 1;
+    }
+
+    agentPool = mmap(NULL, sizeof(struct warmConnection) * agentNodeCount * AGENT_POOL_SIZE,
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (agentPool == MAP_FAILED) {
+        fprintf(stderr, "Could not allocate connection pool.\n");
+        exit(1);
+    }
+    int i;
+    for (i = 0; i < agentNodeCount * AGENT_POOL_SIZE; i++) {
+        agentPool[i].socket = -1;
+        agentPool[i].claimed = 1;
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Agent socket path is too long.\n");
+        exit(1);
+    }
+    strcpy(address.sun_path, socketPath);
+    unlink(socketPath);
+
+    agentListenSocket = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    mode_t previousMask = umask(077);
+    int bound = agentListenSocket >= 0 && bind(agentListenSocket, (struct sockaddr*) &address, sizeof(address)) == 0;
+    umask(previousMask);
+    if (!bound || chmod(socketPath, 0600) != 0 || listen(agentListenSocket, 64) != 0) {
+        fprintf(stderr, "Could not listen on agent socket %s.\n", socketPath);
+        exit(1);
+    }
+
+    // Finished requests are reaped automatically
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (1) {
+        refillAgentPool();
+
+        struct pollfd listening = { agentListenSocket, POLLIN, 0 };
+        if (poll(&listening, 1, 1000) > 0) {
+            // Requests run with the agent's privileges, so only its own user may make them
+            int connection = accept(agentListenSocket, NULL, NULL);
+            struct ucred credentials;
+            socklen_t length = sizeof(credentials);
+            if (connection >= 0 && (getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0 ||
+                                    credentials.uid != geteuid())) {
+                close(connection);
+            }
+            else if (connection >= 0) {
+                serveAgentRequest(connection);
+            }
+        }
+    }
+}
+
+// Forwards a command to the agent listening at socketPath, passing stdout and stderr so its output goes exactly
+// where otp's own would, and waits for its exit status.
+// Pre-conditions: Must be passed the agent socket path and otp's arguments.
+// Post-conditions: Returns the exit status of the command, or -1 if no agent could be reached (nothing was run).
+int forwardToAgent(char* socketPath, int argc, char* argv[]) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    int agent = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (agent < 0 || connect(agent, (struct sockaddr*) &address, sizeof(address)) != 0) {
+        if (agent >= 0) {
+            close(agent);
+        }
+        return -1;
+    }
+
+    // Working directory followed by the arguments, each NUL terminated
+    char* request = malloc(AGENT_REQUEST_MAX);
+    int length = 0;
+    if (getcwd(request, AGENT_REQUEST_MAX) == NULL) {
+        close(agent);
+        free(request);
+        return -1;
+    }
+    length = strlen(request) + 1;
+    int i;
+    for (i = 1; i < argc; i++) {
+        if (length + strlen(argv[i]) + 1 > AGENT_REQUEST_MAX - 1 || i > AGENT_ARGUMENTS - 1) {
+            close(agent);
+            free(request);
+            return -1;
+        }
+        strcpy(request + length, argv[i]);
+        length = length + strlen(argv[i]) + 1;
+    }
+
+    int descriptors[2] = { 1, 2 };
+    char control[CMSG_SPACE(sizeof(descriptors))];
+    struct iovec part = { request, length };
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    memset(control, 0, sizeof(control));
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(descriptors));
+    memcpy(CMSG_DATA(header), descriptors, sizeof(descriptors));
+
+    if (sendmsg(agent, &message, MSG_NOSIGNAL) != length) {
+        close(agent);
+        free(request);
+        return -1;
+    }
+    free(request);
+
+    // The command has started, so from here on its outcome is the agent's
+    unsigned char status = 1;
+    if (recv(agent, &status, 1, 0) != 1) {
+        fprintf(stderr, "otp agent closed the request before it finished.\n");
+        status = 1;
+    }
+    close(agent);
+
+    return status;
+}
+
+// Main runs otp. When OTP_AGENT names the socket of a running agent the command is forwarded to it, otherwise
+// (or if the agent cannot be reached) it is run directly by runOtp. "otp agent <socket> <port> [warm_seconds]" starts
+// an agent, which replaces its connections after warm_seconds (5 by default, keep it below otp_d's -H deadline).
+int main(int argc, char* argv[]) {
+    if ((argc == 4 || argc == 5) && strcmp(argv[1], "agent") == 0) {
+        if (argc == 5) {
+            agentWarmSeconds = atol(argv[4]);
+        }
+        if (agentWarmSeconds < 1) {
+            fprintf(stderr, "Warm seconds must be at least 1.\n");
+            exit(1);
+        }
+        runAgent(argv[2], argv[3]);
+        return 0;
+    }
+
+    char* agentPath = getenv("OTP_AGENT");
+    if (agentPath != NULL && argc > 1) {
+        int status = forwardToAgent(agentPath, argc, argv);
+        if (status >= 0) {
+            return status;
+        }
+    }
+
+    return runOtp(argc, argv);
+}
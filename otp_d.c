@@ -10,6 +10,8 @@
 // https://www.tutorialspoint.com/c_standard_library/c_function_remove.htm
 // https://beej.us/guide/bgnet/html/#setsockoptman
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
@@ -21,24 +23,491 @@
 #include <sys/stat.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/sendfile.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/xattr.h>
+#include <sys/un.h>
+#include "crc32c.h"
+#include "trace.h"
+
+// Replication: maximum number of followers, journal of committed posts and delivery tombstones, size past which a
+// journal every follower has acknowledged is replaced by an empty one, records shipped per batch and batches a
+// shipper may have in flight before it waits for an acknowledgement. A keyed follower challenges a leader with
+// REPLICATION_NONCE_LEN random bytes and gives it REPLICATION_AUTH_TIMEOUT seconds to answer.
+#define MAX_FOLLOWERS 4
+#define JOURNAL_NAME "otp_d.journal"
+#define JOURNAL_ROTATE_BYTES (1 << 20)
+#define REPLICATION_BATCH 256
+#define REPLICATION_WINDOW 4
+#define REPLICATION_NONCE_LEN 16
+#define REPLICATION_AUTH_TIMEOUT 10
+
+// Scheduling: connections held by the main process (handshaking or queued), user hash table size and the fixed cost
+// charged for starting a connection.
+#define MAX_PENDING 256
+#define USER_BUCKETS 256
+#define REQUEST_COST 1024
+
+// Memory store: size of the blocks drops are stored in, user hash table size and longest user name kept in memory
+// (longer names always use disk).
+#define STORE_BLOCK_SIZE 4096
+#define STORE_BUCKETS 1024
+#define STORE_USER_MAX 256
+
+// Hot-drop cache: block size, name hash table size and the fraction of the cache one drop may take at most.
+#define CACHE_BLOCK_SIZE 4096
+#define CACHE_BUCKETS 1024
+#define CACHE_ENTRY_SHARE 4
+
+// Chunked uploads: prefix of the files partial uploads are staged in and size of the receive buffer.
+#define UPLOAD_PREFIX ".upload_"
+#define UPLOAD_BUFFER_SIZE 65536
+
+// Posts: prefix of the staging file a message is received into before it is published as a drop.
+#define POST_PREFIX ".post_"
+
+// Gets: prefix a drop is renamed to while a get sends it, so no other get can pick it up.
+#define GET_PREFIX ".get_"
+
+// Fan-out posts: prefix of the staging file the message is received into and maximum number of recipients.
+#define FANOUT_PREFIX ".fanout_"
+#define FANOUT_MAX 64
+
+// Extended attribute of a staged upload holding "<offset> <crc>", the checksum of its first offset bytes.
+#define UPLOAD_CRC_XATTR "user.otp.crc32c.partial"
+
+// Extended attribute of a drop published from a chunked upload holding the upload id.
+#define UPLOAD_ID_XATTR "user.otp.upload"
+
+// Number of slots in a timer wheel. Entries further out than one revolution stay in their slot until due.
+#define WHEEL_SLOTS 512
+
+// Counters shared by the server, its children and the sweeper. Dumped to stdout when SIGUSR1 is received.
+struct serverMetrics {
+    unsigned long postsAccepted;
+    unsigned long bytesAccepted;
+    unsigned long postsRejectedCount;
+    unsigned long postsRejectedBytes;
+    unsigned long getsServed;
+    unsigned long getsEmpty;
+    unsigned long dropsExpired;
+    unsigned long bytesExpired;
+    unsigned long journalRecords;
+    long long replicaLagBytes[MAX_FOLLOWERS];
+    unsigned long replicaAckedBatches[MAX_FOLLOWERS];
+    unsigned long replicatedPosts;
+    unsigned long replicatedTombstones;
+    unsigned long evictedHandshakes;
+    unsigned long evictedIdle;
+    unsigned long evictedSlow;
+    unsigned long evictedOvertime;
+    unsigned long fanoutRecipients;
+};
+
+// Entry of a hashed timer wheel. Users embed it as the first member of their own structure. Slot is the wheel slot
+// the entry was placed in.
+struct timerEntry {
+    long expiry;
+    int slot;
+    struct timerEntry* next;
+};
+
+// Hashed timer wheel with one slot per tick. Current is the next tick to be processed.
+struct timerWheel {
+    struct timerEntry* slots[WHEEL_SLOTS];
+    long current;
+};
+
+// Connection accepted by the main process. Stage 0 waits for the command, stage 1 for the user and stage 2 is queued.
+// The deadline is in the handshake wheel until the handshake ends. Arrival is when it was accepted, for the trace.
+struct pendingConnection {
+    struct timerEntry deadline;
+    long long arrival;
+    int socket;
+    int stage;
+    char command[8];
+    char user[1025];
+    struct pendingConnection* next;
+};
+
+// Scheduling state of a user: waiting connections, deficit round robin credit (bytes), running children, the
+// bandwidth pacer they share (-1 if none) and links into the round-robin ring and the user hash table.
+struct userQueue {
+    char user[1025];
+    struct pendingConnection* head;
+    struct pendingConnection* tail;
+    long long deficit;
+    int active;
+    int pacer;
+    int backlogged;
+    struct userQueue* ringNext;
+    struct userQueue* ringPrev;
+    struct userQueue* hashNext;
+};
+
+// Drop held in the memory store. State 0 is free, 1 is being received, 2 is stored in its users queue and 3 is being
+// sent. Receiving and sending drops belong to the process owner. Drop bytes live in a chain of blocks.
+struct storeDropRecord {
+    int state;
+    pid_t owner;
+    char user[STORE_USER_MAX];
+    long long size;
+    struct timespec posted;
+    uint32_t crc;
+    int firstBlock;
+    int lastBlock;
+    int next;
+};
+
+// Queue of stored drops of one user (oldest at head), with the users totals and the number of its drops on disk.
+struct storeUser {
+    int inUse;
+    char user[STORE_USER_MAX];
+    int head;
+    int tail;
+    long drops;
+    long long bytes;
+    long diskDrops;
+    int hashNext;
+};
+
+// Pool of fixed size blocks in a shared mapping, used by the memory store and the hot-drop cache. Free blocks and the
+// blocks of each drop are chained through the link array that goes with the pool (-1 ends a chain).
+struct blockPool {
+    int blockCount;
+    int blockSize;
+    int freeBlock;
+    long long usedBytes;
+};
+
+// Header of the shared memory store, followed in the mapping by the drop records, users, block links and blocks.
+// Everything is protected by the process-shared robust mutex.
+struct memoryStore {
+    pthread_mutex_t lock;
+    struct blockPool blocks;
+    int freeDrop;
+    int freeUser;
+    int buckets[STORE_BUCKETS];
+    long storedDrops;
+    unsigned long spilledDrops;
+    unsigned long rejectedDrops;
+};
+
+// Copy of a drop file kept by the hot-drop cache, keyed by file name and checked against the files size and
+// modification time before use. State 0 is free, 1 is being filled by a post, 2 is cached (and in the hash table)
+// and 3 is being sent. Filling and sending entries belong to the process owner.
+struct cacheEntry {
+    int state;
+    int referenced;
+    pid_t owner;
+    char name[256];
+    long long size;
+    struct timespec modified;
+    uint32_t crc;
+    int firstBlock;
+    int lastBlock;
+    int next;
+};
+
+// Header of the shared hot-drop cache, followed in the mapping by the entries, block links and blocks. Cached entries
+// are evicted with the CLOCK algorithm. Everything is protected by the process-shared robust mutex.
+struct dropCache {
+    pthread_mutex_t lock;
+    struct blockPool blocks;
+    int freeEntry;
+    int clockHand;
+    int buckets[CACHE_BUCKETS];
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long insertions;
+    unsigned long evictions;
+    unsigned long invalidations;
+};
+
+// Bytes moved by the child in a process slot, shared with the main process. Outcome is the trace outcome the child
+// reached and discarded counts bytes of a rejected post that were read and thrown away.
+struct slotProgress {
+    long long bytes;
+    long long discarded;
+    int outcome;
+};
+
+// Bandwidth cap of one user, shared by all of its running children: the monotonic time (nanoseconds) at which the
+// users next bytes may go out, advanced by every child as it transfers, and the number of children using it (kept by
+// the scheduler).
+struct bandwidthPacer {
+    long long nextSend;
+    int users;
+};
+
+// Buffered reader over a socket used for the replication stream.
+struct socketReader {
+    int fd;
+    int start;
+    int end;
+    char buffer[65536];
+};
+
+// Drop scheduled for expiry by the sweeper, also chained in a hash table by name to avoid duplicates.
+struct sweepEntry {
+    struct timerEntry timer;
+    struct sweepEntry* hashNext;
+    char name[256];
+};
 
 // Variables used for connections and process tracking (maximum of 5 processes running at a time).
 struct sockaddr_in server_addr, client_addr;
 int processes[5];
-int connectionActive = 1;
+volatile sig_atomic_t connectionActive = 1;
 int server_fd;
 socklen_t cliLength;
 
+// Per-user limits (0 means unlimited) and drop time to live in seconds (0 means drops never expire).
+long quotaDrops = 0;
+long long quotaBytes = 0;
+long dropTTL = 0;
+
+// Shared metrics, sweeper process and the pipe children use to tell the sweeper about new drops.
+struct serverMetrics* metrics = NULL;
+pid_t sweeperPID = -5;
+int sweeperNotifyFd = -1;
+volatile sig_atomic_t metricsRequested = 0;
+
+// Self-pipe the SIGCHLD handler writes to, so the main loop's poll wakes up as soon as a child exits.
+int childExitPipe[2] = { -1, -1 };
+
+// Memory store mode (-m): shared store and its sections, and whether drops that do not fit spill to disk (-s).
+struct memoryStore* memoryStore = NULL;
+struct storeDropRecord* storeDrops = NULL;
+struct storeUser* storeUsers = NULL;
+int* storeBlockNext = NULL;
+char* storeData = NULL;
+long long storeCapacity = 0;
+int storeSpill = 0;
+
+// Hot-drop cache (-C): shared cache and its sections.
+struct dropCache* dropCache = NULL;
+struct cacheEntry* cacheEntries = NULL;
+int* cacheBlockNext = NULL;
+char* cacheData = NULL;
+long long cacheCapacity = 0;
+
+// Scheduler state: connections mid-handshake, users by name, ring of users with waiting connections, owners and
+// progress of the process slots, recipients of the fan-out posts being served, per-user limits and the bandwidth
+// pacers of users with running children (one per process slot is enough). childSlot and childPacer are set for a
+// child when it is forked.
+struct pendingConnection* handshakes = NULL;
+int pendingCount = 0;
+struct userQueue* userTable[USER_BUCKETS];
+struct userQueue* ringCursor = NULL;
+int ringSize = 0;
+struct userQueue* slotOwners[5];
+char* slotRecipients[5];
+struct slotProgress* progress = NULL;
+struct bandwidthPacer* pacers = NULL;
+int perUserConcurrency = 5;
+long long perUserBandwidth = 0;
+long long drrQuantum = 65536;
+int childSlot = -1;
+int childPacer = -1;
+
+// Number of shared memory locks (store, cache) this process holds, and whether it was told to stop while holding
+// one. Children and the sweeper only stop outside of them, so shared structures are never left half updated.
+volatile sig_atomic_t sharedLocksHeld = 0;
+volatile sig_atomic_t stopDeferred = 0;
+
+// Connection deadlines kept by the main process, in seconds (0 disables one): handshake (-H), no progress during a
+// transfer (-I) and whole transfer (-D), plus the minimum average transfer rate in bytes per second (-M).
+// Handshakes in progress are in handshakeWheel, and each running process slot has a timer in slotWheel that fires
+// every second to check its progress.
+struct slotDeadline {
+    struct timerEntry timer;
+    int slot;
+    int isPost;
+    int evicted;
+    long started;
+    long lastActive;
+    long long lastBytes;
+};
+long handshakeTimeout = 10;
+long idleTimeout = 60;
+long transferTimeout = 0;
+long long minThroughput = 0;
+struct timerWheel handshakeWheel;
+struct timerWheel slotWheel;
+struct slotDeadline slotDeadlines[5];
+
+// Replication state. A leader journals to journalFd and runs one shipper per follower, a follower runs a receiver
+// on replicationHost and replicationPort. With a key (-K) leaders and followers prove to each other that they hold it.
+char* followers[MAX_FOLLOWERS];
+int followerCount = 0;
+pid_t shipperPIDs[MAX_FOLLOWERS];
+char* replicationHost = "127.0.0.1";
+int replicationPort = 0;
+int replicationKeyed = 0;
+uint64_t replicationKey[2];
+pid_t receiverPID = -5;
+int journalFd = -1;
+
+// Listening socket handoff (-U): path of the Unix socket on which this instance hands its listening socket to a
+// newly started otp_d, the listener on that path, the connection to the instance this one took over from (closed by
+// it once it has drained), and whether this instance has handed off and is draining.
+char* handoffPath = NULL;
+int handoffListenFd = -1;
+int handoffPeer = -1;
+int draining = 0;
+
+// Request trace (-T): descriptor of the trace file, key of the user hashes and the record of the request running in
+// each process slot.
+int traceFd = -1;
+struct traceKey traceSecret;
+struct traceRecord slotTraces[5];
+
 // Takes a string (char*) parameter for the path of a file to be removed. If
 // successful, the file is removed. If not, an error is sent to stderr.
 // Pre-conditions: Must be passed a valid file path to remove that file.
-// Post-conditions: File is removed or error is sent to stderr.
-void removeFile(char* filePath) {
+// Post-conditions: File is removed or error is sent to stderr. Returns 0 if the file was removed.
+int removeFile(char* filePath) {
     int error = remove(filePath);
     if (error != 0) {
         char* message = "Unable to delete the file.\n";
         write(2, message, 27);
     }
+
+    return error;
+}
+
+// Appends a record to the replication journal when followers are configured. Each record is a single short line
+// written with one write on an O_APPEND descriptor, so records from concurrent children never interleave. Writers
+// hold a shared record lock on the journal while they append, and reopen it if a shipper rotated it before they got
+// the lock, so no record is written to a journal that has been replaced.
+// Pre-conditions: Must be passed the record type (P for a committed post, T for a delivered or removed drop) and
+// the file name (not path) of the drop.
+// Post-conditions: Record is in the journal if replication is enabled.
+void journalRecord(char type, char* dropName) {
+    if (journalFd < 0) {
+        return;
+    }
+
+    char line[300];
+    int length = snprintf(line, 300, "%c %s\n", type, dropName);
+    if (length <= 0 || length >= 300) {
+        return;
+    }
+
+    struct flock lock = { .l_type = F_RDLCK, .l_whence = SEEK_SET };
+    struct stat opened;
+    struct stat named;
+    fcntl(journalFd, F_SETLKW, &lock);
+    while (fstat(journalFd, &opened) == 0 && stat(JOURNAL_NAME, &named) == 0 &&
+           (opened.st_dev != named.st_dev || opened.st_ino != named.st_ino)) {
+        close(journalFd);
+        journalFd = open(JOURNAL_NAME, O_WRONLY | O_CREAT | O_APPEND, 0666);
+        if (journalFd < 0) {
+            return;
+        }
+        fcntl(journalFd, F_SETLKW, &lock);
+    }
+
+    if (write(journalFd, line, length) == length) {
+        __atomic_add_fetch(&metrics->journalRecords, 1, __ATOMIC_RELAXED);
+    }
+
+    lock.l_type = F_UNLCK;
+    fcntl(journalFd, F_SETLK, &lock);
+}
+
+// Returns the wall clock time in microseconds, as trace records store it.
+// Pre-conditions: None.
+// Post-conditions: Returns the current time.
+long long traceClock() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Records how the request served by a child ended, for the trace.
+// Pre-conditions: Must be called by a child with one of the TRACE outcomes.
+// Post-conditions: Outcome is shared with the main process.
+void traceOutcome(int outcome) {
+    if (childSlot >= 0) {
+        progress[childSlot].outcome = outcome;
+    }
+}
+
+// Completes the trace record of a process slot whose child was reaped and appends it to the trace, in one write so
+// a record is never torn.
+// Pre-conditions: Must be called by the main process before the slot is reused.
+// Post-conditions: Record is in the trace if tracing is enabled.
+void writeTraceRecord(int slot) {
+    if (traceFd < 0) {
+        return;
+    }
+
+    struct traceRecord* record = &slotTraces[slot];
+    long long serviceTime = traceClock() - record->arrival;
+    record->serviceTime = serviceTime < 0 ? 0 : (serviceTime > UINT32_MAX ? UINT32_MAX : serviceTime);
+    record->bytes = progress[slot].bytes + progress[slot].discarded;
+    record->outcome = slotDeadlines[slot].evicted ? TRACE_EVICTED : progress[slot].outcome;
+
+    unsigned char encoded[TRACE_RECORD_LEN];
+    traceEncode(encoded, record);
+    if (write(traceFd, encoded, TRACE_RECORD_LEN) != TRACE_RECORD_LEN) {
+        fprintf(stderr, "Could not write trace record.\n");
+    }
+}
+
+// Records bytes moved by a child for the scheduler and paces the transfer to the users bandwidth cap. The bytes
+// take their time on the users pacer, after whatever the users other children have claimed, so all of them
+// together stay within the cap. The scheduler charges the total to the user when the child finishes.
+// Pre-conditions: Must be called by a child after each chunk it receives or sends.
+// Post-conditions: Progress is updated; the child has slept as needed to stay within perUserBandwidth.
+void recordTransfer(long long bytes) {
+    if (childSlot < 0) {
+        return;
+    }
+    progress[childSlot].bytes = progress[childSlot].bytes + bytes;
+
+    if (childPacer >= 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long nowNs = (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+        long long duration = bytes * 1000000000LL / perUserBandwidth;
+
+        // Claim the next free stretch of the users time
+        long long* nextSend = &pacers[childPacer].nextSend;
+        long long next = __atomic_load_n(nextSend, __ATOMIC_RELAXED);
+        long long begin;
+        do {
+            begin = next > nowNs ? next : nowNs;
+        } while (!__atomic_compare_exchange_n(nextSend, &next, begin + duration, 0, __ATOMIC_RELAXED,
+                                              __ATOMIC_RELAXED));
+
+        if (begin + duration > nowNs) {
+            usleep((useconds_t) ((begin + duration - nowNs) / 1000));
+        }
+    }
+}
+
+// Checks whether a directory entry name is a drop of the provided user, that is of the exact form <pid>_<user>.
+// Pre-conditions: Must be passed a file name and a users name.
+// Post-conditions: Returns 1 if the file is a drop for user, otherwise 0.
+int isDropOfUser(char* name, char* user) {
+    int i = 0;
+    // Skip numeric prefix
+    while (isdigit((unsigned char) name[i])) {
+        i++;
+    }
+
+    return i > 0 && name[i] == '_' && strcmp(&name[i + 1], user) == 0;
 }
 
 // Initializes global processes array with all five positions set to -5.
@@ -52,437 +521,3746 @@ void initializeProcesses() {
     }
 }
 
-// Sends file text from provided path to socket provided. If unsuccessful, message is sent to stderr.
-// If successful, message is sent to client (otp).
-// Pre-conditions: Must receive open socket connection and char* to path of file of which to send.
-// Post-conditions: File text is sent if successful. If not, then error message is sent to stderr.
-void sendFile(int communicationSocket, char* path) {
-    FILE* filePtr = NULL;
-    // Attempt to open file of provided path
-    filePtr = fopen(path, "r");
-
-    // If file is opened, send file over data connection
-    if (filePtr != NULL) {
-        //Declare variable
-        int bytesRead = 0;
-
-        //Determine file size
-        fseek(filePtr, 0, SEEK_END);
-        int fileSize = ftell(filePtr);
-        char fileSizeString[20];
-        memset(fileSizeString, '\0', 20);
-
-        // Convert integer to string to send over socket
-        sprintf(fileSizeString, "%d", fileSize);
-
-        // Send number of bytes that will be transmitted
-        send(communicationSocket, fileSizeString, 20, 0);
-
-        //Rewind to start of file
-        rewind(filePtr);
-
-        char fileBuffer[1025];
-        //As long as file is being received, loop
-        while (1) {
-            memset(fileBuffer, '\0', 1025);
-            bytesRead = fread(fileBuffer, 1, 1024, filePtr);
-
-            //If the bytesRead is more than 0, then send the bytes to client
-            if (bytesRead > 0) {
-                send(communicationSocket, fileBuffer, bytesRead, 0);
-            }
-            //Otherwise, break out of loop
-            else {
-                break;
-            }
+// Stores the CRC32C of a drop file with it.
+// Pre-conditions: Must be passed a descriptor of the drop file and its checksum.
+// Post-conditions: Checksum is stored, unless the file system does not support extended attributes.
+void setDropChecksum(int fd, uint32_t crc) {
+    char value[9];
+    snprintf(value, 9, "%08x", crc);
+    fsetxattr(fd, CRC32C_XATTR, value, 8, 0);
+}
+
+// Reads the CRC32C stored with a drop file.
+// Pre-conditions: Must be passed a descriptor of the drop file and a location for the checksum.
+// Post-conditions: Returns 1 and sets crc if the file has a checksum, otherwise 0.
+int getDropChecksum(int fd, uint32_t* crc) {
+    char value[9];
+    memset(value, '\0', 9);
+    if (fgetxattr(fd, CRC32C_XATTR, value, 8) != 8) {
+        return 0;
+    }
+
+    return sscanf(value, "%8x", crc) == 1;
+}
+
+// Sends the 20 byte size field that starts a get response. When the drop has a checksum it follows the size,
+// separated by a space, so otp can verify the message.
+// Pre-conditions: Must be passed a valid/open socket connection, the drop size and its checksum if it has one.
+// Post-conditions: Size field is sent.
+void sendDropSize(int communicationSocket, long long size, int hasChecksum, uint32_t crc) {
+    char fileSizeString[21];
+    memset(fileSizeString, '\0', 21);
+
+    // Convert integer to string to send over socket
+    if (hasChecksum) {
+        snprintf(fileSizeString, 21, "%lld %08x", size, crc);
+    }
+    else {
+        snprintf(fileSizeString, 21, "%lld", size);
+    }
+
+    // Send number of bytes that will be transmitted
+    send(communicationSocket, fileSizeString, 20, 0);
+}
+
+// Signal handler for SIGTERM in children and the sweeper. The process exits at once, or as soon as it releases the
+// last shared memory lock it holds.
+void stopProcess(int signal) {
+    if (sharedLocksHeld > 0) {
+        stopDeferred = 1;
+        return;
+    }
+    _exit(1);
+}
+
+// Hashes a name (user or drop file) with djb2. Callers reduce it to the size of their table.
+// Pre-conditions: Must be passed a string.
+// Post-conditions: Returns the hash.
+unsigned int hashName(char* name) {
+    unsigned int hash = 5381;
+    while (*name != '\0') {
+        hash = hash * 33 + (unsigned char) *name;
+        name++;
+    }
+
+    return hash;
+}
+
+// Initializes a lock in shared memory for use by all processes. It survives a process dying while holding it.
+// Pre-conditions: Lock must be in a shared mapping.
+// Post-conditions: Lock is ready for lockShared.
+void initSharedLock(pthread_mutex_t* lock) {
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+}
+
+// Locks a shared memory lock. If the previous holder died, the lock is made consistent and taken over.
+// Pre-conditions: Lock must have been initialized by initSharedLock.
+// Post-conditions: Caller holds the lock.
+void lockShared(pthread_mutex_t* lock) {
+    sharedLocksHeld++;
+    if (pthread_mutex_lock(lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(lock);
+    }
+}
+
+// Unlocks a shared memory lock, then stops the process if it was told to while holding the lock.
+// Pre-conditions: Caller must hold the lock.
+// Post-conditions: Lock is released.
+void unlockShared(pthread_mutex_t* lock) {
+    pthread_mutex_unlock(lock);
+    sharedLocksHeld--;
+    if (sharedLocksHeld == 0 && stopDeferred) {
+        _exit(1);
+    }
+}
+
+// Chains every block of a pool into its free list.
+// Pre-conditions: Must be passed the pool, its link array of blockCount entries and the block size.
+// Post-conditions: Pool is empty.
+void initBlockPool(struct blockPool* pool, int* links, int blockCount, int blockSize) {
+    int i;
+    for (i = 0; i < blockCount; i++) {
+        links[i] = i + 1 < blockCount ? i + 1 : -1;
+    }
+    pool->blockCount = blockCount;
+    pool->blockSize = blockSize;
+    pool->freeBlock = 0;
+    pool->usedBytes = 0;
+}
+
+// Takes a block from the free list of a pool.
+// Pre-conditions: Caller must hold the lock protecting the pool.
+// Post-conditions: Returns the block index (ending a chain) or -1 if the pool is full.
+int takePoolBlock(struct blockPool* pool, int* links) {
+    int block = pool->freeBlock;
+    if (block != -1) {
+        pool->freeBlock = links[block];
+        links[block] = -1;
+        pool->usedBytes = pool->usedBytes + pool->blockSize;
+    }
+
+    return block;
+}
+
+// Returns a chain of blocks to the free list of a pool.
+// Pre-conditions: Caller must hold the lock protecting the pool. Must be passed the first block of the chain or -1.
+// Post-conditions: Blocks of the chain are free.
+void freePoolBlocks(struct blockPool* pool, int* links, int block) {
+    while (block != -1) {
+        int next = links[block];
+        links[block] = pool->freeBlock;
+        pool->freeBlock = block;
+        pool->usedBytes = pool->usedBytes - pool->blockSize;
+        block = next;
+    }
+}
+
+// Creates the shared memory store with room for capacity bytes of drops. Drop records and users are sized for the
+// worst case of one block per drop.
+// Pre-conditions: capacity must be at least STORE_BLOCK_SIZE.
+// Post-conditions: memoryStore and its sections are mapped and initialized. Exits on error.
+void initMemoryStore(long long capacity) {
+    int blockCount = (int) (capacity / STORE_BLOCK_SIZE);
+    size_t size = sizeof(struct memoryStore) + (sizeof(struct storeDropRecord) + sizeof(struct storeUser) +
+                  sizeof(int) + STORE_BLOCK_SIZE) * (size_t) blockCount;
+
+    char* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (blockCount < 1 || mapping == MAP_FAILED) {
+        fprintf(stderr, "Could not allocate memory store.\n");
+        exit(1);
+    }
+
+    memoryStore = (struct memoryStore*) mapping;
+    storeDrops = (struct storeDropRecord*) (mapping + sizeof(struct memoryStore));
+    storeUsers = (struct storeUser*) (storeDrops + blockCount);
+    storeBlockNext = (int*) (storeUsers + blockCount);
+    storeData = (char*) (storeBlockNext + blockCount);
+
+    initSharedLock(&memoryStore->lock);
+
+    // Chain every block, drop record and user into its free list
+    int i;
+    initBlockPool(&memoryStore->blocks, storeBlockNext, blockCount, STORE_BLOCK_SIZE);
+    for (i = 0; i < blockCount; i++) {
+        storeDrops[i].next = i + 1 < blockCount ? i + 1 : -1;
+        storeUsers[i].hashNext = i + 1 < blockCount ? i + 1 : -1;
+    }
+    for (i = 0; i < STORE_BUCKETS; i++) {
+        memoryStore->buckets[i] = -1;
+    }
+    memoryStore->freeDrop = 0;
+    memoryStore->freeUser = 0;
+}
+
+// Looks up a user in the memory store, optionally creating it.
+// Pre-conditions: Caller must hold the store lock. Name must be shorter than STORE_USER_MAX.
+// Post-conditions: Returns the index of the user or -1.
+int findStoreUser(char* user, int create) {
+    unsigned int bucket = hashName(user) % STORE_BUCKETS;
+    int index;
+
+    for (index = memoryStore->buckets[bucket]; index != -1; index = storeUsers[index].hashNext) {
+        if (strcmp(storeUsers[index].user, user) == 0) {
+            return index;
         }
+    }
+    if (!create || memoryStore->freeUser == -1) {
+        return -1;
+    }
+
+    index = memoryStore->freeUser;
+    memoryStore->freeUser = storeUsers[index].hashNext;
+    memset(&storeUsers[index], 0, sizeof(struct storeUser));
+    storeUsers[index].inUse = 1;
+    strcpy(storeUsers[index].user, user);
+    storeUsers[index].head = -1;
+    storeUsers[index].tail = -1;
+    storeUsers[index].hashNext = memoryStore->buckets[bucket];
+    memoryStore->buckets[bucket] = index;
 
-        //Close the file
-        fclose(filePtr);
+    return index;
+}
 
-        // Remove file that was sent
-        removeFile(path);
+// Returns a user with no stored drops and no drops on disk to the free list.
+// Pre-conditions: Caller must hold the store lock.
+// Post-conditions: User is freed if it is empty.
+void releaseStoreUserIfEmpty(int index) {
+    if (storeUsers[index].head != -1 || storeUsers[index].diskDrops > 0) {
+        return;
     }
 
-    //File doesn't exist and/or cannot be opened
+    int* link = &memoryStore->buckets[hashName(storeUsers[index].user) % STORE_BUCKETS];
+    while (*link != index) {
+        link = &storeUsers[*link].hashNext;
+    }
+    *link = storeUsers[index].hashNext;
+
+    storeUsers[index].inUse = 0;
+    storeUsers[index].hashNext = memoryStore->freeUser;
+    memoryStore->freeUser = index;
+}
+
+// Frees a drop record and its blocks.
+// Pre-conditions: Caller must hold the store lock. Drop must not be in a users queue.
+// Post-conditions: Drop record and blocks are back on their free lists.
+void freeStoreDrop(int drop) {
+    freePoolBlocks(&memoryStore->blocks, storeBlockNext, storeDrops[drop].firstBlock);
+
+    storeDrops[drop].state = 0;
+    storeDrops[drop].next = memoryStore->freeDrop;
+    memoryStore->freeDrop = drop;
+}
+
+// Appends a stored drop to the tail (or, when requeue is set, the head) of its users queue.
+// Pre-conditions: Caller must hold the store lock. Drop must be complete and not in a queue.
+// Post-conditions: Drop is stored and counted for its user.
+void queueStoreDrop(int drop, int requeue) {
+    int user = findStoreUser(storeDrops[drop].user, 1);
+
+    storeDrops[drop].state = 2;
+    storeDrops[drop].owner = 0;
+    if (requeue) {
+        storeDrops[drop].next = storeUsers[user].head;
+        storeUsers[user].head = drop;
+        if (storeUsers[user].tail == -1) {
+            storeUsers[user].tail = drop;
+        }
+    }
     else {
-        //Send file not found error message
-        char* message = "File not found or could not be opened.\n";
-        write(2, message, 39);
+        storeDrops[drop].next = -1;
+        if (storeUsers[user].tail == -1) {
+            storeUsers[user].head = drop;
+        }
+        else {
+            storeDrops[storeUsers[user].tail].next = drop;
+        }
+        storeUsers[user].tail = drop;
+    }
 
-        // If the file is not found, send failure message to client so that it does not wait for message.
-        send(communicationSocket, "0", 1, 0);
+    storeUsers[user].drops++;
+    storeUsers[user].bytes = storeUsers[user].bytes + storeDrops[drop].size;
+    memoryStore->storedDrops++;
+}
+
+// Unlinks the oldest stored drop of a user from its queue.
+// Pre-conditions: Caller must hold the store lock. User must have a stored drop.
+// Post-conditions: Returns the drop, which is no longer counted for the user.
+int unqueueStoreDrop(int user) {
+    int drop = storeUsers[user].head;
+
+    storeUsers[user].head = storeDrops[drop].next;
+    if (storeUsers[user].head == -1) {
+        storeUsers[user].tail = -1;
     }
+    storeUsers[user].drops--;
+    storeUsers[user].bytes = storeUsers[user].bytes - storeDrops[drop].size;
+    memoryStore->storedDrops--;
+
+    return drop;
 }
 
-// Path to oldest file of user is determined and returned.
-// Pre-conditions: Must be passed char* of users name to find their corresponding files.
-// Post-conditions: If found, path to file is returned. If no valid file is found, an empty string
-// is returned.
-char* findOldestFilePath(char* user) {
-    // Declare variables to be used in directory manipulation
-    int oldestModified = 2147483647;
+// Adjusts the count of drops on disk kept for the user of a drop file, so gets in memory mode know whether the
+// disk has to be searched at all.
+// Pre-conditions: Must be passed a drop file name (not path) and +1 or -1.
+// Post-conditions: Users disk drop count is adjusted if the memory store is in use.
+void adjustDiskDrops(char* dropName, int delta) {
+    char* user = strchr(dropName, '_');
+    if (memoryStore == NULL || user == NULL || strlen(user + 1) >= STORE_USER_MAX) {
+        return;
+    }
 
-    // Allocate memory fore filename in directory
-    char* dirName = malloc(sizeof(char) * 128);
-    memset(dirName, '\0', 128);
+    lockShared(&memoryStore->lock);
+    int index = findStoreUser(user + 1, delta > 0);
+    if (index != -1) {
+        storeUsers[index].diskDrops = storeUsers[index].diskDrops + delta;
+        if (storeUsers[index].diskDrops < 0) {
+            storeUsers[index].diskDrops = 0;
+        }
+        releaseStoreUserIfEmpty(index);
+    }
+    unlockShared(&memoryStore->lock);
+}
 
-    // Starting directory
-    DIR* dirToExamine = opendir(".");
+// Checks whether a user is known to have drops on disk. Drops added behind the servers back (otp_pack import) are
+// not counted, but are still found as gets fall back to the disk whenever memory holds nothing for the user.
+// Pre-conditions: Memory store must exist and the name be shorter than STORE_USER_MAX.
+// Post-conditions: Returns 1 if the user has drops on disk, otherwise 0.
+int userHasDiskDrops(char* user) {
+    lockShared(&memoryStore->lock);
+    int index = findStoreUser(user, 0);
+    int hasDiskDrops = index != -1 && storeUsers[index].diskDrops > 0;
+    unlockShared(&memoryStore->lock);
 
-    // To hold sub directory of starting directory
-    struct dirent* file;
-    // To hold information about sub directory
-    struct stat fileAttributes;
+    return hasDiskDrops;
+}
 
-    // Check that directory could be opened
-    if (dirToExamine > 0) {
-        // Loop through directory contents
-        while ((file = readdir(dirToExamine)) != NULL) {
+// Claims the oldest stored drop of a user for sending, provided it was posted no later than notAfter (when given).
+// Pre-conditions: Memory store must exist and the name be shorter than STORE_USER_MAX.
+// Post-conditions: Returns the claimed drop (owned by this process) or -1.
+int claimStoreDrop(char* user, struct timespec* notAfter) {
+    int drop = -1;
 
-            // Check encountered file for username
-            if (strstr(file->d_name, user) != NULL) {
+    lockShared(&memoryStore->lock);
+    int index = findStoreUser(user, 0);
+    if (index != -1 && storeUsers[index].head != -1) {
+        struct timespec posted = storeDrops[storeUsers[index].head].posted;
+        if (notAfter == NULL || posted.tv_sec < notAfter->tv_sec ||
+            (posted.tv_sec == notAfter->tv_sec && posted.tv_nsec <= notAfter->tv_nsec)) {
+            drop = unqueueStoreDrop(index);
+            storeDrops[drop].state = 3;
+            storeDrops[drop].owner = getpid();
+            releaseStoreUserIfEmpty(index);
+        }
+    }
+    unlockShared(&memoryStore->lock);
 
-                // Get attributes
-                stat(file->d_name, &fileAttributes);
+    return drop;
+}
 
-                // Check if found file is older than last oldest file
-                // If so, update time and name of directory
-                if ((int) fileAttributes.st_mtime < oldestModified) {
-                    oldestModified = (int) fileAttributes.st_mtime;
+// Sends a claimed memory drop to otp in the same form as sendFile (size field followed by the bytes) and frees it.
+// Pre-conditions: Must be passed a valid/open socket connection and a drop claimed by this process.
+// Post-conditions: Drop is sent and its memory released.
+void sendStoreDrop(int communicationSocket, int drop) {
+    sendDropSize(communicationSocket, storeDrops[drop].size, 1, storeDrops[drop].crc);
 
-                    // Empty dirName contents and set filename of found file to dirName to be appended
-                    // to path.
-                    memset(dirName, '\0', 128);
-                    strcpy(dirName, file->d_name);
-                }
-            }
+    // Send straight from the shared blocks
+    long long left = storeDrops[drop].size;
+    int block = storeDrops[drop].firstBlock;
+    while (left > 0 && block != -1) {
+        int chunk = left < STORE_BLOCK_SIZE ? (int) left : STORE_BLOCK_SIZE;
+        if (send(communicationSocket, storeData + (long long) block * STORE_BLOCK_SIZE, chunk, 0) != chunk) {
+            break;
         }
+        recordTransfer(chunk);
+        left = left - chunk;
+        block = storeBlockNext[block];
     }
-    else {
-        perror("Could not open directory\n");
+
+    lockShared(&memoryStore->lock);
+    freeStoreDrop(drop);
+    unlockShared(&memoryStore->lock);
+}
+
+// Cleans up after a process that died owning memory drops. Drops it was receiving are discarded and drops it was
+// sending go back to the head of their users queue so they are delivered again.
+// Pre-conditions: Memory store must exist and pid must have exited.
+// Post-conditions: No drop is owned by pid.
+void reclaimStoreOwner(pid_t pid) {
+    int i;
+
+    lockShared(&memoryStore->lock);
+    for (i = 0; i < memoryStore->blocks.blockCount; i++) {
+        if (storeDrops[i].owner == pid && storeDrops[i].state == 1) {
+            freeStoreDrop(i);
+        }
+        else if (storeDrops[i].owner == pid && storeDrops[i].state == 3) {
+            queueStoreDrop(i, 1);
+        }
     }
+    unlockShared(&memoryStore->lock);
+}
 
-    // Close directory being searched
-    closedir(dirToExamine);
+// Removes stored drops older than the time to live. Queues are in posting order, so each is only walked up to its
+// first drop that has not expired.
+// Pre-conditions: Memory store must exist and dropTTL be greater than 0.
+// Post-conditions: Expired memory drops are freed and counted in the metrics.
+void expireStoreDrops(long now) {
+    int i;
 
-    // Set dirPath path as current working directory to have oldest user filename added to.
-//    char* dirPath = malloc(sizeof(char) * 256);
-    char dirPath[256];
-    memset(dirPath, '\0', 256);
-    getcwd(dirPath, 256);
+    lockShared(&memoryStore->lock);
+    for (i = 0; i < memoryStore->blocks.blockCount; i++) {
+        while (storeUsers[i].inUse && storeUsers[i].head != -1 &&
+               storeDrops[storeUsers[i].head].posted.tv_sec + dropTTL <= now) {
+            int drop = unqueueStoreDrop(i);
+            __atomic_add_fetch(&metrics->dropsExpired, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&metrics->bytesExpired, storeDrops[drop].size, __ATOMIC_RELAXED);
+            freeStoreDrop(drop);
+        }
+        if (storeUsers[i].inUse) {
+            releaseStoreUserIfEmpty(i);
+        }
+    }
+    unlockShared(&memoryStore->lock);
+}
 
-    char* pathName = malloc(sizeof(char) * 512);
-    memset(pathName, '\0', 512);
-    // Create path name for file creation
-    strcat(pathName, dirPath);
-    strcat(pathName, "/");
+// Creates a staging file for a message, locked so the sweeper leaves it alone while it is written. A file left under
+// the name by an earlier process with the same pid is unlinked rather than truncated, as it may already have been
+// published as a drop.
+// Pre-conditions: Must be passed the name of the staging file.
+// Post-conditions: Returns a descriptor of the new empty file, or -1.
+int createStagingFile(char* stagingName) {
+    remove(stagingName);
+    int fd = open(stagingName, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd >= 0) {
+        flock(fd, LOCK_EX);
+    }
 
-    // Check if file was found, if not return empty string.
-    if (strcmp(dirName, "") == 0) {
-        // Free memory allocated for filename and path string
-        free(dirName);
+    return fd;
+}
 
-        return "";
+// Writes exactly length bytes from buffer to fd, retrying on short writes.
+// Pre-conditions: Must be passed an open descriptor and a buffer of at least length bytes.
+// Post-conditions: Returns 0 if everything was written, otherwise -1.
+int writeAll(int fd, char* buffer, long long length) {
+    while (length > 0) {
+        ssize_t written = write(fd, buffer, length);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        buffer = buffer + written;
+        length = length - written;
     }
-    else {
-        strcat(pathName, dirName);
+
+    return 0;
+}
+
+// Sends exactly length bytes from buffer on a socket, retrying on short sends. A client that went away makes the
+// send fail instead of raising SIGPIPE.
+// Pre-conditions: Must be passed a valid/open socket connection and a buffer of at least length bytes.
+// Post-conditions: Returns 0 if everything was sent, otherwise -1.
+int sendAll(int communicationSocket, char* buffer, long long length) {
+    while (length > 0) {
+        ssize_t sent = send(communicationSocket, buffer, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return -1;
+        }
+        buffer = buffer + sent;
+        length = length - sent;
     }
 
-    // Free memory allocated for filename and path string
-    free(dirName);
+    return 0;
+}
+
+// Publishes a completely written staging file as a drop of user, so gets only ever see complete drops. The drop is
+// hard linked into place, which unlike rename never replaces a drop already there (one left by an earlier process
+// with the same pid, say), in which case the next free numeric prefix is taken.
+// Pre-conditions: Must be passed the name of a complete staging file, the users name, the numeric prefix to try
+// first and a buffer of size bytes for the drop name.
+// Post-conditions: Returns 0 with the drop name in the buffer and prefix set to the one used, or -1. The staging
+// file is left for the caller to remove.
+int publishDrop(char* stagingName, char* user, unsigned long long* prefix, char* dropName, int size) {
+    while (1) {
+        snprintf(dropName, size, "%llu_%s", *prefix, user);
+        if (link(stagingName, dropName) == 0) {
+            return 0;
+        }
+        if (errno != EEXIST) {
+            return -1;
+        }
+        *prefix = *prefix + 1;
+    }
+}
+
+// Writes every stored drop to disk as a regular <pid>_<user> drop with its posting time as modification time, so a
+// restarted otp_d (in either mode) delivers them in order. A drop that cannot be written whole stays in the store,
+// and so do the users later drops, which must not be delivered before it.
+// Pre-conditions: Memory store must exist and no child may be using it.
+// Post-conditions: Written drops are on disk and freed from memory. Returns the number of drops left in memory.
+int snapshotMemoryStore() {
+    int written = 0;
+    int failed = 0;
+    unsigned long long prefix = getpid();
+    int i;
+
+    for (i = 0; i < memoryStore->blocks.blockCount; i++) {
+        while (storeUsers[i].inUse && storeUsers[i].head != -1) {
+            int drop = unqueueStoreDrop(i);
+            char name[STORE_USER_MAX + 32];
+            char stagingName[64];
+
+            // Drops are written aside and published whole, a successor that took over the socket may already be
+            // serving gets from the directory
+            snprintf(stagingName, 64, "%s%d", POST_PREFIX, getpid());
+            int fd = createStagingFile(stagingName);
+
+            long long left = storeDrops[drop].size;
+            int block = storeDrops[drop].firstBlock;
+            int error = fd < 0;
+            while (!error && left > 0 && block != -1) {
+                int chunk = left < STORE_BLOCK_SIZE ? (int) left : STORE_BLOCK_SIZE;
+                error = writeAll(fd, storeData + (long long) block * STORE_BLOCK_SIZE, chunk) != 0;
+                left = left - chunk;
+                block = storeBlockNext[block];
+            }
+
+            if (!error) {
+                struct timespec times[2] = { storeDrops[drop].posted, storeDrops[drop].posted };
+                setDropChecksum(fd, storeDrops[drop].crc);
+                futimens(fd, times);
+                error = publishDrop(stagingName, storeDrops[drop].user, &prefix, name, sizeof(name)) != 0;
+            }
+            if (fd >= 0) {
+                remove(stagingName);
+                close(fd);
+            }
+
+            if (error) {
+                fprintf(stderr, "Could not write snapshot of drop for %s.\n", storeDrops[drop].user);
+                queueStoreDrop(drop, 1);
+                failed = failed + storeUsers[i].drops;
+                break;
+            }
+            written++;
+            prefix++;
+            freeStoreDrop(drop);
+        }
+    }
+
+    fprintf(stdout, "Snapshot wrote %d drops from memory\n", written);
+    if (failed > 0) {
+        fprintf(stderr, "Snapshot left %d drops in memory, they are lost when otp_d exits.\n", failed);
+    }
+    fflush(stdout);
+
+    return failed;
+}
+
+// Counts drops on disk per user at startup, so gets only search the disk for users that have drops there.
+// Pre-conditions: Memory store must exist.
+// Post-conditions: Disk drop counts reflect the current directory.
+void countDiskDrops() {
+    DIR* dirToExamine = opendir(".");
+    struct dirent* file;
+
+    if (dirToExamine == NULL) {
+        return;
+    }
+    while ((file = readdir(dirToExamine)) != NULL) {
+        int i = 0;
+        while (isdigit((unsigned char) file->d_name[i])) {
+            i++;
+        }
+        if (i > 0 && file->d_name[i] == '_') {
+            adjustDiskDrops(file->d_name, 1);
+        }
+    }
+    closedir(dirToExamine);
+}
+
+// Creates the shared hot-drop cache with room for capacity bytes of drops.
+// Pre-conditions: capacity must be at least CACHE_BLOCK_SIZE * CACHE_ENTRY_SHARE.
+// Post-conditions: dropCache and its sections are mapped and initialized. Exits on error.
+void initDropCache(long long capacity) {
+    int blockCount = (int) (capacity / CACHE_BLOCK_SIZE);
+    size_t size = sizeof(struct dropCache) +
+                  (sizeof(struct cacheEntry) + sizeof(int) + CACHE_BLOCK_SIZE) * (size_t) blockCount;
+
+    char* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (blockCount < 1 || mapping == MAP_FAILED) {
+        fprintf(stderr, "Could not allocate drop cache.\n");
+        exit(1);
+    }
+
+    dropCache = (struct dropCache*) mapping;
+    cacheEntries = (struct cacheEntry*) (mapping + sizeof(struct dropCache));
+    cacheBlockNext = (int*) (cacheEntries + blockCount);
+    cacheData = (char*) (cacheBlockNext + blockCount);
+
+    initSharedLock(&dropCache->lock);
+
+    int i;
+    initBlockPool(&dropCache->blocks, cacheBlockNext, blockCount, CACHE_BLOCK_SIZE);
+    for (i = 0; i < blockCount; i++) {
+        cacheEntries[i].next = i + 1 < blockCount ? i + 1 : -1;
+    }
+    for (i = 0; i < CACHE_BUCKETS; i++) {
+        dropCache->buckets[i] = -1;
+    }
+    dropCache->freeEntry = 0;
+}
+
+// Frees a cache entry and its blocks.
+// Pre-conditions: Caller must hold the cache lock. Entry must not be in the hash table.
+// Post-conditions: Entry and blocks are back on their free lists.
+void freeCacheEntry(int entry) {
+    freePoolBlocks(&dropCache->blocks, cacheBlockNext, cacheEntries[entry].firstBlock);
+
+    cacheEntries[entry].state = 0;
+    cacheEntries[entry].next = dropCache->freeEntry;
+    dropCache->freeEntry = entry;
+}
+
+// Removes a cached entry from the hash table.
+// Pre-conditions: Caller must hold the cache lock. Entry must be cached.
+// Post-conditions: Entry is no longer found by name.
+void unlinkCacheEntry(int entry) {
+    int* link = &dropCache->buckets[hashName(cacheEntries[entry].name) % CACHE_BUCKETS];
+    while (*link != entry) {
+        link = &cacheEntries[*link].next;
+    }
+    *link = cacheEntries[entry].next;
+}
+
+// Takes a block from the free list, evicting cached entries with the CLOCK algorithm when there is none. Entries
+// referenced since the hand last passed get a second chance, entries being filled or sent are skipped.
+// Pre-conditions: Caller must hold the cache lock.
+// Post-conditions: Returns the block index or -1 if nothing can be evicted.
+int allocateCacheBlock() {
+    int steps = 0;
+    while (dropCache->blocks.freeBlock == -1 && steps < 2 * dropCache->blocks.blockCount) {
+        int entry = dropCache->clockHand;
+        dropCache->clockHand = (dropCache->clockHand + 1) % dropCache->blocks.blockCount;
+        steps++;
+
+        if (cacheEntries[entry].state != 2) {
+            continue;
+        }
+        if (cacheEntries[entry].referenced) {
+            cacheEntries[entry].referenced = 0;
+            continue;
+        }
+        unlinkCacheEntry(entry);
+        freeCacheEntry(entry);
+        dropCache->evictions++;
+    }
+
+    return takePoolBlock(&dropCache->blocks, cacheBlockNext);
+}
+
+// Starts caching a drop that is being posted.
+// Pre-conditions: Drop cache must exist. Must be passed the drop file name (not path).
+// Post-conditions: Returns the entry, owned by this process, or -1 if none is free.
+int startCachedDrop(char* name) {
+    if (strlen(name) >= 256) {
+        return -1;
+    }
+
+    lockShared(&dropCache->lock);
+    int entry = dropCache->freeEntry;
+    if (entry != -1) {
+        dropCache->freeEntry = cacheEntries[entry].next;
+        cacheEntries[entry].state = 1;
+        cacheEntries[entry].referenced = 1;
+        cacheEntries[entry].owner = getpid();
+        strcpy(cacheEntries[entry].name, name);
+        cacheEntries[entry].size = 0;
+        cacheEntries[entry].firstBlock = -1;
+        cacheEntries[entry].lastBlock = -1;
+        cacheEntries[entry].next = -1;
+    }
+    unlockShared(&dropCache->lock);
+
+    return entry;
+}
+
+// Abandons caching of a drop being posted.
+// Pre-conditions: Entry must be owned by this process and being filled.
+// Post-conditions: Entry is freed.
+void abandonCachedDrop(int entry) {
+    lockShared(&dropCache->lock);
+    freeCacheEntry(entry);
+    unlockShared(&dropCache->lock);
+}
+
+// Copies received bytes of a drop being posted into its cache entry. Drops that outgrow their share of the cache, or
+// for which no block can be freed, are not cached.
+// Pre-conditions: Entry must be owned by this process and being filled.
+// Post-conditions: Returns 0 if the bytes were added, otherwise the entry is abandoned and -1 is returned.
+int appendCachedDrop(int entry, char* buffer, int length) {
+    struct cacheEntry* cached = &cacheEntries[entry];
+    if (cached->size + length > (long long) dropCache->blocks.blockCount * CACHE_BLOCK_SIZE / CACHE_ENTRY_SHARE) {
+        abandonCachedDrop(entry);
+        return -1;
+    }
+
+    while (length > 0) {
+        int offset = cached->size % CACHE_BLOCK_SIZE;
+        if (offset == 0) {
+            lockShared(&dropCache->lock);
+            int block = allocateCacheBlock();
+            unlockShared(&dropCache->lock);
+            if (block == -1) {
+                abandonCachedDrop(entry);
+                return -1;
+            }
+            if (cached->lastBlock == -1) {
+                cached->firstBlock = block;
+            }
+            else {
+                cacheBlockNext[cached->lastBlock] = block;
+            }
+            cached->lastBlock = block;
+        }
+
+        int chunk = CACHE_BLOCK_SIZE - offset < length ? CACHE_BLOCK_SIZE - offset : length;
+        memcpy(cacheData + (long long) cached->lastBlock * CACHE_BLOCK_SIZE + offset, buffer, chunk);
+        cached->size = cached->size + chunk;
+        buffer = buffer + chunk;
+        length = length - chunk;
+    }
+
+    return 0;
+}
+
+// Makes a fully received drop available to gets once its file is complete.
+// Pre-conditions: Entry must be owned by this process and hold every byte of the file at path, whose checksum is
+// crc.
+// Post-conditions: Entry is cached under its name, or abandoned if the file cannot be checked.
+void publishCachedDrop(int entry, char* path, uint32_t crc) {
+    struct stat fileAttributes;
+    if (stat(path, &fileAttributes) != 0 || fileAttributes.st_size != cacheEntries[entry].size) {
+        abandonCachedDrop(entry);
+        return;
+    }
+
+    lockShared(&dropCache->lock);
+    unsigned int bucket = hashName(cacheEntries[entry].name) % CACHE_BUCKETS;
+    cacheEntries[entry].modified = fileAttributes.st_mtim;
+    cacheEntries[entry].crc = crc;
+    cacheEntries[entry].state = 2;
+    cacheEntries[entry].owner = 0;
+    cacheEntries[entry].next = dropCache->buckets[bucket];
+    dropCache->buckets[bucket] = entry;
+    dropCache->insertions++;
+    unlockShared(&dropCache->lock);
+}
+
+// Drops the cached copy of a drop file that was delivered, expired or replaced.
+// Pre-conditions: Must be passed a drop file name (not path).
+// Post-conditions: No cached entry of that name remains.
+void invalidateCachedDrop(char* name) {
+    if (dropCache == NULL) {
+        return;
+    }
+
+    lockShared(&dropCache->lock);
+    int entry;
+    for (entry = dropCache->buckets[hashName(name) % CACHE_BUCKETS]; entry != -1; entry = cacheEntries[entry].next) {
+        if (strcmp(cacheEntries[entry].name, name) == 0) {
+            unlinkCacheEntry(entry);
+            freeCacheEntry(entry);
+            dropCache->invalidations++;
+            break;
+        }
+    }
+    unlockShared(&dropCache->lock);
+}
+
+// Serves a get from the cache if the drop is resident and its claimed file unchanged. The drop file has already
+// been claimed by sendFile, so only this get can deliver it; the entry is taken out of the cache under the lock and
+// freed once sent.
+// Pre-conditions: Drop cache must exist. Must be passed a valid/open socket, the drop name and the claimed file.
+// Post-conditions: Returns 1 if the drop was sent in full, -1 if sending failed part way and 0 if it is not cached
+// (nothing is sent). The drop file is left for the caller.
+int sendCachedDrop(int communicationSocket, char* name, int fd) {
+    struct stat fileAttributes;
+    if (fstat(fd, &fileAttributes) != 0) {
+        return 0;
+    }
+
+    int entry;
+    lockShared(&dropCache->lock);
+    for (entry = dropCache->buckets[hashName(name) % CACHE_BUCKETS]; entry != -1; entry = cacheEntries[entry].next) {
+        if (strcmp(cacheEntries[entry].name, name) == 0) {
+            break;
+        }
+    }
+    if (entry != -1) {
+        unlinkCacheEntry(entry);
+        // A file of the same name written since (pid reuse) makes the copy stale
+        if (cacheEntries[entry].size != fileAttributes.st_size ||
+            cacheEntries[entry].modified.tv_sec != fileAttributes.st_mtim.tv_sec ||
+            cacheEntries[entry].modified.tv_nsec != fileAttributes.st_mtim.tv_nsec) {
+            freeCacheEntry(entry);
+            dropCache->invalidations++;
+            entry = -1;
+        }
+        else {
+            cacheEntries[entry].state = 3;
+            cacheEntries[entry].owner = getpid();
+        }
+    }
+    if (entry == -1) {
+        dropCache->misses++;
+    }
+    else {
+        dropCache->hits++;
+    }
+    unlockShared(&dropCache->lock);
+
+    if (entry == -1) {
+        return 0;
+    }
+
+    sendDropSize(communicationSocket, cacheEntries[entry].size, 1, cacheEntries[entry].crc);
+
+    long long left = cacheEntries[entry].size;
+    int block = cacheEntries[entry].firstBlock;
+    while (left > 0 && block != -1) {
+        int chunk = left < CACHE_BLOCK_SIZE ? (int) left : CACHE_BLOCK_SIZE;
+        if (sendAll(communicationSocket, cacheData + (long long) block * CACHE_BLOCK_SIZE, chunk) != 0) {
+            break;
+        }
+        recordTransfer(chunk);
+        left = left - chunk;
+        block = cacheBlockNext[block];
+    }
+
+    lockShared(&dropCache->lock);
+    freeCacheEntry(entry);
+    unlockShared(&dropCache->lock);
+
+    return left == 0 ? 1 : -1;
+}
+
+// Frees cache entries a finished child was filling or sending.
+// Pre-conditions: Drop cache must exist and pid must have exited.
+// Post-conditions: No cache entry is owned by pid.
+void reclaimCacheOwner(pid_t pid) {
+    int i;
+
+    lockShared(&dropCache->lock);
+    for (i = 0; i < dropCache->blocks.blockCount; i++) {
+        if (cacheEntries[i].owner == pid && (cacheEntries[i].state == 1 || cacheEntries[i].state == 3)) {
+            freeCacheEntry(i);
+        }
+    }
+    unlockShared(&dropCache->lock);
+}
+
+// Sends the size, checksum and contents of a drop file. Drops may be larger than 2 GiB.
+// Pre-conditions: Must be passed a valid/open socket and a descriptor of the drop positioned at its start.
+// Post-conditions: Returns 1 if the drop was sent in full, otherwise -1.
+int sendDropFile(int communicationSocket, int fd) {
+    struct stat fileAttributes;
+    if (fstat(fd, &fileAttributes) != 0) {
+        return -1;
+    }
+    long long fileSize = (long long) fileAttributes.st_size;
+
+    // Send number of bytes that will be transmitted, with the checksum stored when the drop was posted
+    uint32_t crc = 0;
+    int hasChecksum = getDropChecksum(fd, &crc);
+    sendDropSize(communicationSocket, fileSize, hasChecksum, crc);
+
+    char* fileBuffer = malloc(UPLOAD_BUFFER_SIZE);
+    long long bytesSent = 0;
+    ssize_t bytesRead = 0;
+    //As long as file is being read, send its bytes to the client
+    while ((bytesRead = read(fd, fileBuffer, UPLOAD_BUFFER_SIZE)) > 0 &&
+           sendAll(communicationSocket, fileBuffer, bytesRead) == 0) {
+        bytesSent = bytesSent + bytesRead;
+        recordTransfer(bytesRead);
+    }
+    free(fileBuffer);
+
+    return bytesSent == fileSize ? 1 : -1;
+}
+
+// Claims the drop at path for one get by renaming it to a GET_PREFIX name in the same directory while holding a lock
+// on it. Of several gets that found the same drop only one rename succeeds. The lock tells the sweeper the claimed
+// drop is being sent.
+// Pre-conditions: Must be passed the path of a drop and a buffer of size bytes for the claimed path.
+// Post-conditions: Returns a locked descriptor of the drop, now at claimedPath, or -1 if another get took it first.
+int claimDropFile(char* path, char* claimedPath, int size) {
+    char* name = strrchr(path, '/') + 1;
+    snprintf(claimedPath, size, "%.*s%s%s", (int) (name - path), path, GET_PREFIX, name);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    flock(fd, LOCK_EX);
+
+    // The name may have been taken and reused for a newer drop before the rename, which is then put back
+    struct stat opened;
+    struct stat claimed;
+    if (rename(path, claimedPath) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (fstat(fd, &opened) != 0 || stat(claimedPath, &claimed) != 0 || opened.st_dev != claimed.st_dev ||
+        opened.st_ino != claimed.st_ino) {
+        rename(claimedPath, path);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Sends file text from provided path to socket provided. If unsuccessful, message is sent to stderr.
+// If successful, message is sent to client (otp). The drop is claimed first, so two gets can never both send it.
+// Drops resident in the hot-drop cache are sent without reading the file. A drop is only removed once every byte of
+// it was sent, one whose transfer broke off is put back under its name for the next get.
+// Pre-conditions: Must receive open socket connection and char* to path of file of which to send.
+// Post-conditions: Returns 0 if another get claimed the drop first, in which case nothing is sent, otherwise 1.
+// File text is sent if successful. If not, then error message is sent to stderr.
+int sendFile(int communicationSocket, char* path) {
+    char* name = strrchr(path, '/');
+    char* claimedPath = NULL;
+    int fd = -1;
+
+    // A drop that is gone by the time it is claimed was taken by another get
+    if (name != NULL) {
+        int claimedSize = strlen(path) + strlen(GET_PREFIX) + 1;
+        claimedPath = malloc(claimedSize);
+        fd = claimDropFile(path, claimedPath, claimedSize);
+        if (fd < 0 && access(path, F_OK) != 0) {
+            free(claimedPath);
+            return 0;
+        }
+    }
+
+    //File doesn't exist and/or cannot be opened
+    if (fd < 0) {
+        //Send file not found error message
+        char* message = "File not found or could not be opened.\n";
+        write(2, message, 39);
+
+        // If the file is not found, send failure message to client so that it does not wait for message.
+        send(communicationSocket, "0", 1, 0);
+        free(claimedPath);
+        return 1;
+    }
+    name++;
+
+    // Recently posted drops are usually still in the cache
+    int sent = dropCache != NULL ? sendCachedDrop(communicationSocket, name, fd) : 0;
+    if (sent == 0) {
+        sent = sendDropFile(communicationSocket, fd);
+    }
+
+    // Remove the drop that was sent and record its delivery for followers, or put it back for the next get
+    if (sent == -1) {
+        rename(claimedPath, path);
+        fprintf(stderr, "Drop %s was not sent in full.\n", path);
+    }
+    else if (removeFile(claimedPath) == 0) {
+        journalRecord('T', name);
+        adjustDiskDrops(name, -1);
+        invalidateCachedDrop(name);
+    }
+
+    // Closing the descriptor releases the claim
+    close(fd);
+    free(claimedPath);
+    return 1;
+}
+
+// Path to oldest file of user is determined and returned.
+// Pre-conditions: Must be passed char* of users name to find their corresponding files.
+// Post-conditions: If found, path to file is returned. If no valid file is found, an empty string
+// is returned.
+char* findOldestFilePath(char* user) {
+    // Declare variables to be used in directory manipulation. Nanoseconds are compared as well so drops posted
+    // (or imported by otp_pack) within the same second are still delivered in order.
+    struct timespec oldestModified = { 2147483647, 0 };
+
+    // Allocate memory fore filename in directory
+    char* dirName = malloc(sizeof(char) * 128);
+    memset(dirName, '\0', 128);
+
+    // Starting directory
+    DIR* dirToExamine = opendir(".");
+
+    // To hold sub directory of starting directory
+    struct dirent* file;
+    // To hold information about sub directory
+    struct stat fileAttributes;
+
+    // Check that directory could be opened
+    if (dirToExamine > 0) {
+        // Loop through directory contents
+        while ((file = readdir(dirToExamine)) != NULL) {
+
+            // Check encountered file for username
+            if (isDropOfUser(file->d_name, user)) {
+
+                // Get attributes
+                stat(file->d_name, &fileAttributes);
+
+                // Check if found file is older than last oldest file
+                // If so, update time and name of directory
+                if (fileAttributes.st_mtim.tv_sec < oldestModified.tv_sec ||
+                    (fileAttributes.st_mtim.tv_sec == oldestModified.tv_sec &&
+                     fileAttributes.st_mtim.tv_nsec < oldestModified.tv_nsec)) {
+                    oldestModified = fileAttributes.st_mtim;
+
+                    // Empty dirName contents and set filename of found file to dirName to be appended
+                    // to path.
+                    memset(dirName, '\0', 128);
+                    strcpy(dirName, file->d_name);
+                }
+            }
+        }
+    }
+    else {
+        perror("Could not open directory\n");
+    }
+
+    // Close directory being searched
+    closedir(dirToExamine);
+
+    // Set dirPath path as current working directory to have oldest user filename added to.
+//    char* dirPath = malloc(sizeof(char) * 256);
+    char dirPath[256];
+    memset(dirPath, '\0', 256);
+    getcwd(dirPath, 256);
+
+    char* pathName = malloc(sizeof(char) * 512);
+    memset(pathName, '\0', 512);
+    // Create path name for file creation
+    strcat(pathName, dirPath);
+    strcat(pathName, "/");
+
+    // Check if file was found, if not return empty string.
+    if (strcmp(dirName, "") == 0) {
+        // Free memory allocated for filename and path string
+        free(dirName);
+
+        return "";
+    }
+    else {
+        strcat(pathName, dirName);
+    }
+
+    // Free memory allocated for filename and path string
+    free(dirName);
+
+    return pathName;
+}
+
+// If otp sends request for get command, operations are performed in this function to
+// find the oldest file for the provided users name and send it over the socket connection.
+// Pre-conditions: Parameters for a valid open socket connection and a string representation of
+// a users name must be provided.
+// Post-conditions: Oldest file text is sent over socket connection.
+void performGetOperations(int communicationSocket, char* user) {
+    char* filePath = NULL;
+
+    // In memory store mode the oldest drop may be held in memory. Users with no drops on disk are served without
+    // touching the filesystem, otherwise the older of the oldest file and the oldest memory drop is sent.
+    if (memoryStore != NULL && strlen(user) < STORE_USER_MAX) {
+        int drop = -1;
+        if (!userHasDiskDrops(user)) {
+            drop = claimStoreDrop(user, NULL);
+        }
+        if (drop == -1) {
+            struct stat fileAttributes;
+            filePath = findOldestFilePath(user);
+            if (strcmp(filePath, "") == 0) {
+                drop = claimStoreDrop(user, NULL);
+            }
+            else if (stat(filePath, &fileAttributes) == 0) {
+                drop = claimStoreDrop(user, &fileAttributes.st_mtim);
+            }
+        }
+
+        if (drop != -1) {
+            __atomic_add_fetch(&metrics->getsServed, 1, __ATOMIC_RELAXED);
+            traceOutcome(TRACE_DELIVERED);
+            sendStoreDrop(communicationSocket, drop);
+            if (filePath != NULL && strcmp(filePath, "") != 0) {
+                free(filePath);
+            }
+            return;
+        }
+    }
+
+    // Find the oldest filename and its path of the provided user and return to filePath
+    if (filePath == NULL) {
+        filePath = findOldestFilePath(user);
+    }
+
+    // Send the file to the client over the socket in sections. If another get claimed the oldest drop first, the
+    // next oldest is tried.
+    while (strcmp(filePath, "") != 0 && sendFile(communicationSocket, filePath) == 0) {
+        free(filePath);
+        filePath = findOldestFilePath(user);
+    }
+
+    // If filePath is empty, no file could be found and sendFile told otp so
+    if (strcmp(filePath, "") == 0) {
+        sendFile(communicationSocket, filePath);
+        __atomic_add_fetch(&metrics->getsEmpty, 1, __ATOMIC_RELAXED);
+        traceOutcome(TRACE_EMPTY);
+    }
+    else {
+        __atomic_add_fetch(&metrics->getsServed, 1, __ATOMIC_RELAXED);
+        traceOutcome(TRACE_DELIVERED);
+
+        // Free the file path
+        free(filePath);
+    }
+}
+
+// Totals the number of drops and bytes currently stored for a user, on disk and in the memory store.
+// Pre-conditions: Must be passed a users name and locations for the totals.
+// Post-conditions: Drop count and total size of the users drops are stored in the parameters.
+void measureUserDrops(char* user, long* dropCount, long long* dropBytes) {
+    *dropCount = 0;
+    *dropBytes = 0;
+
+    DIR* dirToExamine = opendir(".");
+    if (dirToExamine == NULL) {
+        perror("Could not open directory\n");
+        return;
+    }
+
+    struct dirent* file;
+    struct stat fileAttributes;
+    // Loop through directory contents and total the users drops
+    while ((file = readdir(dirToExamine)) != NULL) {
+        if (isDropOfUser(file->d_name, user) && stat(file->d_name, &fileAttributes) == 0) {
+            *dropCount = *dropCount + 1;
+            *dropBytes = *dropBytes + fileAttributes.st_size;
+        }
+    }
+
+    closedir(dirToExamine);
+
+    // Include drops held in the memory store
+    if (memoryStore != NULL && strlen(user) < STORE_USER_MAX) {
+        lockShared(&memoryStore->lock);
+        int index = findStoreUser(user, 0);
+        if (index != -1) {
+            *dropCount = *dropCount + storeUsers[index].drops;
+            *dropBytes = *dropBytes + storeUsers[index].bytes;
+        }
+        unlockShared(&memoryStore->lock);
+    }
+}
+
+// Rejects a post that would exceed the users quota or does not fit in the memory store. otp is told the reason and
+// the rest of its upload is read and discarded so that the rejection message is not lost to a connection reset.
+// Pre-conditions: Must be passed a valid/open socket connection, the users name, the bytes already received and the
+// reason sent to otp ("QUOTA_EXCEEDED", "STORE_FULL" or "WRITE_FAILED").
+// Post-conditions: Rejection is sent to otp, counted in the metrics and reported on stderr.
+void rejectPost(int communicationSocket, char* user, long long bytesReceived, char* reason) {
+    send(communicationSocket, reason, strlen(reason), 0);
+    shutdown(communicationSocket, SHUT_WR);
+
+    // Drain remaining upload
+    char drainBuffer[4096];
+    int valread = 0;
+    while ((valread = recv(communicationSocket, drainBuffer, 4096, 0)) > 0) {
+        bytesReceived = bytesReceived + valread;
+        if (childSlot >= 0) {
+            progress[childSlot].discarded = progress[childSlot].discarded + valread;
+        }
+    }
+    traceOutcome(TRACE_REJECTED);
+
+    __atomic_add_fetch(&metrics->postsRejectedCount, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&metrics->postsRejectedBytes, bytesReceived, __ATOMIC_RELAXED);
+
+    if (strcmp(reason, "STORE_FULL") == 0) {
+        fprintf(stderr, "Memory store full, post for user %s rejected.\n", user);
+    }
+    else if (strcmp(reason, "QUOTA_EXCEEDED") == 0) {
+        fprintf(stderr, "Quota exceeded for user %s, post rejected.\n", user);
+    }
+}
+
+// Tells the sweeper about a newly stored drop so it can be scheduled for expiry. The pipe is non-blocking; a drop
+// that cannot be announced is picked up by the sweeper's periodic rescan instead.
+// Pre-conditions: Must be passed the file name (not path) of the new drop.
+// Post-conditions: Name is written to the sweeper pipe if expiry is enabled.
+void notifySweeper(char* dropName) {
+    if (sweeperNotifyFd < 0) {
+        return;
+    }
+
+    char line[258];
+    int length = snprintf(line, 258, "%s\n", dropName);
+    if (length > 0 && length < 258) {
+        write(sweeperNotifyFd, line, length);
+    }
+}
+
+// Adds a block to a drop being received.
+// Pre-conditions: Drop must be owned by this process.
+// Post-conditions: Returns 0 if the drop has room for another STORE_BLOCK_SIZE bytes, -1 if the store is full.
+int extendStoreDrop(int drop) {
+    lockShared(&memoryStore->lock);
+    int block = takePoolBlock(&memoryStore->blocks, storeBlockNext);
+    unlockShared(&memoryStore->lock);
+    if (block == -1) {
+        return -1;
+    }
+
+    if (storeDrops[drop].lastBlock == -1) {
+        storeDrops[drop].firstBlock = block;
+    }
+    else {
+        storeBlockNext[storeDrops[drop].lastBlock] = block;
+    }
+    storeDrops[drop].lastBlock = block;
+
+    return 0;
+}
+
+// Receives a post straight into memory store blocks, taking blocks as the message arrives. The byte quota is
+// enforced as in performPostOperations.
+// Pre-conditions: Memory store must exist and the name be shorter than STORE_USER_MAX.
+// Post-conditions: Returns 1 if the drop was stored and -1 if it was rejected. Returns 0 if the store filled up,
+// with drop set to the partly received drop (still owned by this process) or -1 if none could be started.
+int receiveIntoMemory(int communicationSocket, char* user, long long userBytes, long long* bytesReceived, int* drop) {
+    lockShared(&memoryStore->lock);
+    *drop = memoryStore->freeDrop;
+    if (*drop != -1) {
+        memoryStore->freeDrop = storeDrops[*drop].next;
+        storeDrops[*drop].state = 1;
+        storeDrops[*drop].owner = getpid();
+        strcpy(storeDrops[*drop].user, user);
+        storeDrops[*drop].size = 0;
+        storeDrops[*drop].crc = 0;
+        storeDrops[*drop].firstBlock = -1;
+        storeDrops[*drop].lastBlock = -1;
+        storeDrops[*drop].next = -1;
+    }
+    unlockShared(&memoryStore->lock);
+    if (*drop == -1) {
+        return 0;
+    }
+
+    struct storeDropRecord* record = &storeDrops[*drop];
+    long long allocated = 0;
+    while (1) {
+        if (record->size == allocated) {
+            if (extendStoreDrop(*drop) != 0) {
+                return 0;
+            }
+            allocated = allocated + STORE_BLOCK_SIZE;
+        }
+
+        char* position = storeData + (long long) record->lastBlock * STORE_BLOCK_SIZE + record->size % STORE_BLOCK_SIZE;
+        int valread = recv(communicationSocket, position, STORE_BLOCK_SIZE - record->size % STORE_BLOCK_SIZE, 0);
+        if (valread == 0 || valread == -1) {
+            break;
+        }
+
+        record->crc = crc32cUpdate(record->crc, position, valread);
+        record->size = record->size + valread;
+        *bytesReceived = *bytesReceived + valread;
+        recordTransfer(valread);
+        if (quotaBytes > 0 && userBytes + *bytesReceived + 1 > quotaBytes) {
+            lockShared(&memoryStore->lock);
+            freeStoreDrop(*drop);
+            unlockShared(&memoryStore->lock);
+            rejectPost(communicationSocket, user, *bytesReceived, "QUOTA_EXCEEDED");
+            return -1;
+        }
+    }
+
+    // Add final newline character at end of message
+    if (record->size == allocated && extendStoreDrop(*drop) != 0) {
+        return 0;
+    }
+    storeData[(long long) record->lastBlock * STORE_BLOCK_SIZE + record->size % STORE_BLOCK_SIZE] = '\n';
+    record->crc = crc32cUpdate(record->crc, "\n", 1);
+    record->size++;
+    clock_gettime(CLOCK_REALTIME, &record->posted);
+
+    lockShared(&memoryStore->lock);
+    queueStoreDrop(*drop, 0);
+    unlockShared(&memoryStore->lock);
+
+    return 1;
+}
+
+// Moves a partly received memory drop into its file on disk when the store filled up, and frees it.
+// Pre-conditions: Drop must be owned by this process. File may be NULL, in which case the drop is only freed.
+// Post-conditions: Drop bytes are written to the file and the drop is freed. Returns the checksum of those bytes.
+uint32_t spillStoreDrop(int drop, FILE* fPointer) {
+    uint32_t crc = storeDrops[drop].crc;
+    long long left = storeDrops[drop].size;
+    int block = storeDrops[drop].firstBlock;
+    while (fPointer != NULL && left > 0 && block != -1) {
+        int chunk = left < STORE_BLOCK_SIZE ? (int) left : STORE_BLOCK_SIZE;
+        fwrite(storeData + (long long) block * STORE_BLOCK_SIZE, 1, chunk, fPointer);
+        left = left - chunk;
+        block = storeBlockNext[block];
+    }
+
+    lockShared(&memoryStore->lock);
+    freeStoreDrop(drop);
+    unlockShared(&memoryStore->lock);
+
+    return crc;
+}
+
+// If otp sends request for post command, operations are performed in this function to
+// receive the encrypted file over the socket connection and write that message to a file
+// for that user. The file will be of the format: <pid>_<user>, and only appears once the whole message is in it.
+// The users drop count and byte quotas are enforced before and while the message is received. As children run
+// concurrently, simultaneous posts for one user may overshoot a quota by at most the other posts in flight.
+// In memory store mode the drop is kept in memory instead. A drop that does not fit is rejected, or with -s moved to
+// disk along with the rest of the message. The CRC32C of the drop is calculated as it arrives and stored with it.
+// Pre-conditions: A valid/open socket connection and a string of the users name are passed as parameters.
+// Post-conditions: If successful, an encrypted files text is received over the socket connection and saved to
+// a file for that user with the users name listed. If unsuccessful, a corresponding error is printed to stderr.
+void performPostOperations(int communicationSocket, char* user) {
+    // Set read buffer to receive messages from otp_d server
+    char* readBuffer = malloc(sizeof(char) * 2056);
+    memset(readBuffer, '\0', 2056);
+
+    // Check the users drop count quota before accepting anything
+    long userDrops = 0;
+    long long userBytes = 0;
+    if (quotaDrops > 0 || quotaBytes > 0) {
+        measureUserDrops(user, &userDrops, &userBytes);
+    }
+    if (quotaDrops > 0 && userDrops >= quotaDrops) {
+        rejectPost(communicationSocket, user, 0, "QUOTA_EXCEEDED");
+        free(readBuffer);
+        return;
+    }
+
+    long long bytesReceived = 0;
+    int drop = -1;
+    if (memoryStore != NULL && strlen(user) < STORE_USER_MAX) {
+        int stored = receiveIntoMemory(communicationSocket, user, userBytes, &bytesReceived, &drop);
+        if (stored == 1) {
+            __atomic_add_fetch(&metrics->postsAccepted, 1, __ATOMIC_RELAXED);
+            traceOutcome(TRACE_STORED);
+            __atomic_add_fetch(&metrics->bytesAccepted, bytesReceived + 1, __ATOMIC_RELAXED);
+            fprintf(stdout, "Stored drop for %s in memory\n", user);
+            fflush(stdout);
+        }
+        else if (stored == 0 && !storeSpill) {
+            if (drop != -1) {
+                spillStoreDrop(drop, NULL);
+            }
+            __atomic_add_fetch(&memoryStore->rejectedDrops, 1, __ATOMIC_RELAXED);
+            rejectPost(communicationSocket, user, bytesReceived, "STORE_FULL");
+        }
+        if (stored != 0 || !storeSpill) {
+            free(readBuffer);
+            return;
+        }
+        __atomic_add_fetch(&memoryStore->spilledDrops, 1, __ATOMIC_RELAXED);
+    }
+
+    // GET MESSAGE AND ADD TO FILE
+    // The message is received into a staging file, which gets never look at, and published once complete
+    char stagingName[64];
+    snprintf(stagingName, 64, "%s%d", POST_PREFIX, getpid());
+    char dropName[STORE_USER_MAX + 1100];
+    snprintf(dropName, sizeof(dropName), "%d_%s", getpid(), user);
+
+    int stagingFd = createStagingFile(stagingName);
+    FILE *fPointer = stagingFd >= 0 ? fdopen(stagingFd, "w") : NULL;
+
+    // Move anything already received into memory to the file
+    uint32_t crc = 0;
+    if (drop != -1) {
+        crc = spillStoreDrop(drop, fPointer);
+    }
+
+    // Keep a copy of the drop in the hot-drop cache while it is written, drops that spilled are too big for it
+    int cached = -1;
+    if (dropCache != NULL && fPointer != NULL && drop == -1) {
+        cached = startCachedDrop(dropName);
+    }
+
+    // Check to see if file was opened
+    if (fPointer == NULL) {
+        char* message = "Error opening a file.\n";
+        write(2, message, 21);
+
+        free(readBuffer);
+        return;
+    }
+
+    int valread = 0;
+    // Loop until all of message is received from otp. Message will be received in chunks of 1024.
+    while (valread != -1) {
+
+        // Clear buffer
+        memset(readBuffer, '\0', 2056);
+
+        // Get encrypted message from the client
+        valread = recv(communicationSocket, readBuffer, 1024, 0);
+
+        // If message indicating send is completed is sent, exit read loop.
+        if (valread == 0) {
+            break;
+        }
+
+        // A connection that failed mid-message leaves nothing behind
+        if (valread == -1) {
+            if (cached != -1) {
+                abandonCachedDrop(cached);
+            }
+            fclose(fPointer);
+            removeFile(stagingName);
+            fprintf(stderr, "Post for user %s failed after %lld bytes.\n", user, bytesReceived);
+
+            free(readBuffer);
+            return;
+        }
+
+        // Stop as soon as the stored drop (including its trailing newline) would exceed the users byte quota
+        bytesReceived = bytesReceived + valread;
+        recordTransfer(valread);
+        if (quotaBytes > 0 && userBytes + bytesReceived + 1 > quotaBytes) {
+            if (cached != -1) {
+                abandonCachedDrop(cached);
+            }
+            fclose(fPointer);
+            removeFile(stagingName);
+            rejectPost(communicationSocket, user, bytesReceived, "QUOTA_EXCEEDED");
+
+            free(readBuffer);
+            return;
+        }
+
+        // Write exactly the bytes received, binary mode messages may contain any byte value
+        if (fwrite(readBuffer, 1, valread, fPointer) != (size_t) valread) {
+            break;
+        }
+        crc = crc32cUpdate(crc, readBuffer, valread);
+        if (cached != -1 && appendCachedDrop(cached, readBuffer, valread) != 0) {
+            cached = -1;
+        }
+    }
+
+    // Add final newline character at end of message
+    fputc('\n', fPointer);
+    crc = crc32cUpdate(crc, "\n", 1);
+
+    // A drop that could not be written in full (the disk filled up, say) is never published
+    if (fflush(fPointer) != 0 || ferror(fPointer)) {
+        if (cached != -1) {
+            abandonCachedDrop(cached);
+        }
+        fclose(fPointer);
+        removeFile(stagingName);
+        fprintf(stderr, "Could not write drop for user %s.\n", user);
+        rejectPost(communicationSocket, user, bytesReceived, "WRITE_FAILED");
+
+        free(readBuffer);
+        return;
+    }
+
+    // Publish the file, still locked so the sweeper cannot take it, then close it. The journal record that follows
+    // is the commit record for followers.
+    setDropChecksum(fileno(fPointer), crc);
+    unsigned long long prefix = getpid();
+    char* expectedName = strdup(dropName);
+    if (publishDrop(stagingName, user, &prefix, dropName, sizeof(dropName)) != 0) {
+        if (cached != -1) {
+            abandonCachedDrop(cached);
+        }
+        removeFile(stagingName);
+        fclose(fPointer);
+        fprintf(stderr, "Could not publish drop for user %s.\n", user);
+
+        free(expectedName);
+        free(readBuffer);
+        return;
+    }
+    remove(stagingName);
+    fclose(fPointer);
+
+    // The cached copy was started under the name the drop was expected to get
+    if (cached != -1 && strcmp(dropName, expectedName) == 0 && appendCachedDrop(cached, "\n", 1) == 0) {
+        publishCachedDrop(cached, dropName, crc);
+    }
+    else if (cached != -1) {
+        abandonCachedDrop(cached);
+    }
+    free(expectedName);
+
+    __atomic_add_fetch(&metrics->postsAccepted, 1, __ATOMIC_RELAXED);
+    traceOutcome(TRACE_STORED);
+    __atomic_add_fetch(&metrics->bytesAccepted, bytesReceived + 1, __ATOMIC_RELAXED);
+    notifySweeper(dropName);
+    journalRecord('P', dropName);
+    adjustDiskDrops(dropName, 1);
+
+    // Output message with path of new file
+    char dirPath[256];
+    getcwd(dirPath, 256);
+    fprintf(stdout, "%s/%s\n", dirPath, dropName);
+
+    fflush(stdout);
+
+    // Free allocated memory for read buffer
+    free(readBuffer);
+}
+
+// Reads one newline terminated line from a socket a byte at a time, so nothing after it is consumed.
+// Pre-conditions: Must be passed a valid/open socket connection and a buffer of max bytes.
+// Post-conditions: Returns the length of the line (without newline, NUL terminated) or -1 if none was received.
+int receiveLine(int communicationSocket, char* line, int max) {
+    int length = 0;
+    while (length < max - 1) {
+        if (recv(communicationSocket, line + length, 1, 0) != 1) {
+            return -1;
+        }
+        if (line[length] == '\n') {
+            break;
+        }
+        length++;
+    }
+    line[length] = '\0';
+
+    return length < max - 1 ? length : -1;
+}
+
+// Finds the checksum of the bytes already staged for an upload. It is normally saved when a connection ends, only an
+// upload whose child was killed has to be read back.
+// Pre-conditions: Must be passed a descriptor of the staged upload and the number of bytes staged.
+// Post-conditions: Returns the CRC32C of the staged bytes.
+uint32_t stagedChecksum(int fd, long long staged) {
+    char value[40];
+    long long offset = -1;
+    uint32_t crc = 0;
+
+    memset(value, '\0', 40);
+    if (fgetxattr(fd, UPLOAD_CRC_XATTR, value, 39) > 0 && sscanf(value, "%lld %8x", &offset, &crc) == 2 &&
+        offset == staged) {
+        return crc;
+    }
+
+    char* readBuffer = malloc(UPLOAD_BUFFER_SIZE);
+    crc = 0;
+    offset = 0;
+    while (offset < staged) {
+        ssize_t valread = pread(fd, readBuffer, UPLOAD_BUFFER_SIZE, offset);
+        if (valread <= 0) {
+            break;
+        }
+        crc = crc32cUpdate(crc, readBuffer, valread);
+        offset = offset + valread;
+    }
+    free(readBuffer);
+
+    return crc;
+}
+
+// Looks for an undelivered drop of user that was published from the chunked upload with the given id, so a client
+// that missed the "COMPLETE" reply is not made to upload the message a second time.
+// Pre-conditions: Must be passed the users name and an upload id.
+// Post-conditions: Returns 1 if such a drop exists, otherwise 0.
+int findPublishedUpload(char* user, char* uploadId) {
+    DIR* dirToExamine = opendir(".");
+    struct dirent* file;
+    char value[65];
+    int found = 0;
+
+    if (dirToExamine == NULL) {
+        return 0;
+    }
+
+    while (!found && (file = readdir(dirToExamine)) != NULL) {
+        if (!isDropOfUser(file->d_name, user)) {
+            continue;
+        }
+        memset(value, '\0', 65);
+        if (getxattr(file->d_name, UPLOAD_ID_XATTR, value, 64) > 0 && strcmp(value, uploadId) == 0) {
+            found = 1;
+        }
+    }
+    closedir(dirToExamine);
+
+    return found;
+}
+
+// If otp sends request for chunk command, a resumable upload is received. otp first sends "<upload id> <size>" and
+// is told the offset already staged for that id ("OFFSET <n>"), then sends the rest of the message from there. The
+// message is staged in .upload_<id>_<user> and only published as a <pid>_<user> drop (with its trailing newline)
+// once all of it is staged, after which "COMPLETE" is sent. A connection lost part way leaves the staged bytes for
+// otp to resume from. Another connection already uploading the same id is answered with "BUSY". The checksum of the
+// staged bytes is kept with them so the published drop gets its CRC32C without reading it again. The published drop
+// carries the upload id, and an upload whose drop is still waiting is answered with "COMPLETE" straight away.
+// Pre-conditions: A valid/open socket connection and a string of the users name are passed as parameters.
+// Post-conditions: Staged upload is extended and published once complete. Errors are reported on stderr.
+void performChunkOperations(int communicationSocket, char* user) {
+    char header[128];
+    char uploadId[65];
+    long long totalSize = 0;
+
+    if (receiveLine(communicationSocket, header, 128) < 0 ||
+        sscanf(header, "%64s %lld", uploadId, &totalSize) != 2 || totalSize < 0) {
+        fprintf(stderr, "Malformed chunked upload header.\n");
+        return;
+    }
+    int i;
+    for (i = 0; uploadId[i] != '\0'; i++) {
+        if (!isalnum((unsigned char) uploadId[i])) {
+            fprintf(stderr, "Malformed chunked upload id.\n");
+            return;
+        }
+    }
+
+    // The whole upload is checked against the users quotas before anything is staged
+    long userDrops = 0;
+    long long userBytes = 0;
+    if (quotaDrops > 0 || quotaBytes > 0) {
+        measureUserDrops(user, &userDrops, &userBytes);
+    }
+    if ((quotaDrops > 0 && userDrops >= quotaDrops) || (quotaBytes > 0 && userBytes + totalSize + 1 > quotaBytes)) {
+        rejectPost(communicationSocket, user, 0, "QUOTA_EXCEEDED");
+        return;
+    }
+
+    char stagingName[1200];
+    snprintf(stagingName, sizeof(stagingName), "%s%s_%s", UPLOAD_PREFIX, uploadId, user);
+    struct stat fileAttributes;
+    struct stat nameAttributes;
+    int fd = -1;
+    while (fd < 0) {
+        fd = open(stagingName, O_WRONLY | O_CREAT, 0666);
+        if (fd < 0) {
+            fprintf(stderr, "Could not open staged upload %s.\n", stagingName);
+            return;
+        }
+        if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+            send(communicationSocket, "BUSY\n", 5, MSG_NOSIGNAL);
+            close(fd);
+            return;
+        }
+
+        // The connection that held the lock may have published the file and removed its name in the meantime, the
+        // file is then a drop and must not be touched. A staging file that is also a drop was published by a child
+        // killed before it removed the name, it is dropped and the upload starts over under a new file.
+        fstat(fd, &fileAttributes);
+        if (stat(stagingName, &nameAttributes) != 0 || nameAttributes.st_dev != fileAttributes.st_dev ||
+            nameAttributes.st_ino != fileAttributes.st_ino || fileAttributes.st_nlink > 1) {
+            if (fileAttributes.st_nlink > 1) {
+                remove(stagingName);
+            }
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    // A fresh staging file may belong to an upload that was already published, its client missed the reply
+    long long staged = fileAttributes.st_size;
+    if (staged == 0 && findPublishedUpload(user, uploadId)) {
+        remove(stagingName);
+        close(fd);
+        send(communicationSocket, "COMPLETE\n", 9, MSG_NOSIGNAL);
+        traceOutcome(TRACE_STORED);
+        fprintf(stdout, "Upload %s for user %s was already published\n", uploadId, user);
+        fflush(stdout);
+        return;
+    }
+
+    // Staged bytes beyond the announced size mean the id was reused for another message, start over
+    if (staged > totalSize) {
+        ftruncate(fd, 0);
+        staged = 0;
+    }
+    lseek(fd, staged, SEEK_SET);
+    uint32_t crc = stagedChecksum(fd, staged);
+
+    char reply[40];
+    int length = snprintf(reply, 40, "OFFSET %lld\n", staged);
+    send(communicationSocket, reply, length, MSG_NOSIGNAL);
+
+    char* readBuffer = malloc(UPLOAD_BUFFER_SIZE);
+    while (staged < totalSize) {
+        long long wanted = totalSize - staged < UPLOAD_BUFFER_SIZE ? totalSize - staged : UPLOAD_BUFFER_SIZE;
+        int valread = recv(communicationSocket, readBuffer, wanted, 0);
+        if (valread <= 0 || writeAll(fd, readBuffer, valread) != 0) {
+            break;
+        }
+        staged = staged + valread;
+        crc = crc32cUpdate(crc, readBuffer, valread);
+        recordTransfer(valread);
+    }
+    free(readBuffer);
+
+    if (staged < totalSize) {
+        length = snprintf(reply, 40, "%lld %08x", staged, crc);
+        fsetxattr(fd, UPLOAD_CRC_XATTR, reply, length, 0);
+        fprintf(stderr, "Upload %s for user %s paused at %lld of %lld bytes.\n", uploadId, user, staged, totalSize);
+        traceOutcome(TRACE_PAUSED);
+        close(fd);
+        return;
+    }
+
+    // Publish the complete message as a regular drop
+    char dropName[1100];
+    snprintf(dropName, sizeof(dropName), "%d_%s", getpid(), user);
+    crc = crc32cUpdate(crc, "\n", 1);
+    setDropChecksum(fd, crc);
+    fremovexattr(fd, UPLOAD_CRC_XATTR);
+    fsetxattr(fd, UPLOAD_ID_XATTR, uploadId, strlen(uploadId), 0);
+    unsigned long long prefix = getpid();
+    if (writeAll(fd, "\n", 1) != 0 || publishDrop(stagingName, user, &prefix, dropName, sizeof(dropName)) != 0) {
+        fprintf(stderr, "Could not publish upload %s for user %s.\n", uploadId, user);
+        close(fd);
+        return;
+    }
+    remove(stagingName);
+    close(fd);
+
+    __atomic_add_fetch(&metrics->postsAccepted, 1, __ATOMIC_RELAXED);
+    traceOutcome(TRACE_STORED);
+    __atomic_add_fetch(&metrics->bytesAccepted, totalSize + 1, __ATOMIC_RELAXED);
+    notifySweeper(dropName);
+    journalRecord('P', dropName);
+    adjustDiskDrops(dropName, 1);
+    send(communicationSocket, "COMPLETE\n", 9, MSG_NOSIGNAL);
+
+    fprintf(stdout, "Published upload %s as %s\n", uploadId, dropName);
+    fflush(stdout);
+}
+
+// If otp sends request for fan command, one message is received for several users. The user sent in the handshake
+// is a comma separated list of recipients. The message is received once into a staging file, which is then hard
+// linked into place as a <pid>_<user> drop for every recipient and unlinked. The recipients drops share one copy
+// of the data: each get removes one link and the file system reclaims the data after the last delivery.
+// The drop quota of every recipient is checked up front, and the byte quota against the recipient with the least
+// room left, in which case the whole post is rejected. Delivery is all or nothing: if the drop of any recipient
+// cannot be stored, the drops already linked are removed and otp is told with FANOUT_FAILED, so it can safely
+// post again.
+// Pre-conditions: A valid/open socket connection and the list of recipients are passed as parameters.
+// Post-conditions: If successful, every recipient has a drop of the message. Errors are reported on stderr.
+void performFanoutOperations(int communicationSocket, char* recipientList) {
+    char* recipients[FANOUT_MAX];
+    int recipientCount = 0;
+
+    // Split the list, ignoring repeated recipients
+    char* list = strdup(recipientList);
+    char* recipient = strtok(list, ",");
+    while (recipient != NULL) {
+        int duplicate = 0;
+        int i;
+        for (i = 0; i < recipientCount; i++) {
+            if (strcmp(recipients[i], recipient) == 0) {
+                duplicate = 1;
+            }
+        }
+        if (strchr(recipient, '/') != NULL || (!duplicate && recipientCount == FANOUT_MAX)) {
+            fprintf(stderr, "Fan-out recipients must be at most %d valid user names.\n", FANOUT_MAX);
+            free(list);
+            return;
+        }
+        if (!duplicate) {
+            recipients[recipientCount] = recipient;
+            recipientCount++;
+        }
+        recipient = strtok(NULL, ",");
+    }
+    if (recipientCount == 0) {
+        free(list);
+        return;
+    }
+
+    // Find the recipient with the least room left
+    long long roomLeft = -1;
+    int i;
+    for (i = 0; i < recipientCount && (quotaDrops > 0 || quotaBytes > 0); i++) {
+        long userDrops = 0;
+        long long userBytes = 0;
+        measureUserDrops(recipients[i], &userDrops, &userBytes);
+        if (quotaDrops > 0 && userDrops >= quotaDrops) {
+            rejectPost(communicationSocket, recipients[i], 0, "QUOTA_EXCEEDED");
+            free(list);
+            return;
+        }
+        if (quotaBytes > 0 && (roomLeft == -1 || quotaBytes - userBytes < roomLeft)) {
+            roomLeft = quotaBytes - userBytes;
+        }
+    }
+
+    char stagingName[64];
+    snprintf(stagingName, 64, "%s%d", FANOUT_PREFIX, getpid());
+    int stagingFd = createStagingFile(stagingName);
+    FILE* fPointer = stagingFd >= 0 ? fdopen(stagingFd, "w") : NULL;
+    if (fPointer == NULL) {
+        fprintf(stderr, "Error opening a file.\n");
+        free(list);
+        return;
+    }
+
+    char* readBuffer = malloc(UPLOAD_BUFFER_SIZE);
+    long long bytesReceived = 0;
+    uint32_t crc = 0;
+    int valread = 0;
+    while ((valread = recv(communicationSocket, readBuffer, UPLOAD_BUFFER_SIZE, 0)) > 0) {
+        bytesReceived = bytesReceived + valread;
+        recordTransfer(valread);
+        if (roomLeft != -1 && bytesReceived + 1 > roomLeft) {
+            fclose(fPointer);
+            remove(stagingName);
+            rejectPost(communicationSocket, recipientList, bytesReceived, "QUOTA_EXCEEDED");
+            free(readBuffer);
+            free(list);
+            return;
+        }
+
+        if (fwrite(readBuffer, 1, valread, fPointer) != (size_t) valread) {
+            break;
+        }
+        crc = crc32cUpdate(crc, readBuffer, valread);
+    }
+    free(readBuffer);
+
+    // Add final newline character at end of message
+    fputc('\n', fPointer);
+    crc = crc32cUpdate(crc, "\n", 1);
+
+    // A message that could not be written in full is never linked into any mailbox
+    if (fflush(fPointer) != 0 || ferror(fPointer)) {
+        fclose(fPointer);
+        remove(stagingName);
+        fprintf(stderr, "Could not write fan-out drop for %s.\n", recipientList);
+        rejectPost(communicationSocket, recipientList, bytesReceived, "WRITE_FAILED");
+        free(list);
+        return;
+    }
+    setDropChecksum(fileno(fPointer), crc);
+
+    // Link the message into every recipients mailbox. Gets of the new drops wait for the lock on the staging file,
+    // so if any link fails the others can still be taken back before anyone sees them.
+    char (*dropNames)[1100] = malloc(sizeof(*dropNames) * recipientCount);
+    int delivered = 0;
+    for (i = 0; i < recipientCount; i++) {
+        unsigned long long prefix = getpid();
+        if (publishDrop(stagingName, recipients[i], &prefix, dropNames[i], sizeof(dropNames[i])) != 0) {
+            fprintf(stderr, "Could not store fan-out drop for user %s.\n", recipients[i]);
+            break;
+        }
+        delivered++;
+    }
+    if (delivered < recipientCount) {
+        for (i = 0; i < delivered; i++) {
+            remove(dropNames[i]);
+        }
+        delivered = 0;
+    }
+    remove(stagingName);
+    fclose(fPointer);
+
+    if (delivered == 0) {
+        send(communicationSocket, "FANOUT_FAILED", 13, MSG_NOSIGNAL);
+        free(dropNames);
+        free(list);
+        return;
+    }
+
+    for (i = 0; i < delivered; i++) {
+        notifySweeper(dropNames[i]);
+        journalRecord('P', dropNames[i]);
+        adjustDiskDrops(dropNames[i], 1);
+    }
+    free(dropNames);
+
+    __atomic_add_fetch(&metrics->postsAccepted, 1, __ATOMIC_RELAXED);
+    traceOutcome(TRACE_STORED);
+    __atomic_add_fetch(&metrics->bytesAccepted, bytesReceived + 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&metrics->fanoutRecipients, delivered, __ATOMIC_RELAXED);
+
+    fprintf(stdout, "Stored fan-out drop %d_* for %d users\n", getpid(), delivered);
+    fflush(stdout);
+    free(list);
+}
+
+// Initializes a timer wheel so that the first tick to be processed is now.
+// Pre-conditions: Must be passed a timer wheel and the current tick.
+// Post-conditions: All slots of the wheel are empty.
+void timerWheelInit(struct timerWheel* wheel, long now) {
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+    wheel->current = now;
+}
+
+// Adds an entry to the slot of its expiry tick. Entries already due are placed in the next slot to be processed.
+// Pre-conditions: Entry expiry must be set and the entry must not be in a wheel.
+// Post-conditions: Entry is in the wheel.
+void timerWheelInsert(struct timerWheel* wheel, struct timerEntry* entry) {
+    long tick = entry->expiry < wheel->current ? wheel->current : entry->expiry;
+    int slot = (int) (tick % WHEEL_SLOTS);
+
+    entry->slot = slot;
+    entry->next = wheel->slots[slot];
+    wheel->slots[slot] = entry;
+}
+
+// Removes an entry that has not expired yet from the wheel.
+// Pre-conditions: Entry must be in the wheel.
+// Post-conditions: Entry is no longer in the wheel.
+void timerWheelRemove(struct timerWheel* wheel, struct timerEntry* entry) {
+    struct timerEntry** link = &wheel->slots[entry->slot];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+}
+
+// Advances the wheel up to and including tick now, unlinking every entry that is due. Entries more than one
+// revolution away stay in their slot. If more than a revolution has passed, every slot is visited once.
+// Pre-conditions: Must be passed an initialized wheel and the current tick.
+// Post-conditions: Returns a list (chained through next) of the entries that expired.
+struct timerEntry* timerWheelAdvance(struct timerWheel* wheel, long now) {
+    struct timerEntry* expired = NULL;
+    long visits = now - wheel->current + 1;
+
+    if (visits > WHEEL_SLOTS) {
+        visits = WHEEL_SLOTS;
+    }
+
+    long i;
+    for (i = 0; i < visits; i++) {
+        int slot = (int) ((wheel->current + i) % WHEEL_SLOTS);
+        struct timerEntry** link = &wheel->slots[slot];
+
+        // Unlink due entries from the slot and push them onto the expired list
+        while (*link != NULL) {
+            struct timerEntry* entry = *link;
+            if (entry->expiry <= now) {
+                *link = entry->next;
+                entry->next = expired;
+                expired = entry;
+            }
+            else {
+                link = &entry->next;
+            }
+        }
+    }
+
+    if (now + 1 > wheel->current) {
+        wheel->current = now + 1;
+    }
+
+    return expired;
+}
+
+// Schedules a drop for expiry if it exists and is not already scheduled. Expiry is its modification time plus the
+// time to live.
+// Pre-conditions: Must be passed the sweeper's wheel, its table of scheduled drops and a file name.
+// Post-conditions: Drop is in the wheel and the table if it is a drop that was not already scheduled.
+void scheduleDrop(struct timerWheel* wheel, struct sweepEntry** scheduled, char* name) {
+    struct stat fileAttributes;
+
+    // Only drops (<pid>_<user> files) can expire
+    int i = 0;
+    while (isdigit((unsigned char) name[i])) {
+        i++;
+    }
+    if (i == 0 || name[i] != '_' || strlen(name) >= 256 || stat(name, &fileAttributes) != 0 ||
+        !S_ISREG(fileAttributes.st_mode)) {
+        return;
+    }
+
+    unsigned int bucket = hashName(name) % WHEEL_SLOTS;
+    struct sweepEntry* entry;
+    for (entry = scheduled[bucket]; entry != NULL; entry = entry->hashNext) {
+        if (strcmp(entry->name, name) == 0) {
+            return;
+        }
+    }
+
+    entry = malloc(sizeof(struct sweepEntry));
+    strcpy(entry->name, name);
+    entry->timer.expiry = fileAttributes.st_mtime + dropTTL;
+    entry->hashNext = scheduled[bucket];
+    scheduled[bucket] = entry;
+
+    timerWheelInsert(wheel, &entry->timer);
+}
+
+// Removes a staged chunked upload, post or fan-out post that has not been extended for the time to live, unless it
+// is being written.
+// Pre-conditions: Must be passed the name of a staging file.
+// Post-conditions: Staging file is removed if it was abandoned.
+void removeAbandonedUpload(char* name) {
+    struct stat fileAttributes;
+    struct stat nameAttributes;
+    int fd = open(name, O_RDONLY);
+
+    // Once locked, the name must still be the file that was checked, it may have been published and replaced
+    if (fd >= 0 && fstat(fd, &fileAttributes) == 0 && fileAttributes.st_mtime + dropTTL <= time(NULL) &&
+        flock(fd, LOCK_EX | LOCK_NB) == 0 && stat(name, &nameAttributes) == 0 &&
+        nameAttributes.st_dev == fileAttributes.st_dev && nameAttributes.st_ino == fileAttributes.st_ino) {
+        remove(name);
+        fprintf(stdout, "Removed abandoned staging file %s\n", name);
+        fflush(stdout);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+// Puts a drop claimed by a get that died while sending it back under its name, so a later get delivers it.
+// Pre-conditions: Must be passed the name of a claimed (GET_PREFIX) drop.
+// Post-conditions: Drop is back under its name unless a get still holds the claim or the name is taken.
+void restoreAbandonedClaim(char* name) {
+    struct stat fileAttributes;
+    struct stat nameAttributes;
+    int fd = open(name, O_RDONLY);
+
+    // Linking never replaces a newer drop that took the name since
+    if (fd >= 0 && fstat(fd, &fileAttributes) == 0 && flock(fd, LOCK_EX | LOCK_NB) == 0 &&
+        stat(name, &nameAttributes) == 0 && nameAttributes.st_dev == fileAttributes.st_dev &&
+        nameAttributes.st_ino == fileAttributes.st_ino && link(name, name + strlen(GET_PREFIX)) == 0) {
+        remove(name);
+        fprintf(stdout, "Restored claimed drop %s\n", name + strlen(GET_PREFIX));
+        fflush(stdout);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+// Schedules every drop currently in the directory, removes abandoned staging files and restores drops
+// claimed by gets that died.
+// Pre-conditions: Must be passed the sweeper's wheel and table of scheduled drops.
+// Post-conditions: All drops in the directory are scheduled.
+void scheduleAllDrops(struct timerWheel* wheel, struct sweepEntry** scheduled) {
+    DIR* dirToExamine = opendir(".");
+    struct dirent* file;
+
+    if (dirToExamine == NULL) {
+        perror("Could not open directory\n");
+        return;
+    }
+
+    while ((file = readdir(dirToExamine)) != NULL) {
+        if (strncmp(file->d_name, UPLOAD_PREFIX, strlen(UPLOAD_PREFIX)) == 0 ||
+            strncmp(file->d_name, POST_PREFIX, strlen(POST_PREFIX)) == 0 ||
+            strncmp(file->d_name, FANOUT_PREFIX, strlen(FANOUT_PREFIX)) == 0) {
+            removeAbandonedUpload(file->d_name);
+        }
+        else if (strncmp(file->d_name, GET_PREFIX, strlen(GET_PREFIX)) == 0) {
+            restoreAbandonedClaim(file->d_name);
+            scheduleDrop(wheel, scheduled, file->d_name + strlen(GET_PREFIX));
+        }
+        else {
+            scheduleDrop(wheel, scheduled, file->d_name);
+        }
+    }
+
+    closedir(dirToExamine);
+}
+
+// Handles a sweeper entry whose time has come. The drop is removed if it is still present and has been stored for
+// longer than the time to live. Drops already delivered are simply forgotten and drops replaced by a newer file of
+// the same name are rescheduled.
+// Pre-conditions: Entry must have been unlinked from the wheel but still be in the table.
+// Post-conditions: Entry is freed or back in the wheel. Expired drops are removed and counted in the metrics.
+void expireDrop(struct timerWheel* wheel, struct sweepEntry** scheduled, struct sweepEntry* entry, long now) {
+    struct stat fileAttributes;
+
+    int exists = stat(entry->name, &fileAttributes) == 0;
+
+    if (exists && fileAttributes.st_mtime + dropTTL > now) {
+        entry->timer.expiry = fileAttributes.st_mtime + dropTTL;
+        timerWheelInsert(wheel, &entry->timer);
+        return;
+    }
+
+    if (exists && remove(entry->name) == 0) {
+        __atomic_add_fetch(&metrics->dropsExpired, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&metrics->bytesExpired, fileAttributes.st_size, __ATOMIC_RELAXED);
+        journalRecord('T', entry->name);
+        adjustDiskDrops(entry->name, -1);
+        invalidateCachedDrop(entry->name);
+        fprintf(stdout, "Expired %s\n", entry->name);
+        fflush(stdout);
+    }
+
+    // Unlink from the table and free
+    struct sweepEntry** link = &scheduled[hashName(entry->name) % WHEEL_SLOTS];
+    while (*link != entry) {
+        link = &(*link)->hashNext;
+    }
+    *link = entry->hashNext;
+    free(entry);
+}
+
+// Background sweeper process that reclaims expired drops. New drops are announced by children over the notify
+// pipe and every drop is placed on a timer wheel with one second ticks. The directory is rescanned once per
+// revolution of the wheel to pick up drops that could not be announced (full pipe, drops imported by otp_pack).
+// Drops held in the memory store are checked once per tick.
+// Pre-conditions: Must be passed the read end of the notify pipe. dropTTL must be greater than 0.
+// Post-conditions: Runs until terminated by the server.
+void runSweeper(int notifyFd) {
+    struct timerWheel wheel;
+    struct sweepEntry* scheduled[WHEEL_SLOTS];
+    char pending[4096];
+    int pendingLength = 0;
+
+    long now = time(NULL);
+    long lastScan = now;
+    long lastExpiry = 0;
+    memset(scheduled, 0, sizeof(scheduled));
+    timerWheelInit(&wheel, now);
+    scheduleAllDrops(&wheel, scheduled);
+
+    while (1) {
+        struct pollfd notify = { notifyFd, POLLIN, 0 };
+        if (poll(&notify, 1, 1000) > 0) {
+            int valread = read(notifyFd, pending + pendingLength, sizeof(pending) - pendingLength - 1);
+            if (valread > 0) {
+                pendingLength = pendingLength + valread;
+                pending[pendingLength] = '\0';
+
+                // Schedule every complete line, keeping any partial line for the next read
+                char* line = pending;
+                char* newline;
+                while ((newline = strchr(line, '\n')) != NULL) {
+                    *newline = '\0';
+                    scheduleDrop(&wheel, scheduled, line);
+                    line = newline + 1;
+                }
+                pendingLength = strlen(line);
+                memmove(pending, line, pendingLength);
+                if (pendingLength == sizeof(pending) - 1) {
+                    pendingLength = 0;
+                }
+            }
+        }
+
+        now = time(NULL);
+        if (memoryStore != NULL && now != lastExpiry) {
+            expireStoreDrops(now);
+            lastExpiry = now;
+        }
+        struct timerEntry* expired = timerWheelAdvance(&wheel, now);
+        while (expired != NULL) {
+            struct timerEntry* next = expired->next;
+            expireDrop(&wheel, scheduled, (struct sweepEntry*) expired, now);
+            expired = next;
+        }
+
+        if (now - lastScan >= WHEEL_SLOTS) {
+            scheduleAllDrops(&wheel, scheduled);
+            lastScan = now;
+        }
+    }
+}
+
+// Starts the sweeper process and the pipe used to notify it of new drops.
+// Pre-conditions: dropTTL must be greater than 0 and metrics must be allocated.
+// Post-conditions: sweeperPID and sweeperNotifyFd are set. Exits on error.
+void startSweeper() {
+    int notifyPipe[2];
+    if (pipe(notifyPipe) != 0) {
+        perror("Sweeper pipe error");
+        exit(1);
+    }
+    fcntl(notifyPipe[1], F_SETFL, O_NONBLOCK);
+
+    sweeperPID = fork();
+    if (sweeperPID == -1) {
+        perror("PID Fork Error");
+        exit(1);
+    }
+    if (sweeperPID == 0) {
+        close(notifyPipe[1]);
+        signal(SIGTERM, stopProcess);
+        runSweeper(notifyPipe[0]);
+        exit(0);
+    }
+
+    close(notifyPipe[0]);
+    sweeperNotifyFd = notifyPipe[1];
+}
+
+// Writes the shared metrics to stdout on a single line.
+// Pre-conditions: metrics must be allocated.
+// Post-conditions: Current counter values are output.
+void dumpMetrics() {
+    fprintf(stdout, "metrics posts_accepted=%lu bytes_accepted=%lu posts_rejected=%lu rejected_bytes=%lu "
+            "gets_served=%lu gets_empty=%lu drops_expired=%lu bytes_expired=%lu\n",
+            metrics->postsAccepted, metrics->bytesAccepted, metrics->postsRejectedCount,
+            metrics->postsRejectedBytes, metrics->getsServed, metrics->getsEmpty, metrics->dropsExpired,
+            metrics->bytesExpired);
+
+    fprintf(stdout, "metrics evicted_handshakes=%lu evicted_idle=%lu evicted_slow=%lu evicted_overtime=%lu "
+            "fanout_recipients=%lu\n", metrics->evictedHandshakes, metrics->evictedIdle, metrics->evictedSlow,
+            metrics->evictedOvertime, metrics->fanoutRecipients);
+
+    int i;
+    for (i = 0; i < followerCount; i++) {
+        fprintf(stdout, "metrics replica=%s lag_bytes=%lld acked_batches=%lu\n", followers[i],
+                metrics->replicaLagBytes[i], metrics->replicaAckedBatches[i]);
+    }
+    if (memoryStore != NULL) {
+        fprintf(stdout, "metrics memory_drops=%ld memory_bytes=%lld memory_capacity=%lld spilled=%lu store_full=%lu\n",
+                memoryStore->storedDrops, memoryStore->blocks.usedBytes,
+                (long long) memoryStore->blocks.blockCount * STORE_BLOCK_SIZE, memoryStore->spilledDrops,
+                memoryStore->rejectedDrops);
+    }
+    if (dropCache != NULL) {
+        unsigned long lookups = dropCache->hits + dropCache->misses;
+        fprintf(stdout, "metrics cache_hits=%lu cache_misses=%lu cache_hit_rate=%.3f cache_bytes=%lld "
+                "cache_capacity=%lld cache_insertions=%lu cache_evictions=%lu cache_invalidations=%lu\n",
+                dropCache->hits, dropCache->misses, lookups > 0 ? (double) dropCache->hits / lookups : 0.0,
+                dropCache->blocks.usedBytes, (long long) dropCache->blocks.blockCount * CACHE_BLOCK_SIZE,
+                dropCache->insertions, dropCache->evictions, dropCache->invalidations);
+    }
+    if (followerCount > 0 || replicationPort > 0) {
+        fprintf(stdout, "metrics journal_records=%lu replicated_posts=%lu replicated_tombstones=%lu\n",
+                metrics->journalRecords, metrics->replicatedPosts, metrics->replicatedTombstones);
+    }
+    fflush(stdout);
+}
+
+// Signal handler for SIGUSR1, asks the main loop to dump the metrics.
+void requestMetrics(int signal) {
+    metricsRequested = 1;
+}
+
+// Signal handler for SIGINT and SIGTERM in memory store mode, asks the main loop to stop so the store is saved.
+void requestShutdown(int signal) {
+    connectionActive = 0;
+}
+
+// Signal handler for SIGCHLD, wakes up the main loop to reap the child. A full pipe already holds a wake-up.
+void notifyChildExit(int signal) {
+    int savedErrno = errno;
+    char wake = 'c';
+    write(childExitPipe[1], &wake, 1);
+    errno = savedErrno;
+}
+
+// Refills a socket reader, keeping any unconsumed bytes at the front of its buffer.
+// Pre-conditions: Reader must have been initialized with an open socket.
+// Post-conditions: Returns the number of new bytes, 0 on end of stream or -1 on error.
+int readerFill(struct socketReader* reader) {
+    memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+    reader->end = reader->end - reader->start;
+    reader->start = 0;
+
+    int valread = recv(reader->fd, reader->buffer + reader->end, sizeof(reader->buffer) - reader->end, 0);
+    if (valread > 0) {
+        reader->end = reader->end + valread;
+    }
+
+    return valread;
+}
+
+// Reads one newline terminated line from a socket reader.
+// Pre-conditions: Must be passed a reader and a line buffer of max bytes.
+// Post-conditions: Returns the length of the line (newline removed) or -1 on end of stream, error or overlong line.
+int readerLine(struct socketReader* reader, char* line, int max) {
+    while (1) {
+        char* newline = memchr(reader->buffer + reader->start, '\n', reader->end - reader->start);
+        if (newline != NULL) {
+            int length = newline - (reader->buffer + reader->start);
+            if (length >= max) {
+                return -1;
+            }
+            memcpy(line, reader->buffer + reader->start, length);
+            line[length] = '\0';
+            reader->start = reader->start + length + 1;
+            return length;
+        }
+        if (reader->end - reader->start >= max || readerFill(reader) <= 0) {
+            return -1;
+        }
+    }
+}
+
+// Copies length bytes from a socket reader to a file descriptor.
+// Pre-conditions: Must be passed a reader and an open descriptor.
+// Post-conditions: Returns 0 if all bytes were copied, otherwise -1.
+int readerCopy(struct socketReader* reader, int fd, long long length) {
+    while (length > 0) {
+        if (reader->start == reader->end && readerFill(reader) <= 0) {
+            return -1;
+        }
+
+        long long available = reader->end - reader->start;
+        long long chunk = available < length ? available : length;
+        if (writeAll(fd, reader->buffer + reader->start, chunk) != 0) {
+            return -1;
+        }
+        reader->start = reader->start + chunk;
+        length = length - chunk;
+    }
+
+    return 0;
+}
+
+// Checks that a name received over replication is a plain drop name that stays in the current directory.
+// Pre-conditions: Must be passed a name.
+// Post-conditions: Returns 1 for a valid drop name, otherwise 0.
+int isValidDropName(char* name) {
+    int i = 0;
+    while (isdigit((unsigned char) name[i])) {
+        i++;
+    }
+
+    return i > 0 && name[i] == '_' && name[i + 1] != '\0' && strchr(name, '/') == NULL && strlen(name) < 256;
+}
+
+// Applies the replication stream of a leader. Posts are written to a temporary file and renamed into place so gets
+// on this follower only ever see complete drops, tombstones remove the delivered drop and every commit marker is
+// acknowledged with the journal offset it carries.
+// Pre-conditions: Must be passed a connected replication socket.
+// Post-conditions: Returns when the leader disconnects or sends a malformed record.
+void applyReplication(int replicationSocket) {
+    struct socketReader* reader = malloc(sizeof(struct socketReader));
+    char line[512];
+    reader->fd = replicationSocket;
+    reader->start = 0;
+    reader->end = 0;
+
+    while (readerLine(reader, line, 512) > 0) {
+        char name[300];
+        long long size = 0;
+        long long seconds = 0;
+        long nanoseconds = 0;
+        unsigned int crc = 0;
+        int fields = 0;
+
+        // Committed post: P <name> <size> <mtime seconds> <mtime nanoseconds> [<crc32c>] followed by the drop bytes
+        if (line[0] == 'P' &&
+            (fields = sscanf(line, "P %299s %lld %lld %ld %8x", name, &size, &seconds, &nanoseconds, &crc)) >= 4 &&
+            isValidDropName(name) && size >= 0) {
+            char tempName[310];
+            snprintf(tempName, 310, ".repl_%s", name);
+
+            int fd = open(tempName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (fd < 0 || readerCopy(reader, fd, size) != 0) {
+                fprintf(stderr, "Could not apply replicated drop %s.\n", name);
+                break;
+            }
+
+            struct timespec times[2] = { { seconds, nanoseconds }, { seconds, nanoseconds } };
+            if (fields == 5) {
+                setDropChecksum(fd, crc);
+            }
+            futimens(fd, times);
+            close(fd);
+            if (access(name, F_OK) != 0) {
+                adjustDiskDrops(name, 1);
+            }
+            rename(tempName, name);
+            invalidateCachedDrop(name);
+            __atomic_add_fetch(&metrics->replicatedPosts, 1, __ATOMIC_RELAXED);
+        }
+        // Tombstone: T <name>
+        else if (line[0] == 'T' && sscanf(line, "T %299s", name) == 1 && isValidDropName(name)) {
+            if (remove(name) == 0) {
+                adjustDiskDrops(name, -1);
+                invalidateCachedDrop(name);
+            }
+            __atomic_add_fetch(&metrics->replicatedTombstones, 1, __ATOMIC_RELAXED);
+        }
+        // Commit marker: C <offset>, acknowledged once everything before it is applied
+        else if (line[0] == 'C' && sscanf(line, "C %lld", &size) == 1) {
+            char ack[40];
+            int length = snprintf(ack, 40, "A %lld\n", size);
+            if (writeAll(replicationSocket, ack, length) != 0) {
+                break;
+            }
+        }
+        else {
+            fprintf(stderr, "Malformed replication record.\n");
+            break;
+        }
+    }
+
+    free(reader);
+}
+
+// Sets the receive timeout of a replication socket, 0 to wait without limit.
+// Pre-conditions: Must be passed a valid/open socket.
+// Post-conditions: Receives on the socket fail after seconds without data.
+void setReplicationTimeout(int replicationSocket, long seconds) {
+    struct timeval timeout = { .tv_sec = seconds, .tv_usec = 0 };
+    setsockopt(replicationSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+// Computes the answer to a replication challenge under the replication key.
+// Pre-conditions: replicationKey must be loaded. Must be passed the challenge as sent.
+// Post-conditions: Returns the keyed hash of the challenge.
+uint64_t replicationAnswer(char* challenge) {
+    return sipHash(challenge, strlen(challenge), replicationKey[0], replicationKey[1]);
+}
+
+// Challenges a connecting leader with a random nonce and checks that it answers with the hash of it under the
+// replication key, so only a leader holding the key can create, replace or remove drops on this follower.
+// Pre-conditions: replicationKey must be loaded. Must be passed the accepted socket.
+// Post-conditions: Returns 1 if the leader answered correctly, 0 otherwise.
+int authenticateLeader(int replicationSocket) {
+    unsigned char nonce[REPLICATION_NONCE_LEN];
+    char challenge[2 * REPLICATION_NONCE_LEN + 1];
+    char expected[40];
+    char line[40];
+    int i;
+
+    int randomFd = open("/dev/urandom", O_RDONLY);
+    if (randomFd < 0 || read(randomFd, nonce, sizeof(nonce)) != sizeof(nonce)) {
+        if (randomFd >= 0) {
+            close(randomFd);
+        }
+        return 0;
+    }
+    close(randomFd);
+
+    for (i = 0; i < REPLICATION_NONCE_LEN; i++) {
+        sprintf(challenge + 2 * i, "%02x", nonce[i]);
+    }
+    snprintf(line, 40, "N %s\n", challenge);
+    snprintf(expected, 40, "H %016llx", (unsigned long long) replicationAnswer(challenge));
+
+    // A leader that never answers must not hold up the next one
+    setReplicationTimeout(replicationSocket, REPLICATION_AUTH_TIMEOUT);
+    int answered = sendAll(replicationSocket, line, strlen(line)) == 0 &&
+                   receiveLine(replicationSocket, line, 40) >= 0 && strcmp(line, expected) == 0;
+    setReplicationTimeout(replicationSocket, 0);
+
+    return answered;
+}
+
+// Answers the challenge of a keyed follower.
+// Pre-conditions: replicationKey must be loaded. Must be passed a socket connected to the follower.
+// Post-conditions: Returns 1 if the answer was sent, 0 if the follower sent no challenge in time.
+int answerFollower(int replicationSocket) {
+    char line[40];
+
+    setReplicationTimeout(replicationSocket, REPLICATION_AUTH_TIMEOUT);
+    int length = receiveLine(replicationSocket, line, 40);
+    setReplicationTimeout(replicationSocket, 0);
+    if (length < 3 || strncmp(line, "N ", 2) != 0) {
+        return 0;
+    }
+
+    char answer[40];
+    snprintf(answer, 40, "H %016llx\n", (unsigned long long) replicationAnswer(line + 2));
+    return sendAll(replicationSocket, answer, strlen(answer)) == 0;
+}
+
+// Follower process that accepts replication connections from a leader on replicationHost and replicationPort and
+// applies them. With a key, leaders that cannot answer its challenge are turned away.
+// Pre-conditions: replicationHost and replicationPort must be set.
+// Post-conditions: Runs until terminated by the server. Exits if the address cannot be bound.
+void runReceiver() {
+    int receiver_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    struct sockaddr_in receiver_addr;
+
+    setsockopt(receiver_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    bzero((char *) &receiver_addr, sizeof(receiver_addr));
+    receiver_addr.sin_family = AF_INET;
+    inet_pton(AF_INET, replicationHost, &receiver_addr.sin_addr);
+    receiver_addr.sin_port = htons(replicationPort);
+
+    if (receiver_fd < 0 || bind(receiver_fd, (struct sockaddr *) &receiver_addr, sizeof(receiver_addr)) < 0) {
+        fprintf(stderr, "Error on binding replication port.\n");
+        exit(1);
+    }
+    listen(receiver_fd, 1);
+
+    // One leader at a time
+    while (1) {
+        int replicationSocket = accept(receiver_fd, NULL, NULL);
+        if (replicationSocket >= 0) {
+            if (!replicationKeyed || authenticateLeader(replicationSocket)) {
+                applyReplication(replicationSocket);
+            }
+            else {
+                fprintf(stderr, "Rejected a replication connection that did not hold the replication key.\n");
+            }
+            close(replicationSocket);
+        }
+    }
+}
+
+// Connects to a follower given as <host>:<port>.
+// Pre-conditions: Must be passed the follower address.
+// Post-conditions: Returns the connected socket or -1.
+int connectFollower(char* follower) {
+    char host[256];
+    memset(host, '\0', 256);
+
+    char* colon = strrchr(follower, ':');
+    if (colon == NULL || colon - follower >= 256) {
+        return -1;
+    }
+    memcpy(host, follower, colon - follower);
+
+    struct addrinfo hints;
+    struct addrinfo* result = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &result) != 0) {
+        return -1;
+    }
+
+    int replicationSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (replicationSocket >= 0 && connect(replicationSocket, result->ai_addr, result->ai_addrlen) < 0) {
+        close(replicationSocket);
+        replicationSocket = -1;
+    }
+    freeaddrinfo(result);
+
+    return replicationSocket;
+}
+
+// Builds the name of the file in which a shipper keeps the journal offset acknowledged by its follower.
+// Pre-conditions: Must be passed a buffer of at least 300 bytes and a follower address.
+// Post-conditions: Buffer holds the offset file name.
+void shipperOffsetName(char* buffer, char* follower) {
+    snprintf(buffer, 300, "%s.%s", JOURNAL_NAME, follower);
+
+    // Keep the name free of the port separator
+    char* colon = strrchr(buffer, ':');
+    if (colon != NULL) {
+        *colon = '_';
+    }
+}
+
+// Reads the journal offset a follower last acknowledged, 0 if it never acknowledged one.
+// Pre-conditions: Must be passed the name of the followers offset file.
+// Post-conditions: Returns the acknowledged offset.
+long long readShipperOffset(char* offsetName) {
+    long long offset = 0;
+
+    FILE* offsetFile = fopen(offsetName, "r");
+    if (offsetFile != NULL) {
+        if (fscanf(offsetFile, "%lld", &offset) != 1) {
+            offset = 0;
+        }
+        fclose(offsetFile);
+    }
+
+    return offset;
+}
+
+// Records the journal offset a follower acknowledged, so a restarted leader resumes where the follower left off.
+// Pre-conditions: Must be passed the name of the followers offset file and the offset.
+// Post-conditions: Offset file holds the offset if it could be written.
+void writeShipperOffset(char* offsetName, long long offset) {
+    FILE* offsetFile = fopen(offsetName, "w");
+    if (offsetFile != NULL) {
+        fprintf(offsetFile, "%lld\n", offset);
+        fclose(offsetFile);
+    }
+}
+
+// Replaces the journal by an empty one once it has grown past JOURNAL_ROTATE_BYTES and every follower has
+// acknowledged all of it. The exclusive record lock keeps writers out while the offsets are checked, reset to 0 and
+// the empty journal is renamed into place. A crash before the rename only makes shippers ship the old journal again,
+// which followers apply idempotently.
+// Pre-conditions: Must be called by a shipper after it recorded an acknowledgement.
+// Post-conditions: Journal is empty and every offset is 0 if it was rotated, otherwise nothing changed.
+void rotateJournal() {
+    int fd = open(JOURNAL_NAME, O_RDWR);
+    if (fd < 0) {
+        return;
+    }
+
+    struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+    struct stat opened;
+    struct stat named;
+    if (fcntl(fd, F_SETLKW, &lock) != 0 || fstat(fd, &opened) != 0 || stat(JOURNAL_NAME, &named) != 0 ||
+        opened.st_dev != named.st_dev || opened.st_ino != named.st_ino || opened.st_size < JOURNAL_ROTATE_BYTES) {
+        close(fd);
+        return;
+    }
+
+    char offsetName[300];
+    int i;
+    for (i = 0; i < followerCount; i++) {
+        shipperOffsetName(offsetName, followers[i]);
+        if (readShipperOffset(offsetName) != opened.st_size) {
+            close(fd);
+            return;
+        }
+    }
+
+    for (i = 0; i < followerCount; i++) {
+        shipperOffsetName(offsetName, followers[i]);
+        writeShipperOffset(offsetName, 0);
+    }
+    int rotated = open(JOURNAL_NAME ".new", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (rotated >= 0) {
+        close(rotated);
+        rename(JOURNAL_NAME ".new", JOURNAL_NAME);
+    }
+
+    // Closing the descriptor releases the lock
+    close(fd);
+}
+
+// Ships one journal record to a follower. Posts carry the drop bytes, sent straight from the file with sendfile;
+// a drop that is already gone is skipped as its tombstone follows in the journal.
+// Pre-conditions: Must be passed a connected replication socket and a journal line without its newline.
+// Post-conditions: Returns 0 if the record was shipped or skipped, -1 if the connection failed.
+int shipRecord(int replicationSocket, char* record) {
+    char header[400];
+    int length = 0;
+
+    if (record[0] == 'T') {
+        length = snprintf(header, 400, "%s\n", record);
+        return writeAll(replicationSocket, header, length);
+    }
+
+    int fd = open(record + 2, O_RDONLY);
+    struct stat fileAttributes;
+    if (fd < 0) {
+        return 0;
+    }
+    if (fstat(fd, &fileAttributes) != 0) {
+        close(fd);
+        return 0;
+    }
+
+    // The checksum, when the drop has one, travels as an optional last field
+    uint32_t crc = 0;
+    if (getDropChecksum(fd, &crc)) {
+        length = snprintf(header, 400, "P %s %lld %lld %ld %08x\n", record + 2, (long long) fileAttributes.st_size,
+                          (long long) fileAttributes.st_mtim.tv_sec, fileAttributes.st_mtim.tv_nsec, crc);
+    }
+    else {
+        length = snprintf(header, 400, "P %s %lld %lld %ld\n", record + 2, (long long) fileAttributes.st_size,
+                          (long long) fileAttributes.st_mtim.tv_sec, fileAttributes.st_mtim.tv_nsec);
+    }
+    int error = writeAll(replicationSocket, header, length);
+
+    off_t offset = 0;
+    while (error == 0 && offset < fileAttributes.st_size) {
+        if (sendfile(replicationSocket, fd, &offset, fileAttributes.st_size - offset) <= 0) {
+            error = -1;
+        }
+    }
+    close(fd);
+
+    return error;
+}
+
+// Ships the journal to a connected follower starting at ackedOffset. Records are sent in batches of up to
+// REPLICATION_BATCH, each closed by a commit marker carrying the journal offset it reaches. Up to REPLICATION_WINDOW
+// batches are in flight before the shipper waits for an acknowledgement, so the link stays busy. The lag metric is
+// the part of the journal not yet acknowledged. Once everything is acknowledged and the journal was rotated, the
+// shipper moves on to the new journal from its start.
+// Pre-conditions: Must be passed the follower index and a connected socket.
+// Post-conditions: Returns when the connection fails. The last acknowledged offset is in the followers offset file.
+void shipJournal(int index, int replicationSocket) {
+    FILE* journal = fopen(JOURNAL_NAME, "r");
+    if (journal == NULL) {
+        return;
+    }
+
+    // The offset is read after the journal is opened, as a rotation in between resets it to 0
+    char offsetName[300];
+    shipperOffsetName(offsetName, followers[index]);
+    long long ackedOffset = readShipperOffset(offsetName);
+    fseeko(journal, ackedOffset, SEEK_SET);
+
+    struct socketReader* acks = malloc(sizeof(struct socketReader));
+    acks->fd = replicationSocket;
+    acks->start = 0;
+    acks->end = 0;
+
+    int inFlight = 0;
+    int connected = 1;
+    char record[400];
+
+    while (connected) {
+        int records = 0;
+
+        // Collect complete journal records, a record still being appended is left for the next pass
+        while (records < REPLICATION_BATCH) {
+            off_t position = ftello(journal);
+            if (fgets(record, 400, journal) == NULL) {
+                clearerr(journal);
+                break;
+            }
+            if (record[strlen(record) - 1] != '\n') {
+                fseeko(journal, position, SEEK_SET);
+                break;
+            }
+            record[strlen(record) - 1] = '\0';
+
+            if (shipRecord(replicationSocket, record) != 0) {
+                connected = 0;
+                break;
+            }
+            records++;
+        }
+
+        // A rotated journal has been shipped and acknowledged in full, continue with its replacement
+        struct stat opened;
+        struct stat named;
+        if (connected && records == 0 && inFlight == 0 && fstat(fileno(journal), &opened) == 0 &&
+            stat(JOURNAL_NAME, &named) == 0 && (opened.st_dev != named.st_dev || opened.st_ino != named.st_ino)) {
+            FILE* rotated = fopen(JOURNAL_NAME, "r");
+            if (rotated != NULL) {
+                fclose(journal);
+                journal = rotated;
+                ackedOffset = 0;
+            }
+        }
+
+        if (connected && records > 0) {
+            char commit[40];
+            int length = snprintf(commit, 40, "C %lld\n", (long long) ftello(journal));
+            connected = writeAll(replicationSocket, commit, length) == 0;
+            inFlight++;
+        }
+
+        // Wait for acknowledgements only when the window is full, otherwise just poll (briefly when idle)
+        struct pollfd ackPoll = { replicationSocket, POLLIN, 0 };
+        int timeout = inFlight >= REPLICATION_WINDOW ? -1 : (records > 0 ? 0 : 100);
+        while (connected && poll(&ackPoll, 1, timeout) > 0) {
+            if (readerFill(acks) <= 0) {
+                connected = 0;
+                break;
+            }
+
+            char line[40];
+            long long offset = 0;
+            // Consume every complete acknowledgement received
+            while (memchr(acks->buffer + acks->start, '\n', acks->end - acks->start) != NULL &&
+                   readerLine(acks, line, 40) > 0) {
+                if (sscanf(line, "A %lld", &offset) == 1) {
+                    ackedOffset = offset;
+                    inFlight--;
+                    __atomic_add_fetch(&metrics->replicaAckedBatches[index], 1, __ATOMIC_RELAXED);
+                }
+            }
+            timeout = inFlight >= REPLICATION_WINDOW ? -1 : 0;
+
+            // Remember progress so a restarted leader resumes where the follower left off
+            writeShipperOffset(offsetName, ackedOffset);
+            rotateJournal();
+        }
+
+        struct stat journalAttributes;
+        if (fstat(fileno(journal), &journalAttributes) == 0) {
+            metrics->replicaLagBytes[index] = journalAttributes.st_size - ackedOffset;
+        }
+    }
+
+    fclose(journal);
+    free(acks);
+}
+
+// Shipper process for one follower. Connects (and reconnects after failures) to the follower and ships the journal
+// from the last acknowledged offset. Unacknowledged batches are shipped again after a reconnect, which followers
+// apply idempotently.
+// Pre-conditions: Must be passed the index of a configured follower.
+// Post-conditions: Runs until terminated by the server.
+void runShipper(int index) {
+    // A follower going away must not kill the shipper
+    signal(SIGPIPE, SIG_IGN);
+
+    while (1) {
+        int replicationSocket = connectFollower(followers[index]);
+        if (replicationSocket >= 0) {
+            if (!replicationKeyed || answerFollower(replicationSocket)) {
+                shipJournal(index, replicationSocket);
+            }
+            close(replicationSocket);
+        }
+        sleep(1);
+    }
+}
+
+// Opens the journal and starts a shipper process for every follower, and the receiver process if this instance is a
+// follower.
+// Pre-conditions: followers, followerCount and replicationPort must be set and metrics allocated.
+// Post-conditions: journalFd, shipperPIDs and receiverPID are set. Exits on error.
+void startReplication() {
+    int i;
+
+    if (followerCount > 0 && journalFd < 0) {
+        journalFd = open(JOURNAL_NAME, O_WRONLY | O_CREAT | O_APPEND, 0666);
+        if (journalFd < 0) {
+            perror("Could not open journal");
+            exit(1);
+        }
+    }
+
+    for (i = 0; i < followerCount; i++) {
+        shipperPIDs[i] = fork();
+        if (shipperPIDs[i] == -1) {
+            perror("PID Fork Error");
+            exit(1);
+        }
+        if (shipperPIDs[i] == 0) {
+            runShipper(i);
+            exit(0);
+        }
+    }
+
+    if (replicationPort > 0) {
+        receiverPID = fork();
+        if (receiverPID == -1) {
+            perror("PID Fork Error");
+            exit(1);
+        }
+        if (receiverPID == 0) {
+            runReceiver();
+            exit(0);
+        }
+    }
+}
+
+// Looks up the scheduling state of a user, optionally creating it.
+// Pre-conditions: Must be passed a users name.
+// Post-conditions: Returns the users state, or NULL if it does not exist and create is 0.
+struct userQueue* findUserQueue(char* user, int create) {
+    unsigned int bucket = hashName(user) % USER_BUCKETS;
+    struct userQueue* queue;
+
+    for (queue = userTable[bucket]; queue != NULL; queue = queue->hashNext) {
+        if (strcmp(queue->user, user) == 0) {
+            return queue;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    queue = malloc(sizeof(struct userQueue));
+    memset(queue, 0, sizeof(struct userQueue));
+    strcpy(queue->user, user);
+    queue->pacer = -1;
+    queue->hashNext = userTable[bucket];
+    userTable[bucket] = queue;
+
+    return queue;
+}
+
+// Adds a user with waiting connections to the round-robin ring, just behind the cursor so it waits a full round.
+// Pre-conditions: User must not be in the ring.
+// Post-conditions: User is in the ring.
+void ringInsert(struct userQueue* queue) {
+    if (ringCursor == NULL) {
+        queue->ringNext = queue;
+        queue->ringPrev = queue;
+        ringCursor = queue;
+    }
+    else {
+        queue->ringNext = ringCursor;
+        queue->ringPrev = ringCursor->ringPrev;
+        ringCursor->ringPrev->ringNext = queue;
+        ringCursor->ringPrev = queue;
+    }
+    queue->backlogged = 1;
+    ringSize++;
+}
+
+// Removes a user from the round-robin ring.
+// Pre-conditions: User must be in the ring.
+// Post-conditions: User is no longer in the ring and the cursor does not point at it.
+void ringRemove(struct userQueue* queue) {
+    if (queue->ringNext == queue) {
+        ringCursor = NULL;
+    }
+    else {
+        queue->ringPrev->ringNext = queue->ringNext;
+        queue->ringNext->ringPrev = queue->ringPrev;
+        if (ringCursor == queue) {
+            ringCursor = queue->ringNext;
+        }
+    }
+    queue->backlogged = 0;
+    ringSize--;
+}
+
+// Frees the state of a user that has nothing waiting and nothing running. Any remaining debt is forgiven.
+// Pre-conditions: Must be passed a users state.
+// Post-conditions: State is freed if the user is idle.
+void releaseUserIfIdle(struct userQueue* queue) {
+    if (queue->head != NULL || queue->active > 0) {
+        return;
+    }
+
+    struct userQueue** link = &userTable[hashName(queue->user) % USER_BUCKETS];
+    while (*link != queue) {
+        link = &(*link)->hashNext;
+    }
+    *link = queue->hashNext;
+    free(queue);
+}
+
+// Closes, in a newly forked child, every connection held by the scheduler except the one the child serves, so that
+// clients see their connection close as soon as their own child is done.
+// Pre-conditions: Must be called in a child right after fork.
+// Post-conditions: Only the listening socket (closed too) and the served connection remain of the scheduler's.
+void closeOtherConnections(struct pendingConnection* keep) {
+    struct pendingConnection* connection;
+    int i;
+
+    close(server_fd);
+    if (handoffListenFd >= 0) {
+        close(handoffListenFd);
+    }
+    if (handoffPeer >= 0) {
+        close(handoffPeer);
+    }
+    for (connection = handshakes; connection != NULL; connection = connection->next) {
+        close(connection->socket);
+    }
+    for (i = 0; i < USER_BUCKETS; i++) {
+        struct userQueue* queue;
+        for (queue = userTable[i]; queue != NULL; queue = queue->hashNext) {
+            for (connection = queue->head; connection != NULL; connection = connection->next) {
+                if (connection != keep) {
+                    close(connection->socket);
+                }
+            }
+        }
+    }
+}
+
+// Starts watching the process slot a connection was just dispatched to. Its clock starts after the childs
+// mandatory sleep.
+// Pre-conditions: Must be passed the slot and whether the connection is a post.
+// Post-conditions: Slot timer is in slotWheel.
+void startSlotDeadline(int slot, int isPost) {
+    long now = time(NULL);
+    struct slotDeadline* deadline = &slotDeadlines[slot];
+
+    deadline->slot = slot;
+    deadline->isPost = isPost;
+    deadline->evicted = 0;
+    deadline->started = now + 2;
+    deadline->lastActive = now + 2;
+    deadline->lastBytes = 0;
+    deadline->timer.expiry = now + 1;
+    timerWheelInsert(&slotWheel, &deadline->timer);
+}
+
+// Checks a running process slot whose timer fired. A child that made no progress for idleTimeout, ran longer than
+// transferTimeout or averaged less than minThroughput (measured once idleTimeout has passed, to let it ramp up) is
+// told to stop. Otherwise the timer is set to fire again a second later.
+// Pre-conditions: Slot timer must have been unlinked from slotWheel and the slot be running.
+// Post-conditions: Child is killed and counted in the metrics, or its timer is back in the wheel.
+void checkSlotDeadline(struct slotDeadline* deadline, long now) {
+    long long bytes = progress[deadline->slot].bytes;
+    if (bytes != deadline->lastBytes) {
+        deadline->lastBytes = bytes;
+        deadline->lastActive = now;
+    }
+
+    unsigned long* reason = NULL;
+    long elapsed = now - deadline->started;
+    if (idleTimeout > 0 && now - deadline->lastActive >= idleTimeout) {
+        reason = &metrics->evictedIdle;
+    }
+    else if (transferTimeout > 0 && elapsed >= transferTimeout) {
+        reason = &metrics->evictedOvertime;
+    }
+    else if (minThroughput > 0 && elapsed >= (idleTimeout > 0 ? idleTimeout : 1) && bytes / elapsed < minThroughput) {
+        reason = &metrics->evictedSlow;
+    }
+
+    if (reason == NULL) {
+        deadline->timer.expiry = now + 1;
+        timerWheelInsert(&slotWheel, &deadline->timer);
+        return;
+    }
+
+    // SIGTERM rather than SIGKILL, a child holding a shared memory lock finishes its update first (see stopProcess)
+    kill(processes[deadline->slot], SIGTERM);
+    deadline->evicted = 1;
+    __atomic_add_fetch(reason, 1, __ATOMIC_RELAXED);
+    fprintf(stderr, "Evicted connection of user %s after %ld seconds.\n", slotOwners[deadline->slot]->user,
+            elapsed > 0 ? elapsed : 0);
+}
+
+// Closes the handshakes that ran past their deadline and checks the process slots that are due.
+// Pre-conditions: Wheels must be initialized.
+// Post-conditions: Late handshakes are dropped and slow children killed.
+void enforceDeadlines() {
+    long now = time(NULL);
+
+    struct timerEntry* expired = timerWheelAdvance(&handshakeWheel, now);
+    while (expired != NULL) {
+        struct pendingConnection* connection = (struct pendingConnection*) expired;
+        expired = expired->next;
+
+        struct pendingConnection** link = &handshakes;
+        while (*link != connection) {
+            link = &(*link)->next;
+        }
+        *link = connection->next;
+
+        close(connection->socket);
+        free(connection);
+        pendingCount--;
+        __atomic_add_fetch(&metrics->evictedHandshakes, 1, __ATOMIC_RELAXED);
+    }
+
+    expired = timerWheelAdvance(&slotWheel, now);
+    while (expired != NULL) {
+        struct slotDeadline* deadline = (struct slotDeadline*) expired;
+        expired = expired->next;
+        checkSlotDeadline(deadline, now);
+    }
+}
+
+// Starts the trace record of a connection dispatched to a process slot. A fan-out is traced under a hash of its
+// whole recipient list.
+// Pre-conditions: Must be passed the slot and the connection dispatched to it.
+// Post-conditions: slotTraces holds the request, completed by writeTraceRecord when the child is reaped.
+void startTraceRecord(int slot, struct pendingConnection* connection) {
+    struct traceRecord* record = &slotTraces[slot];
+
+    memset(record, 0, sizeof(struct traceRecord));
+    record->arrival = connection->arrival;
+    record->userHash = traceUserHash(connection->user, &traceSecret);
+    record->recipients = 1;
+    if (strcmp("get", connection->command) == 0) {
+        record->operation = TRACE_GET;
+    }
+    else if (strcmp("chunk", connection->command) == 0) {
+        record->operation = TRACE_CHUNK;
+    }
+    else if (strcmp("fan", connection->command) == 0) {
+        record->operation = TRACE_FAN;
+        char* separator = connection->user;
+        while ((separator = strchr(separator, ',')) != NULL) {
+            record->recipients++;
+            separator++;
+        }
+    }
+    else {
+        record->operation = TRACE_POST;
+    }
+}
+
+// Starts a child for the first waiting connection of a user in the given process slot. The child paces itself on
+// the users bandwidth pacer, which all of the users running children share.
+// Pre-conditions: User must have a waiting connection and slot must be free.
+// Post-conditions: Connection is being served by a child recorded in processes. Exits if fork fails.
+void dispatchConnection(struct userQueue* queue, int slot) {
+    struct pendingConnection* connection = queue->head;
+    queue->head = connection->next;
+    if (queue->head == NULL) {
+        queue->tail = NULL;
+    }
+    pendingCount--;
+    queue->active++;
+
+    progress[slot].bytes = 0;
+    progress[slot].discarded = 0;
+    progress[slot].outcome = TRACE_FAILED;
+    childSlot = slot;
+
+    // A user starting its first child takes a free pacer, there are never more users running than slots
+    if (perUserBandwidth > 0 && queue->pacer == -1) {
+        int pacer = 0;
+        while (pacers[pacer].users > 0) {
+            pacer++;
+        }
+        queue->pacer = pacer;
+        pacers[pacer].nextSend = 0;
+    }
+    if (queue->pacer != -1) {
+        pacers[queue->pacer].users++;
+    }
+    childPacer = queue->pacer;
+
+    // Create fork and receive PID return value for processing
+    pid_t spawnPID = fork();
+
+    // Perform actions based on PID value returned
+    switch (spawnPID) {
+
+        // Error forking, output respective error and exit
+        case -1: {
+            perror("PID Fork Error");
+            exit(1);
+            break;
+        }
+
+        // Child process runs and performs operations
+        case 0: {
+            closeOtherConnections(connection);
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTERM, stopProcess);
+
+            // Mandatory sleep for each child process
+            sleep(2);
+
+            // Check if post or get and perform operations accordingly
+            if (strcmp("get", connection->command) == 0) {
+                performGetOperations(connection->socket, connection->user);
+            }
+            else if (strcmp("post", connection->command) == 0) {
+                performPostOperations(connection->socket, connection->user);
+            }
+            else if (strcmp("chunk", connection->command) == 0) {
+                performChunkOperations(connection->socket, connection->user);
+            }
+            else if (strcmp("fan", connection->command) == 0) {
+                performFanoutOperations(connection->socket, connection->user);
+            }
+
+            // Exit child process
+            exit(0);
+        }
+
+        // Parent process enters, records the child and lets it own the connection
+        default: {
+            processes[slot] = spawnPID;
+            slotOwners[slot] = queue;
+            childSlot = -1;
+            startSlotDeadline(slot, strcmp("post", connection->command) == 0 ||
+                              strcmp("fan", connection->command) == 0);
+            startTraceRecord(slot, connection);
+            if (strcmp("fan", connection->command) == 0) {
+                slotRecipients[slot] = strdup(connection->user);
+            }
+
+            close(connection->socket);
+            free(connection);
+        }
+    }
+}
+
+// Charges the bytes of a fan-out post to the deficit of every other recipient with connections queued or running,
+// as the post went into each of their mailboxes. Recipients without a queue have no turn to lose.
+// Pre-conditions: Must be passed the comma separated recipients, the queue the post was served as and its bytes.
+// Post-conditions: Deficits of the recipients other than the served queue are lowered by bytes.
+void chargeRecipients(char* recipientList, struct userQueue* served, long long bytes) {
+    char* list = strdup(recipientList);
+    char* recipient = strtok(list, ",");
+    while (recipient != NULL) {
+        struct userQueue* queue = findUserQueue(recipient, 0);
+        if (queue != NULL && queue != served) {
+            queue->deficit = queue->deficit - bytes;
+        }
+        recipient = strtok(NULL, ",");
+    }
+    free(list);
+}
+
+// Returns the index of a free process slot or -1 if all 5 are in use.
+// Pre-conditions: Declared processes array.
+// Post-conditions: Returns a free slot index or -1.
+int findFreeSlot() {
+    int i;
+    for (i = 0; i < 5; i++) {
+        if (processes[i] == -5) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Hands free process slots to waiting connections with deficit round robin over the users that have connections
+// waiting. On each visit a user is credited drrQuantum bytes (never holding more than one quantum) and may start
+// connections while its deficit is positive, up to perUserConcurrency running at once. Each start costs
+// REQUEST_COST and the bytes actually moved are charged when the child finishes, so a user bulk-loading large drops
+// runs into debt and waits while users with small requests keep being served every round.
+// Pre-conditions: Scheduler state must be initialized.
+// Post-conditions: Connections are started until no slot is free or no user may start one.
+void dispatchConnections() {
+    int idleVisits = 0;
+
+    while (ringSize > 0 && findFreeSlot() >= 0) {
+        struct userQueue* queue = ringCursor;
+        ringCursor = queue->ringNext;
+        int started = 0;
+
+        if (queue->active < perUserConcurrency) {
+            queue->deficit = queue->deficit + drrQuantum < drrQuantum ? queue->deficit + drrQuantum : drrQuantum;
+
+            int slot;
+            while (queue->head != NULL && queue->deficit > 0 && queue->active < perUserConcurrency &&
+                   (slot = findFreeSlot()) >= 0) {
+                dispatchConnection(queue, slot);
+                queue->deficit = queue->deficit - REQUEST_COST;
+                started++;
+            }
+
+            // A user leaving the ring keeps its debt but not its credit
+            if (queue->head == NULL) {
+                ringRemove(queue);
+                if (queue->deficit > 0) {
+                    queue->deficit = 0;
+                }
+            }
+        }
+
+        idleVisits = started > 0 ? 0 : idleVisits + 1;
+        if (ringSize > 0 && idleVisits >= ringSize) {
+            // Every waiting user is at its concurrency cap or in debt. Skip ahead the rounds needed for the user
+            // closest to being served instead of crediting one quantum per pass.
+            long long needed = -1;
+            struct userQueue* member = ringCursor;
+            int i;
+            for (i = 0; i < ringSize; i++, member = member->ringNext) {
+                long long missing = 1 - drrQuantum - member->deficit;
+                if (member->active < perUserConcurrency && (needed < 0 || missing < needed)) {
+                    needed = missing;
+                }
+            }
+            if (needed < 0) {
+                break;
+            }
+            for (i = 0; i < ringSize; i++, member = member->ringNext) {
+                if (member->active < perUserConcurrency) {
+                    member->deficit = member->deficit + needed;
+                }
+            }
+            idleVisits = 0;
+        }
+    }
+}
+
+// Check on processes running in background and if the process has finished. If process has finished, set position
+// in processes array to free (-5), charge the bytes it moved to its user and release the user if it is idle. Never
+// waits for a process to finish.
+// Pre-conditions: Declared processes array holding possible process ID's of background processes.
+// Post-conditions: Checks background processes (if any) and if finished, sets process position in array to free (-5).
+// Returns the number of processes still running.
+// Reference: http://web.engr.oregonstate.edu/~brewsteb/CS344Slides/3.1%20Processes.pdf
+int checkProcesses() {
+    int exitStatus = -10;
+    int running = 0;
 
-    return pathName;
-}
+    int i;
+    // Loop through processes, checking status
+    for (i = 0; i < 5; i++) {
+        // Check if process exists and if it is still running
+        if (processes[i] != -5) {
+            // Check if process completed and collect result in childPID, if not 0, then process has finished.
+            pid_t childPID = waitpid(processes[i], &exitStatus, WNOHANG);
 
-// If otp sends request for get command, operations are performed in this function to
-// find the oldest file for the provided users name and send it over the socket connection.
-// Pre-conditions: Parameters for a valid open socket connection and a string representation of
-// a users name must be provided.
-// Post-conditions: Oldest file text is sent over socket connection.
-void performGetOperations(int communicationSocket, char* user) {
-    // Find the oldest filename and its path of the provided user and return to filePath
-    char* filePath = findOldestFilePath(user);
+            // If the pid_t returned is not 0, then it has exited
+            if (childPID != 0) {
+                // Return memory drops and cache entries a killed child left behind
+                if (memoryStore != NULL) {
+                    reclaimStoreOwner(processes[i]);
+                }
+                if (dropCache != NULL) {
+                    reclaimCacheOwner(processes[i]);
+                }
 
-    // If filePath is empty, then set boolean type to indicate file could not be found. This skips the processes below.
-    int fileFound = 1;
-    if (strcmp(filePath, "") == 0) {
-        fileFound = 0;
-    }
+                // An evicted post leaves its staging file behind, it was never published, journaled or counted
+                if (slotDeadlines[i].evicted && slotDeadlines[i].isPost) {
+                    char partialName[1100];
+                    snprintf(partialName, sizeof(partialName), "%s%d", POST_PREFIX, processes[i]);
+                    remove(partialName);
+                    snprintf(partialName, sizeof(partialName), "%s%d", FANOUT_PREFIX, processes[i]);
+                    remove(partialName);
+                }
+                else if (!slotDeadlines[i].evicted) {
+                    timerWheelRemove(&slotWheel, &slotDeadlines[i].timer);
+                }
+                writeTraceRecord(i);
 
-    // Send the file to the client over the socket in sections
-    sendFile(communicationSocket, filePath);
+                // Set process index to -5 when finished to indicate free
+                processes[i] = -5;
 
-    // If the file was found, free the file path
-    if (fileFound == 1) {
-        // Free the file path
-        free(filePath);
+                struct userQueue* queue = slotOwners[i];
+                slotOwners[i] = NULL;
+                queue->active--;
+                if (queue->pacer != -1) {
+                    pacers[queue->pacer].users--;
+                    if (pacers[queue->pacer].users == 0) {
+                        queue->pacer = -1;
+                    }
+                }
+                queue->deficit = queue->deficit - progress[i].bytes;
+                if (slotRecipients[i] != NULL) {
+                    chargeRecipients(slotRecipients[i], queue, progress[i].bytes);
+                    free(slotRecipients[i]);
+                    slotRecipients[i] = NULL;
+                }
+                releaseUserIfIdle(queue);
+            }
+            else {
+                running++;
+            }
+        }
     }
+
+    return running;
 }
 
-// If otp sends request for post command, operations are performed in this function to
-// receive the encrypted file over the socket connection and write that message to a file
-// for that user. The file will be of the format: <pid>_<user>
-// Pre-conditions: A valid/open socket connection and a string of the users name are passed as parameters.
-// Post-conditions: If successful, an encrypted files text is received over the socket connection and saved to
-// a file for that user with the users name listed. If unsuccessful, a corresponding error is printed to stderr.
-void performPostOperations(int communicationSocket, char* user) {
-    // Set read buffer to receive messages from otp_d server
-    char* readBuffer = malloc(sizeof(char) * 2056);
-    memset(readBuffer, '\0', 2056);
+// Advances the handshake of a new connection by one step. The command and then the user are each read with a
+// single receive, as otp waits for the acknowledgement of one before sending the next.
+// Pre-conditions: Connection socket must be readable.
+// Post-conditions: Returns 1 once the user is received, 0 if more is needed and -1 if the client went away.
+int advanceHandshake(struct pendingConnection* connection) {
+    if (connection->stage == 0) {
+        // Get command (post or get)
+        int valread = recv(connection->socket, connection->command, 5, MSG_DONTWAIT);
+        if (valread <= 0) {
+            return -1;
+        }
 
-    // GET MESSAGE AND ADD TO FILE
-    // Variables for path. Set path as current working directory.
-    char dirPath[256];
-    getcwd(dirPath, 256);
+        // Respond with acceptance message
+        send(connection->socket, "COMMAND_RECEIVED", 16, MSG_NOSIGNAL);
+        connection->stage = 1;
+        return 0;
+    }
 
-    // Get pid and convert to string
-    char pid[10];
-    sprintf(pid, "%d", getpid());
+    // Get user from the client
+    int valread = recv(connection->socket, connection->user, 1024, MSG_DONTWAIT);
+    if (valread <= 0) {
+        return -1;
+    }
 
-    char* pathName = malloc(sizeof(char) * 512);
-    memset(pathName, '\0', 512);
-    // Create path name for file creation
-    strcat(pathName, dirPath);
-    strcat(pathName, "/");
-    strcat(pathName, pid);
-    strcat(pathName, "_");
-    strcat(pathName, user);
+    // Respond with acceptance message
+    send(connection->socket, "USER_RECEIVED", 13, MSG_NOSIGNAL);
+    connection->stage = 2;
+    return 1;
+}
 
-    FILE *fPointer = fopen(pathName, "w");
+// Moves a connection that finished its handshake to the back of its users queue. A fan-out post is queued as its
+// first recipient, so that it is held to that users concurrency and bandwidth limits instead of those of a new user
+// for every list of recipients.
+// Pre-conditions: Connection must have completed its handshake and be unlinked from the handshake list.
+// Post-conditions: Connection is queued and its user is in the round-robin ring.
+void enqueueConnection(struct pendingConnection* connection) {
+    char user[1025];
+    strcpy(user, connection->user);
+    if (strcmp("fan", connection->command) == 0) {
+        user[strcspn(user, ",")] = '\0';
+    }
+    struct userQueue* queue = findUserQueue(user, 1);
 
-    // Check to see if file was opened
-    if (fPointer == NULL) {
-        char* message = "Error opening a file.\n";
-        write(2, message, 21);
+    connection->next = NULL;
+    if (queue->tail == NULL) {
+        queue->head = connection;
     }
-    // Output message to file
     else {
-        int valread = 0;
-        // Loop until all of message is received from otp. Message will be received in chunks of 1024.
-        while (valread != -1) {
-
-            // Clear buffer
-            memset(readBuffer, '\0', 2056);
+        queue->tail->next = connection;
+    }
+    queue->tail = connection;
 
-            // Get encrypted message from the client
-            valread = recv(communicationSocket, readBuffer, 1024, 0);
+    if (!queue->backlogged) {
+        ringInsert(queue);
+    }
+}
 
-            // If message indicating send is completed is sent, exit read loop.
-            if (valread == 0) {
-                break;
-            }
+// Checks that the process at the other end of a handoff connection runs as the same user as this one, as the
+// listening socket is only ever passed between instances of the same service.
+// Pre-conditions: Must be passed a connected Unix domain socket.
+// Post-conditions: Returns 1 if the peer has this processes effective user id, otherwise 0.
+int isPeerSelf(int peer) {
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
 
-            // Allocate memory for string to accept the expected message size
-            char* fileInput = malloc(sizeof(char) * 1028);
-            memset(fileInput, '\0', 1028);
+    return getsockopt(peer, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == 0 && credentials.uid == geteuid();
+}
 
-            // Add message to string from buffer and print to file
-            strcpy(fileInput, readBuffer);
-            fprintf(fPointer, "%s", fileInput);
+// Takes over the listening socket of a running otp_d started with the same -U path. The running instance stops its
+// replication processes before it hands the socket over, so this instance can start its own.
+// Pre-conditions: handoffPath must be set. Must be called before any process is started.
+// Post-conditions: Returns 1 with server_fd set to the inherited socket and handoffPeer connected, or 0 if no
+// instance is listening on the path. Exits if the inherited socket does not listen on port.
+int receiveListener(int port) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, handoffPath, sizeof(address.sun_path) - 1);
 
-            // Free allocated memory for fileInput
-            free(fileInput);
+    int peer = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (peer < 0 || connect(peer, (struct sockaddr*) &address, sizeof(address)) != 0) {
+        if (peer >= 0) {
+            close(peer);
         }
+        return 0;
+    }
+    if (!isPeerSelf(peer)) {
+        fprintf(stderr, "Process on %s runs as another user.\n", handoffPath);
+        exit(1);
     }
 
-    // Add final newline character at end of message
-    fprintf(fPointer, "\n");
-    fflush(stdout);
+    char marker;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec part = { &marker, 1 };
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
 
-    // Close file
-    fclose(fPointer);
+    struct cmsghdr* header = NULL;
+    if (recvmsg(peer, &message, 0) != 1 || (header = CMSG_FIRSTHDR(&message)) == NULL ||
+        header->cmsg_type != SCM_RIGHTS) {
+        fprintf(stderr, "otp_d on %s did not hand off its listening socket.\n", handoffPath);
+        exit(1);
+    }
+    memcpy(&server_fd, CMSG_DATA(header), sizeof(int));
 
-    // Output message with path of new file
-    write(1, pathName, strlen(pathName));
-    write(1, "\n", 1);
+    // Both instances must serve the same port
+    struct sockaddr_in listening;
+    socklen_t length = sizeof(listening);
+    if (getsockname(server_fd, (struct sockaddr*) &listening, &length) != 0 || ntohs(listening.sin_port) != port) {
+        fprintf(stderr, "Handed off socket does not listen on port %d.\n", port);
+        exit(1);
+    }
 
+    handoffPeer = peer;
+    fprintf(stdout, "Took over listening socket on port %d\n", port);
     fflush(stdout);
 
-    // Free allocated memory for file path and read buffer
-    free(pathName);
-    free(readBuffer);
+    return 1;
 }
 
-// Check on processes running in background and if the process has finished. If process has finished, set position
-// in processes array to free (-5). If all process positions are full and none are finished, continue looping until
-// one completes.
-// Pre-conditions: Declared processes array holding possible process ID's of background processes.
-// Post-conditions: Checks background processes (if any) and if finished, sets process position in array to free (-5).
-// If all positions are full, function will continue looping/checking until a process completes.
-// Reference: http://web.engr.oregonstate.edu/~brewsteb/CS344Slides/3.1%20Processes.pdf
-void checkProcesses() {
-    int exitStatus = -10;
+// Listens on handoffPath for the next instance to hand the listening socket to.
+// Pre-conditions: handoffPath must be set and this instance own the listening socket.
+// Post-conditions: handoffListenFd is listening. Exits on error.
+void startHandoffListener() {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(handoffPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Handoff socket path is too long.\n");
+        exit(1);
+    }
+    strcpy(address.sun_path, handoffPath);
 
-    int processesFull = 1;
-    while (processesFull == 1) {
-        int i;
-        // Loop through processes, checking status
-        for (i = 0; i < 5; i++) {
-            // Check if process exists and if it is still running
-            if (processes[i] != -5) {
-                // Check if process completed and collect result in childPID, if not 0, then process has finished.
-                pid_t childPID = waitpid(processes[i], &exitStatus, WNOHANG);
-
-                // If the pid_t returned is not 0, then it has exited
-                if (childPID != 0) {
-                    // Set process index to -5 when finished to indicate free
-                    processes[i] = -5;
-
-                    // Set processes as not full as one ended
-                    processesFull = 0;
-                }
-            }
-            // If there is a free spot, then set processesFull bool value
-            else {
-                processesFull = 0;
-            }
-        }
+    // The path may be left by the instance this one took over from. Only this user may connect to it.
+    unlink(handoffPath);
+    handoffListenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t previousMask = umask(077);
+    int bound = handoffListenFd >= 0 && bind(handoffListenFd, (struct sockaddr*) &address, sizeof(address)) == 0;
+    umask(previousMask);
+    if (!bound || chmod(handoffPath, 0600) != 0 || listen(handoffListenFd, 1) != 0) {
+        fprintf(stderr, "Could not listen on handoff socket %s.\n", handoffPath);
+        exit(1);
+    }
+}
+
+// Ends the shipper and receiver processes. followerCount is kept so startReplication can start them again.
+// Pre-conditions: Replication processes must have been started.
+// Post-conditions: No replication process is running.
+void stopReplication() {
+    int i;
+    for (i = 0; i < followerCount; i++) {
+        kill(shipperPIDs[i], SIGTERM);
+        waitpid(shipperPIDs[i], NULL, 0);
+    }
+    if (receiverPID != -5) {
+        kill(receiverPID, SIGTERM);
+        waitpid(receiverPID, NULL, 0);
+        receiverPID = -5;
+    }
+}
+
+// Hands the listening socket to a new instance connecting on handoffPath. Connections from processes of other users
+// are refused. Replication processes are ended first, as they cannot run twice, and started again if the socket
+// could not be sent. The sweeper keeps running until this instance exits. From then on this instance
+// accepts no more connections and drains: handshakes in progress, queued connections and running children are
+// finished as usual, after which runServer returns.
+// Pre-conditions: handoffListenFd must be readable.
+// Post-conditions: New instance holds the listening socket and this instance is draining, or nothing changed if the
+// connection went away.
+void handOffListener() {
+    int peer = accept(handoffListenFd, NULL, NULL);
+    if (peer < 0) {
+        return;
+    }
+    if (!isPeerSelf(peer)) {
+        fprintf(stderr, "Refused handoff to a process of another user.\n");
+        close(peer);
+        return;
+    }
+
+    stopReplication();
+
+    char marker = 'L';
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec part = { &marker, 1 };
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    memset(control, 0, sizeof(control));
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &server_fd, sizeof(int));
+
+    if (sendmsg(peer, &message, MSG_NOSIGNAL) != 1) {
+        fprintf(stderr, "Could not hand off listening socket.\n");
+        close(peer);
+        startReplication();
+        return;
     }
+    followerCount = 0;
+
+    // The peer stays open until this process exits, which tells the new instance that draining is over
+    close(server_fd);
+    close(handoffListenFd);
+    handoffListenFd = -1;
+    draining = 1;
+    fprintf(stdout, "Handed off listening socket, draining %d waiting connections\n", pendingCount);
+    fflush(stdout);
 }
 
 // Server driver function that sets up socket connection to listen on provided port and loops until ctrl-c is
-// encountered. Each get or post operation is performed by a forked process once a connection is established by
-// the main process. No more than 5 processes can be forked off at any given time. If another is attempted, the
-// main process will wait until one finishes.
+// encountered. The main process accepts connections and reads each handshake (command and user) without blocking,
+// then queues the connection per user. Waiting connections are started in forked processes, no more than 5 at a
+// time, chosen by deficit round robin across users (see dispatchConnections).
 // Pre-conditions: A port number is passed as parameter to runServer to create a listening connection on that port.
 // Post-conditions: If successful, any get or post request will be processed when received by otp and the server
 // will run indefinitely until terminated with ctrl-c. If unsuccessful, runServer returns -1 and outputs a correlating
 // error message to stderr.
 int runServer(int port) {
-    int error = 0;
-    //Initiate control connection and get integer from error if exists
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    //If socket isn't opened properly, print error and return.
-    if (server_fd < 0) {
-        fprintf(stderr, "Error opening socket.\n");
+    // A socket handed off by a previous instance is already listening
+    if (handoffPeer < 0) {
+        //Initiate control connection and get integer from error if exists
+        server_fd = socket(AF_INET, SOCK_STREAM, 0);
+        //If socket isn't opened properly, print error and return.
+        if (server_fd < 0) {
+            fprintf(stderr, "Error opening socket.\n");
 
-        return -1;
-    }
+            return -1;
+        }
 
-    // Server socket setup
-    bzero((char *) &server_addr, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
+        // Server socket setup
+        bzero((char *) &server_addr, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+        server_addr.sin_port = htons(port);
 
-    //If socket cannot be bound properly, return -1 and print error.
-    if (bind(server_fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
-        fprintf(stderr, "Error on binding.\n");
-        return -1;
-    }
+        //If socket cannot be bound properly, return -1 and print error.
+        if (bind(server_fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
+            fprintf(stderr, "Error on binding.\n");
+            return -1;
+        }
 
-    //Start listening
-    listen (server_fd, 5);
+        //Start listening
+        listen (server_fd, 64);
+    }
+    if (handoffPath != NULL) {
+        startHandoffListener();
+    }
 
     //Set client length based on client_addr
     cliLength = sizeof(client_addr);
 
-    int communicationSocket = -5;
-    //Loops until connection is ended (program currently setup to end with ctrl c and not user input.
-    while (connectionActive) {
-        // Wait for connection to be accepted and set connection to
-        communicationSocket = accept(server_fd, (struct sockaddr *) &client_addr, &cliLength);
+    timerWheelInit(&handshakeWheel, time(NULL));
+    timerWheelInit(&slotWheel, time(NULL));
 
-        // Variable to hold PID of fork process
-        pid_t spawnPID = -5;
+    // Children exiting wake up poll through the self-pipe instead of the loop polling for them
+    if (pipe2(childExitPipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+        fprintf(stderr, "Error creating child exit pipe.\n");
+        return -1;
+    }
+    struct sigaction childAction;
+    memset(&childAction, 0, sizeof(childAction));
+    childAction.sa_handler = notifyChildExit;
+    childAction.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &childAction, NULL);
 
-        // Check if there is a free process before fork and clear any if completed.
-        // If not, continues looping until a process ends.
-        checkProcesses();
+    struct pollfd* pollSet = malloc(sizeof(struct pollfd) * (MAX_PENDING + 4));
+    struct pendingConnection** polled = malloc(sizeof(struct pendingConnection*) * (MAX_PENDING + 4));
 
-        // Create fork and receive PID return value for processing
-        spawnPID = fork();
+    //Loops until connection is ended (program currently setup to end with ctrl c and not user input.
+    while (connectionActive) {
+        // Watch the listening socket while there is room for more connections, and every handshake in progress
+        int pollCount = 0;
+        struct pendingConnection* connection;
+        if (pendingCount < MAX_PENDING && !draining) {
+            pollSet[0].fd = server_fd;
+            pollSet[0].events = POLLIN;
+            polled[0] = NULL;
+            pollCount = 1;
+        }
+        for (connection = handshakes; connection != NULL; connection = connection->next) {
+            pollSet[pollCount].fd = connection->socket;
+            pollSet[pollCount].events = POLLIN;
+            polled[pollCount] = connection;
+            pollCount++;
+        }
 
-        // Perform actions based on PID value returned
-        switch (spawnPID) {
+        // Watch for a new instance taking over, and for the end of the instance this one took over from
+        if (handoffListenFd >= 0) {
+            pollSet[pollCount].fd = handoffListenFd;
+            pollSet[pollCount].events = POLLIN;
+            polled[pollCount] = NULL;
+            pollCount++;
+        }
+        if (handoffPeer >= 0) {
+            pollSet[pollCount].fd = handoffPeer;
+            pollSet[pollCount].events = POLLIN;
+            polled[pollCount] = NULL;
+            pollCount++;
+        }
+        pollSet[pollCount].fd = childExitPipe[0];
+        pollSet[pollCount].events = POLLIN;
+        polled[pollCount] = NULL;
+        pollCount++;
 
-            // Error forking, output respective error and exit
-            case -1: {
-                perror("PID Fork Error");
-                exit(1);
-                break;
-            }
+        // Finished children wake up poll through the self-pipe. Otherwise wake up once a second while handshakes or
+        // transfers with deadlines are in progress so the deadlines are enforced.
+        int running = checkProcesses();
+        int deadlines = handshakes != NULL || (running > 0 && (idleTimeout > 0 || transferTimeout > 0));
+        int ready = poll(pollSet, pollCount, deadlines ? 1000 : -1);
+        enforceDeadlines();
 
-            // Child process runs and performs operations
-            case 0: {
-                // Mandatory sleep for each child process
-                sleep(2);
+        // Dump metrics if requested. A signal interrupts poll, in which case nothing is ready.
+        if (metricsRequested) {
+            metricsRequested = 0;
+            dumpMetrics();
+        }
 
-                //Buffer receives get or post command
-                char* command = malloc(sizeof(char) * 8);
-                memset(command, '\0', 8);
+        int i;
+        for (i = 0; ready > 0 && i < pollCount; i++) {
+            if (pollSet[i].revents == 0) {
+                continue;
+            }
 
-                // Get command (post or get)
-                int valread = read(communicationSocket, command, 5);
+            if (pollSet[i].fd == handoffListenFd) {
+                handOffListener();
+                continue;
+            }
 
-                // Respond with acceptance message if received
-                if (valread > 0) {
-                    send(communicationSocket, "COMMAND_RECEIVED", 16, 0);
+            // Children are reaped below, the wake-ups only need to be drained
+            if (pollSet[i].fd == childExitPipe[0]) {
+                char wakes[64];
+                while (read(childExitPipe[0], wakes, sizeof(wakes)) > 0) {
                 }
+                continue;
+            }
 
-                // Accept username from otp
-                // Buffer receives get or post command
-                char* readBuffer = malloc(sizeof(char) * 1029);
-                memset(readBuffer, '\0', 1029);
-
-                // Get user from the client
-                valread = read(communicationSocket, readBuffer, 1024);
-
-                // Set user to user string after setting memory and clearing it
-                char* user = malloc(sizeof(char) * (strlen(readBuffer) + 5));
-                memset(user, '\0', strlen(readBuffer));
-                strcpy(user, readBuffer);
+            // Drops the previous instance held in memory are on disk once it is gone
+            if (pollSet[i].fd == handoffPeer) {
+                close(handoffPeer);
+                handoffPeer = -1;
+                if (memoryStore != NULL) {
+                    countDiskDrops();
+                }
+                continue;
+            }
 
-                // Respond with acceptance message if received
-                if (valread > 0) {
-                    send(communicationSocket, "USER_RECEIVED", 13, 0);
+            // New connection
+            if (polled[i] == NULL) {
+                int communicationSocket = accept(server_fd, (struct sockaddr *) &client_addr, &cliLength);
+                if (communicationSocket >= 0) {
+                    connection = malloc(sizeof(struct pendingConnection));
+                    memset(connection, 0, sizeof(struct pendingConnection));
+                    connection->socket = communicationSocket;
+                    connection->arrival = traceClock();
+                    connection->next = handshakes;
+                    handshakes = connection;
+                    pendingCount++;
+                    if (handshakeTimeout > 0) {
+                        connection->deadline.expiry = time(NULL) + handshakeTimeout;
+                        timerWheelInsert(&handshakeWheel, &connection->deadline);
+                    }
                 }
+                continue;
+            }
 
-                // Check if post or get and perform operations accordingly
-                if (strcmp("get", command) == 0) {
-                    performGetOperations(communicationSocket, user);
+            // Handshake step, finished handshakes move to their users queue and failed ones are dropped
+            connection = polled[i];
+            int result = advanceHandshake(connection);
+            if (result != 0) {
+                struct pendingConnection** link = &handshakes;
+                while (*link != connection) {
+                    link = &(*link)->next;
                 }
-                else if (strcmp("post", command) == 0) {
-                    performPostOperations(communicationSocket, user);
+                *link = connection->next;
+                if (handshakeTimeout > 0) {
+                    timerWheelRemove(&handshakeWheel, &connection->deadline);
                 }
 
-                // Free memory for user
-                free(user);
-                free(command);
-                free(readBuffer);
-
-                // Exit child process
-                exit(0);
-            }
-
-            // Parent process enters
-            default: {
-                int i;
-                // Loop through processes array and find a location with -5 to add PID of
-                // background process. When found, add PID to that location. There should
-                // always be a free process location at this point. Before a fork occurs,
-                // the program will check for max capacity of 5 processes and will wait
-                // until one finishes before adding more.
-                for (i = 0; i < 5; i++) {
-                    if (processes[i] == -5) {
-                        processes[i] = spawnPID;
-                        break;
-                    }
-                    fflush(stdout);
+                if (result == 1) {
+                    enqueueConnection(connection);
+                }
+                else {
+                    close(connection->socket);
+                    free(connection);
+                    pendingCount--;
                 }
             }
         }
 
+        checkProcesses();
+        dispatchConnections();
+
         fflush(stdout);
+
+        // A draining instance is done once every connection it accepted has been served
+        if (draining && pendingCount == 0 && checkProcesses() == 0) {
+            break;
+        }
     }
 
-    //Close control connection. Never really reached as the only way to close currently is ctrl c however.
-    close(communicationSocket);
+    //Close control connection, unless it was handed off
+    if (!draining) {
+        close(server_fd);
+    }
+    free(pollSet);
+    free(polled);
+    signal(SIGCHLD, SIG_DFL);
+    close(childExitPipe[0]);
+    close(childExitPipe[1]);
 
     return 0;
 }
 
+// Waits for the children ended by endProcesses and writes the memory store to disk.
+// Pre-conditions: Memory store must exist and endProcesses must have been called.
+// Post-conditions: Memory drops are saved as drop files. Returns the number of drops that could not be saved.
+int saveMemoryStore() {
+    int i;
+    for (i = 0; i < 5; i++) {
+        if (processes[i] != -5) {
+            waitpid(processes[i], NULL, 0);
+            reclaimStoreOwner(processes[i]);
+            processes[i] = -5;
+        }
+    }
+
+    return snapshotMemoryStore();
+}
+
 // End all processes started when called on exit.
 // Pre-conditions: Array of process ID's used in program is declared.
 // Post-conditions: All processes found are terminated.
@@ -494,36 +4272,216 @@ void endProcesses() {
             kill(processes[i], SIGTERM);
         }
     }
+
+    // End sweeper if running
+    if (sweeperPID != -5) {
+        kill(sweeperPID, SIGTERM);
+    }
+
+    // End replication processes
+    for (i = 0; i < followerCount; i++) {
+        kill(shipperPIDs[i], SIGTERM);
+    }
+    if (receiverPID != -5) {
+        kill(receiverPID, SIGTERM);
+    }
+}
+
+// Parses a non-negative integer command line option value. Outputs an error and exits if it is not one.
+// Pre-conditions: Must be passed the option value and a name describing it for error messages.
+// Post-conditions: Returns the value of the option.
+long long parseNumberOption(char* value, char* name) {
+    int i;
+    // Check if all values in argument are integers and output error/exit if not
+    for (i = 0; i < strlen(value); i++) {
+        if (!isdigit(value[i])) {
+            fprintf(stderr, "%s argument can only be an integer value.\n", name);
+            exit(1);
+        }
+    }
+
+    return atoll(value);
 }
 
 // Main takes in a command argument for the port number to listen for connections on while the server is running.
+// Optional arguments before the port set per-user quotas and drop expiry:
+//   -n <drops>    maximum number of drops stored per user
+//   -b <bytes>    maximum number of bytes stored per user
+//   -e <seconds>  time after which undelivered drops are reclaimed by the background sweeper
+//   -r <host:port> follower to replicate committed posts and delivery tombstones to (repeatable)
+//   -R [<address>:]<port> address (default 127.0.0.1) and port on which this instance accepts replication from a
+//                 leader. Any address other than a loopback one needs -K.
+//   -K <file>     replication key, the first 16 bytes of the file. A follower started with it only accepts leaders
+//                 that prove they hold the same key, and a leader answers the challenge of its followers with it.
+//   -c <count>    maximum number of connections of one user served at once
+//   -w <bytes>    bandwidth cap per user in bytes per second, shared by the users running connections
+//   -q <bytes>    deficit round robin quantum credited to a user on each round
+//   -m <bytes>    keep drops in a shared memory store of this size instead of files. On SIGINT or SIGTERM the store
+//                 is written to disk as regular drop files.
+//   -s            with -m, move drops that do not fit in memory to disk instead of rejecting them
+//   -C <bytes>    keep copies of recently posted drop files in a hot-drop cache of this size, so gets of them do
+//                 not read the file
+//   -H <seconds>  deadline for a client to send its command and user (default 10, 0 disables)
+//   -I <seconds>  deadline for a transfer to make progress (default 60, 0 disables)
+//   -D <seconds>  deadline for a whole transfer (default none)
+//   -M <bytes>    minimum average transfer rate in bytes per second, checked once the idle deadline has passed
+//   -T <file>     append a record of every finished request to this trace file (see trace.h and otp_replay)
+//   -U <path>     Unix socket for restarts without downtime. An instance started with the same path takes over the
+//                 listening socket of the one running, which stops accepting, finishes the requests it already
+//                 accepted and exits.
 // The server driver function is called if the port consists of what appears to be a valid value and runs the server
 // processes until exited. When finished, endProcesses is called to ensure all processes have ended prior to exiting.
+// Sending SIGUSR1 to the server outputs its metrics.
 int main(int argc, char* argv[]) {
     // Initialize processes array indices to -5
     initializeProcesses();
 
+    // Read optional limits
+    int option;
+    while ((option = getopt(argc, argv, "n:b:e:r:R:K:c:w:q:m:sC:H:I:D:M:T:U:")) != -1) {
+        switch (option) {
+            case 'n': {
+                quotaDrops = parseNumberOption(optarg, "Drop quota");
+                break;
+            }
+            case 'b': {
+                quotaBytes = parseNumberOption(optarg, "Byte quota");
+                break;
+            }
+            case 'e': {
+                dropTTL = parseNumberOption(optarg, "Expiry");
+                break;
+            }
+            case 'r': {
+                if (followerCount == MAX_FOLLOWERS || strchr(optarg, ':') == NULL) {
+                    fprintf(stderr, "Followers must be given as host:port, at most %d of them.\n", MAX_FOLLOWERS);
+                    exit(1);
+                }
+                followers[followerCount] = optarg;
+                followerCount++;
+                break;
+            }
+            case 'R': {
+                // An address given before the port replaces the loopback default
+                char* colon = strrchr(optarg, ':');
+                if (colon != NULL) {
+                    *colon = '\0';
+                    replicationHost = optarg;
+                    optarg = colon + 1;
+                }
+                struct in_addr address;
+                if (inet_pton(AF_INET, replicationHost, &address) != 1) {
+                    fprintf(stderr, "Replication address must be an IPv4 address.\n");
+                    exit(1);
+                }
+                replicationPort = (int) parseNumberOption(optarg, "Replication port");
+                break;
+            }
+            case 'K': {
+                // The first 16 bytes of the file are the key
+                unsigned char key[16];
+                int keyFd = open(optarg, O_RDONLY);
+                if (keyFd < 0 || read(keyFd, key, sizeof(key)) != sizeof(key)) {
+                    fprintf(stderr, "Replication key file must hold at least 16 bytes.\n");
+                    exit(1);
+                }
+                close(keyFd);
+                replicationKey[0] = getUnsigned(key, 8);
+                replicationKey[1] = getUnsigned(key + 8, 8);
+                replicationKeyed = 1;
+                break;
+            }
+            case 'c': {
+                perUserConcurrency = (int) parseNumberOption(optarg, "Concurrency");
+                break;
+            }
+            case 'w': {
+                perUserBandwidth = parseNumberOption(optarg, "Bandwidth");
+                break;
+            }
+            case 'q': {
+                drrQuantum = parseNumberOption(optarg, "Quantum");
+                break;
+            }
+            case 'm': {
+                storeCapacity = parseNumberOption(optarg, "Memory store size");
+                break;
+            }
+            case 's': {
+                storeSpill = 1;
+                break;
+            }
+            case 'C': {
+                cacheCapacity = parseNumberOption(optarg, "Cache size");
+                break;
+            }
+            case 'H': {
+                handshakeTimeout = parseNumberOption(optarg, "Handshake deadline");
+                break;
+            }
+            case 'I': {
+                idleTimeout = parseNumberOption(optarg, "Idle deadline");
+                break;
+            }
+            case 'D': {
+                transferTimeout = parseNumberOption(optarg, "Transfer deadline");
+                break;
+            }
+            case 'M': {
+                minThroughput = parseNumberOption(optarg, "Minimum throughput");
+                break;
+            }
+            case 'U': {
+                handoffPath = optarg;
+                break;
+            }
+            case 'T': {
+                traceFd = open(optarg, O_WRONLY | O_CREAT | O_APPEND, 0644);
+                struct stat traceAttributes;
+                if (traceFd < 0 || fstat(traceFd, &traceAttributes) != 0) {
+                    fprintf(stderr, "Could not open trace file %s.\n", optarg);
+                    exit(1);
+                }
+                if (traceAttributes.st_size == 0) {
+                    write(traceFd, TRACE_MAGIC, TRACE_MAGIC_LEN);
+                }
+
+                // The key is never stored, so user hashes cannot be reversed by hashing guessed names
+                int randomFd = open("/dev/urandom", O_RDONLY);
+                if (randomFd < 0 || read(randomFd, &traceSecret, sizeof(traceSecret)) != sizeof(traceSecret)) {
+                    fprintf(stderr, "Could not generate the trace key.\n");
+                    exit(1);
+                }
+                close(randomFd);
+                break;
+            }
+            default: {
+                fprintf(stderr, "Usage: otp_d [-n drops] [-b bytes] [-e seconds] [-r host:port] [-R [address:]port] "
+                        "[-K file] [-c count] [-w bytes] [-q bytes] [-m bytes [-s]] [-C bytes] [-H seconds] "
+                        "[-I seconds] [-D seconds] [-M bytes] [-T file] [-U path] <port>\n");
+                exit(1);
+            }
+        }
+    }
+
+    // Anyone who can reach an unauthenticated receiver can rewrite the drops, so only loopback may go without a key
+    if (replicationPort > 0 && !replicationKeyed && strncmp(replicationHost, "127.", 4) != 0) {
+        fprintf(stderr, "A replication port bound to %s needs a replication key (-K).\n", replicationHost);
+        exit(1);
+    }
+
     //Check to see that correct number of arguments are included, if not throw error
-    if (argc < 2) {
+    if (argc - optind < 1) {
         fprintf(stderr, "A port number must be provided to listen on as a command line argument.");
         exit(1);
     }
-    else if (argc > 2) {
+    else if (argc - optind > 1) {
         fprintf(stderr, "Only one command line argument should be provided to specify port to listen on.");
         exit(1);
     }
 
-    int i;
-    // Check if all values in argument are integers and output error/exit if not
-    for (i = 0; i < strlen(argv[1]); i++) {
-        if (!isdigit(argv[1][i])) {
-            fprintf(stderr, "Port number argument can only be an integer value.\n");
-            exit(1);
-        }
-    }
-
     //Set port
-    int port = atoi(argv[1]);
+    int port = (int) parseNumberOption(argv[optind], "Port number");
 
     //If port number is invalid range, throw error
     if (port <= 0 || port > 65535) {
@@ -531,16 +4489,87 @@ int main(int argc, char* argv[]) {
         exit(1);
     }
 
+    // Metrics are shared with every child and the sweeper
+    metrics = mmap(NULL, sizeof(struct serverMetrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (metrics == MAP_FAILED) {
+        perror("Metrics allocation error");
+        exit(1);
+    }
+    memset(metrics, 0, sizeof(struct serverMetrics));
+
+    // Progress of each process slot is written by its child and read by the scheduler
+    progress = mmap(NULL, sizeof(struct slotProgress) * 5, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (progress == MAP_FAILED) {
+        perror("Progress allocation error");
+        exit(1);
+    }
+    pacers = mmap(NULL, sizeof(struct bandwidthPacer) * 5, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (pacers == MAP_FAILED) {
+        perror("Pacer allocation error");
+        exit(1);
+    }
+    if (perUserConcurrency < 1 || drrQuantum < 1) {
+        fprintf(stderr, "Concurrency and quantum must be at least 1.\n");
+        exit(1);
+    }
+
+    // SIGUSR1 interrupts accept (no SA_RESTART) so the metrics are dumped right away
+    struct sigaction metricsAction;
+    memset(&metricsAction, 0, sizeof(metricsAction));
+    metricsAction.sa_handler = requestMetrics;
+    sigaction(SIGUSR1, &metricsAction, NULL);
+
+    // The memory store and cache are created before any process that may touch it is started
+    if (storeCapacity > 0) {
+        if (storeCapacity < STORE_BLOCK_SIZE) {
+            fprintf(stderr, "Memory store size must be at least %d bytes.\n", STORE_BLOCK_SIZE);
+            exit(1);
+        }
+        initMemoryStore(storeCapacity);
+        countDiskDrops();
+    }
+    if (cacheCapacity > 0) {
+        if (cacheCapacity < CACHE_BLOCK_SIZE * CACHE_ENTRY_SHARE) {
+            fprintf(stderr, "Cache size must be at least %d bytes.\n", CACHE_BLOCK_SIZE * CACHE_ENTRY_SHARE);
+            exit(1);
+        }
+        initDropCache(cacheCapacity);
+    }
+
+    // A running instance hands over its listening socket, and ends its replication processes, before this one starts
+    if (handoffPath != NULL) {
+        receiveListener(port);
+    }
+
+    // Replication starts first so the sweeper inherits the journal
+    startReplication();
+
+    if (dropTTL > 0) {
+        startSweeper();
+    }
+
+    // Stop cleanly on SIGINT and SIGTERM so the memory store can be saved
+    if (memoryStore != NULL) {
+        struct sigaction shutdownAction;
+        memset(&shutdownAction, 0, sizeof(shutdownAction));
+        shutdownAction.sa_handler = requestShutdown;
+        sigaction(SIGINT, &shutdownAction, NULL);
+        sigaction(SIGTERM, &shutdownAction, NULL);
+    }
+
     //Run server
     int error = runServer(port);
 
     // Kills any remaining processes
     endProcesses();
+    if (memoryStore != NULL && saveMemoryStore() > 0) {
+        error = -1;
+    }
 
-    // If an error occurs with opening socket/binding, then exit.
+    // If an error occurs with opening socket/binding or drops were lost, then exit.
     if (error == -1) {
         exit(1);
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,821 @@
+// Author: Justin Tromp
+// Date: 10/19/2026
+// Description: otp_pack is an offline backup and migration tool for the drops held by otp_d. Export packs every
+// pending <pid>_<user> drop in the current directory into a single archive in which each user's drops are stored
+// oldest first with an explicit sequence number, so ordering no longer depends on copy tools preserving st_mtime.
+// Import unpacks such an archive into the current directory and restores the ordering. Drop contents are read or
+// written by a pool of worker threads while the archive itself is streamed with large sequential I/O. Every drop is
+// checked against the CRC32C otp_d stored with it on export and against the one in the archive on import, and the
+// imported drop gets it back so otp can still verify it when it is delivered.
+// Valid export arguments: export <archive> [threads]
+// Valid import arguments: import <archive> [threads]
+// References: Previous Assignments
+// https://man7.org/linux/man-pages/man3/pthread_create.3.html
+// https://man7.org/linux/man-pages/man2/utimensat.2.html
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include "bigendian.h"
+#include "crc32c.h"
+
+// Archive layout: an 8 byte magic and a 64 bit record count, followed by one record per drop. Every integer is
+// stored big-endian. A record is a fixed header (user length, per-user sequence, original numeric prefix, mtime
+// seconds, mtime nanoseconds, data size) followed by the user name, the drop bytes and the CRC32C of the drop bytes.
+#define PACK_MAGIC "OTPPACK2"
+#define PACK_MAGIC_LEN 8
+#define RECORD_HEADER_LEN 34
+#define RECORD_CHECKSUM_LEN 4
+
+// Drops are moved in batches so that worker threads can load (or store) one batch while the archive is streamed
+// for the previous one. Drops larger than STREAM_THRESHOLD are never held in memory and are copied directly.
+#define BATCH_MAX_DROPS 4096
+#define BATCH_MAX_BYTES (64 * 1024 * 1024)
+#define STREAM_THRESHOLD (8 * 1024 * 1024)
+#define ARCHIVE_BUFFER_SIZE (8 * 1024 * 1024)
+#define COPY_BUFFER_SIZE (1024 * 1024)
+#define MAX_THREADS 64
+
+// A single drop being exported or imported.
+struct dropEntry {
+    char* user;
+    unsigned long long prefix;
+    unsigned int userSeq;
+    struct timespec mtime;
+    unsigned long long size;
+    char* data;
+    uint32_t crc;
+    int streamed;
+    int error;
+    int corrupt;
+};
+
+// Range of drops handed to the worker threads along with the shared claim counter.
+struct batchJob {
+    struct dropEntry* entries;
+    size_t start;
+    size_t end;
+    size_t next;
+    int threadCount;
+    pthread_t threads[MAX_THREADS];
+};
+
+// Checks whether a directory entry name has the <pid>_<user> form used for drops by otp_d. If so, the numeric
+// prefix is stored in prefix and a pointer to the user part of the name is returned.
+// Pre-conditions: Must be passed a valid file name and a location for the prefix.
+// Post-conditions: Returns the user portion of the name for a drop, otherwise NULL.
+char* parseDropName(char* name, unsigned long long* prefix) {
+    int i = 0;
+    unsigned long long value = 0;
+
+    // Prefix must be at least one digit (pids never start with a zero) followed by an underscore and a
+    // non-empty user
+    if (name[0] == '0') {
+        return NULL;
+    }
+    while (isdigit((unsigned char) name[i])) {
+        value = value * 10 + (name[i] - '0');
+        i++;
+    }
+    if (i == 0 || name[i] != '_' || name[i + 1] == '\0') {
+        return NULL;
+    }
+
+    *prefix = value;
+    return &name[i + 1];
+}
+
+// Orders drops by user and then by modification time (oldest first), using the numeric prefix as a tie breaker.
+// Pre-conditions: Both parameters point to dropEntry structures.
+// Post-conditions: Returns negative, zero or positive for qsort.
+int compareDrops(const void* first, const void* second) {
+    const struct dropEntry* a = first;
+    const struct dropEntry* b = second;
+
+    int userOrder = strcmp(a->user, b->user);
+    if (userOrder != 0) {
+        return userOrder;
+    }
+    if (a->mtime.tv_sec != b->mtime.tv_sec) {
+        return a->mtime.tv_sec < b->mtime.tv_sec ? -1 : 1;
+    }
+    if (a->mtime.tv_nsec != b->mtime.tv_nsec) {
+        return a->mtime.tv_nsec < b->mtime.tv_nsec ? -1 : 1;
+    }
+    if (a->prefix != b->prefix) {
+        return a->prefix < b->prefix ? -1 : 1;
+    }
+
+    return 0;
+}
+
+// Reads exactly size bytes from fd into buffer, retrying on short reads.
+// Pre-conditions: Must be passed an open file descriptor and a buffer of at least size bytes.
+// Post-conditions: Returns 0 if all bytes were read, otherwise -1.
+int readFully(int fd, char* buffer, unsigned long long size) {
+    unsigned long long done = 0;
+    while (done < size) {
+        ssize_t bytesRead = read(fd, buffer + done, size - done);
+        if (bytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead <= 0) {
+            return -1;
+        }
+        done = done + bytesRead;
+    }
+
+    return 0;
+}
+
+// Writes exactly size bytes from buffer to fd, retrying on short writes.
+// Pre-conditions: Must be passed an open file descriptor and a buffer of at least size bytes.
+// Post-conditions: Returns 0 if all bytes were written, otherwise -1.
+int writeFully(int fd, char* buffer, unsigned long long size) {
+    unsigned long long done = 0;
+    while (done < size) {
+        ssize_t bytesWritten = write(fd, buffer + done, size - done);
+        if (bytesWritten < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesWritten <= 0) {
+            return -1;
+        }
+        done = done + bytesWritten;
+    }
+
+    return 0;
+}
+
+// Stores the CRC32C of a drop file with it, the way otp_d does.
+// Pre-conditions: Must be passed a descriptor of the drop file and its checksum.
+// Post-conditions: Checksum is stored, unless the file system does not support extended attributes.
+void setDropChecksum(int fd, uint32_t crc) {
+    char value[9];
+    snprintf(value, 9, "%08x", crc);
+    fsetxattr(fd, CRC32C_XATTR, value, 8, 0);
+}
+
+// Reads the CRC32C otp_d stored with a drop file.
+// Pre-conditions: Must be passed a descriptor of the drop file and a location for the checksum.
+// Post-conditions: Returns 1 and sets crc if the file has a checksum, otherwise 0.
+int getDropChecksum(int fd, uint32_t* crc) {
+    char value[9];
+    memset(value, '\0', 9);
+    if (fgetxattr(fd, CRC32C_XATTR, value, 8) != 8) {
+        return 0;
+    }
+
+    return sscanf(value, "%8x", crc) == 1;
+}
+
+// Builds the on-disk file name of a drop from its prefix and user.
+// Pre-conditions: Must be passed a buffer of at least 512 bytes and a drop entry.
+// Post-conditions: Buffer holds the <pid>_<user> name of the drop.
+void buildDropName(char* buffer, struct dropEntry* entry) {
+    snprintf(buffer, 512, "%llu_%s", entry->prefix, entry->user);
+}
+
+// Loads the contents of an exported drop into memory and checksums them.
+// Pre-conditions: Entry must describe a drop in the current directory that is not streamed.
+// Post-conditions: Entry data and crc hold the drop contents and their checksum, or the entry error flag is set
+// (and corrupt, if the contents do not match the checksum stored with the drop).
+void loadDrop(struct dropEntry* entry) {
+    char name[512];
+    buildDropName(name, entry);
+
+    entry->data = malloc(entry->size + 1);
+    int fd = open(name, O_RDONLY);
+    if (entry->data == NULL || fd < 0 || readFully(fd, entry->data, entry->size) != 0) {
+        entry->error = 1;
+    }
+    else {
+        uint32_t stored;
+        entry->crc = crc32cUpdate(0, entry->data, entry->size);
+        if (getDropChecksum(fd, &stored) && stored != entry->crc) {
+            entry->error = 1;
+            entry->corrupt = 1;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+// Creates the file of an imported drop exclusively and sets its checksum and modification time. If a drop with the
+// same name already exists, the numeric prefix is bumped until a free name is found.
+// Pre-conditions: Entry must hold a valid user and, unless streamed, its data and the checksum from the archive.
+// Post-conditions: Returns an open descriptor for the created file (streamed entries) or stores the data,
+// closes the file and returns 0. Returns -1 on error, with corrupt set and no file created if the data does not
+// match its checksum.
+int storeDrop(struct dropEntry* entry) {
+    char name[512];
+    int fd = -1;
+    int attempts = 0;
+
+    if (!entry->streamed && crc32cUpdate(0, entry->data, entry->size) != entry->crc) {
+        entry->corrupt = 1;
+        return -1;
+    }
+
+    // Never overwrite a drop that is already present on this host
+    while (fd < 0 && attempts < 1000) {
+        buildDropName(name, entry);
+        fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0666);
+        if (fd < 0 && errno != EEXIST) {
+            return -1;
+        }
+        if (fd < 0) {
+            entry->prefix = entry->prefix + 1;
+            attempts++;
+        }
+    }
+    if (fd < 0) {
+        return -1;
+    }
+
+    // Streamed drops are filled in by the caller
+    if (entry->streamed) {
+        return fd;
+    }
+
+    struct timespec times[2] = { entry->mtime, entry->mtime };
+    int error = writeFully(fd, entry->data, entry->size);
+    if (error == 0) {
+        setDropChecksum(fd, entry->crc);
+        error = futimens(fd, times);
+    }
+    close(fd);
+
+    return error;
+}
+
+// Worker thread bodies. Each claims drops from the shared batch one at a time and loads (export) or stores
+// (import) them.
+// Pre-conditions: Argument must point to a started batchJob.
+// Post-conditions: All drops in the batch have been processed.
+void* loadWorker(void* argument) {
+    struct batchJob* job = argument;
+
+    while (1) {
+        size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->end) {
+            break;
+        }
+        if (!job->entries[i].streamed) {
+            loadDrop(&job->entries[i]);
+        }
+    }
+
+    return NULL;
+}
+
+void* storeWorker(void* argument) {
+    struct batchJob* job = argument;
+
+    while (1) {
+        size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->end) {
+            break;
+        }
+        if (!job->entries[i].streamed && storeDrop(&job->entries[i]) != 0) {
+            job->entries[i].error = 1;
+        }
+    }
+
+    return NULL;
+}
+
+// Starts worker threads on the range of drops [start, end).
+// Pre-conditions: Job must not have running threads.
+// Post-conditions: Worker threads are running on the batch.
+void startBatch(struct batchJob* job, struct dropEntry* entries, size_t start, size_t end, int threadCount,
+                void* (*worker)(void*)) {
+    job->entries = entries;
+    job->start = start;
+    job->end = end;
+    job->next = start;
+    job->threadCount = threadCount;
+
+    int i;
+    for (i = 0; i < threadCount; i++) {
+        if (pthread_create(&job->threads[i], NULL, worker, job) != 0) {
+            fprintf(stderr, "Could not create worker thread.\n");
+            exit(1);
+        }
+    }
+}
+
+// Waits for all worker threads of a batch to finish.
+// Pre-conditions: Job must have been started with startBatch.
+// Post-conditions: All worker threads of the batch have exited.
+void finishBatch(struct batchJob* job) {
+    int i;
+    for (i = 0; i < job->threadCount; i++) {
+        pthread_join(job->threads[i], NULL);
+    }
+    job->threadCount = 0;
+}
+
+// Determines where the batch starting at start ends, bounded by drop count and buffered bytes.
+// Pre-conditions: Start must be less than count.
+// Post-conditions: Returns the index one past the last drop of the batch.
+size_t batchEnd(struct dropEntry* entries, size_t start, size_t count) {
+    size_t end = start;
+    unsigned long long bytes = 0;
+
+    while (end < count && end - start < BATCH_MAX_DROPS && bytes < BATCH_MAX_BYTES) {
+        if (!entries[end].streamed) {
+            bytes = bytes + entries[end].size;
+        }
+        end++;
+    }
+
+    return end;
+}
+
+// Writes a record header for entry to the archive.
+// Pre-conditions: Archive must be open for writing.
+// Post-conditions: Record header and user name are written. Exits on error.
+void writeRecordHeader(FILE* archive, struct dropEntry* entry) {
+    unsigned char header[RECORD_HEADER_LEN];
+    size_t userLen = strlen(entry->user);
+
+    putUnsigned(header, userLen, 2);
+    putUnsigned(header + 2, entry->userSeq, 4);
+    putUnsigned(header + 6, entry->prefix, 8);
+    putUnsigned(header + 14, (unsigned long long) entry->mtime.tv_sec, 8);
+    putUnsigned(header + 22, (unsigned long long) entry->mtime.tv_nsec, 4);
+    putUnsigned(header + 26, entry->size, 8);
+
+    if (fwrite(header, 1, RECORD_HEADER_LEN, archive) != RECORD_HEADER_LEN ||
+        fwrite(entry->user, 1, userLen, archive) != userLen) {
+        fprintf(stderr, "Error writing to archive.\n");
+        exit(1);
+    }
+}
+
+// Writes the checksum that closes a record to the archive.
+// Pre-conditions: Archive must be open for writing and positioned after the drop contents.
+// Post-conditions: Checksum is written. Exits on error.
+void writeRecordChecksum(FILE* archive, uint32_t crc) {
+    unsigned char trailer[RECORD_CHECKSUM_LEN];
+    putUnsigned(trailer, crc, RECORD_CHECKSUM_LEN);
+
+    if (fwrite(trailer, 1, RECORD_CHECKSUM_LEN, archive) != RECORD_CHECKSUM_LEN) {
+        fprintf(stderr, "Error writing to archive.\n");
+        exit(1);
+    }
+}
+
+// Copies a drop too large to buffer straight from its file into the archive, checksumming it on the way.
+// Pre-conditions: Archive must be open for writing and entry must describe an existing drop.
+// Post-conditions: Drop contents are appended to the archive and entry crc holds their checksum. Exits on error
+// or if the contents do not match the checksum stored with the drop.
+void streamDropToArchive(FILE* archive, struct dropEntry* entry, char* copyBuffer) {
+    char name[512];
+    buildDropName(name, entry);
+
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open drop %s.\n", name);
+        exit(1);
+    }
+
+    unsigned long long left = entry->size;
+    while (left > 0) {
+        unsigned long long chunk = left < COPY_BUFFER_SIZE ? left : COPY_BUFFER_SIZE;
+        if (readFully(fd, copyBuffer, chunk) != 0 || fwrite(copyBuffer, 1, chunk, archive) != chunk) {
+            fprintf(stderr, "Error copying drop %s.\n", name);
+            exit(1);
+        }
+        entry->crc = crc32cUpdate(entry->crc, copyBuffer, chunk);
+        left = left - chunk;
+    }
+
+    uint32_t stored;
+    if (getDropChecksum(fd, &stored) && stored != entry->crc) {
+        fprintf(stderr, "Drop %s does not match its checksum.\n", name);
+        exit(1);
+    }
+    close(fd);
+}
+
+// Collects every drop in the current directory into a sorted array and assigns per-user sequence numbers.
+// Pre-conditions: Must be passed a location for the number of drops found.
+// Post-conditions: Returns the sorted array of drops (may be NULL when none are found).
+struct dropEntry* collectDrops(size_t* count) {
+    size_t capacity = 0;
+    struct dropEntry* entries = NULL;
+    *count = 0;
+
+    DIR* dirToExamine = opendir(".");
+    if (dirToExamine == NULL) {
+        perror("Could not open directory");
+        exit(1);
+    }
+
+    struct dirent* file;
+    struct stat fileAttributes;
+    while ((file = readdir(dirToExamine)) != NULL) {
+        unsigned long long prefix = 0;
+        char* user = parseDropName(file->d_name, &prefix);
+
+        if (user == NULL || lstat(file->d_name, &fileAttributes) != 0 || !S_ISREG(fileAttributes.st_mode)) {
+            continue;
+        }
+
+        // Grow array when full
+        if (*count == capacity) {
+            capacity = capacity == 0 ? 1024 : capacity * 2;
+            entries = realloc(entries, sizeof(struct dropEntry) * capacity);
+            if (entries == NULL) {
+                fprintf(stderr, "Out of memory.\n");
+                exit(1);
+            }
+        }
+
+        struct dropEntry* entry = &entries[*count];
+        memset(entry, 0, sizeof(struct dropEntry));
+        entry->user = strdup(user);
+        entry->prefix = prefix;
+        entry->mtime = fileAttributes.st_mtim;
+        entry->size = fileAttributes.st_size;
+        entry->streamed = entry->size > STREAM_THRESHOLD;
+        *count = *count + 1;
+    }
+    closedir(dirToExamine);
+
+    if (*count > 0) {
+        qsort(entries, *count, sizeof(struct dropEntry), compareDrops);
+    }
+
+    // Number drops of each user from oldest to newest
+    size_t i;
+    for (i = 0; i < *count; i++) {
+        if (i > 0 && strcmp(entries[i].user, entries[i - 1].user) == 0) {
+            entries[i].userSeq = entries[i - 1].userSeq + 1;
+        }
+    }
+
+    return entries;
+}
+
+// Exports all drops in the current directory to the archive at path. Worker threads load the next batch of drops
+// while the current batch is written to the archive.
+// Pre-conditions: Must be passed a writable archive path and a thread count of at least 1.
+// Post-conditions: Archive holds every drop found. Exits on error.
+void exportDrops(char* path, int threadCount) {
+    size_t count = 0;
+    struct dropEntry* entries = collectDrops(&count);
+
+    FILE* archive = fopen(path, "wb");
+    if (archive == NULL) {
+        fprintf(stderr, "Could not open archive %s for writing.\n", path);
+        exit(1);
+    }
+    setvbuf(archive, NULL, _IOFBF, ARCHIVE_BUFFER_SIZE);
+
+    unsigned char header[PACK_MAGIC_LEN + 8];
+    memcpy(header, PACK_MAGIC, PACK_MAGIC_LEN);
+    putUnsigned(header + PACK_MAGIC_LEN, count, 8);
+    if (fwrite(header, 1, sizeof(header), archive) != sizeof(header)) {
+        fprintf(stderr, "Error writing to archive.\n");
+        exit(1);
+    }
+
+    char* copyBuffer = malloc(COPY_BUFFER_SIZE);
+    struct batchJob jobs[2];
+    size_t start = 0;
+    size_t end = count > 0 ? batchEnd(entries, 0, count) : 0;
+    int current = 0;
+
+    if (count > 0) {
+        startBatch(&jobs[current], entries, start, end, threadCount, loadWorker);
+    }
+
+    // Write each batch while the next one is being loaded
+    while (start < count) {
+        finishBatch(&jobs[current]);
+
+        size_t nextStart = end;
+        size_t nextEnd = nextStart < count ? batchEnd(entries, nextStart, count) : nextStart;
+        if (nextStart < count) {
+            startBatch(&jobs[1 - current], entries, nextStart, nextEnd, threadCount, loadWorker);
+        }
+
+        size_t i;
+        for (i = start; i < end; i++) {
+            char name[512];
+            buildDropName(name, &entries[i]);
+
+            if (entries[i].corrupt) {
+                fprintf(stderr, "Drop %s does not match its checksum.\n", name);
+                exit(1);
+            }
+            if (entries[i].error) {
+                fprintf(stderr, "Could not read drop %s.\n", name);
+                exit(1);
+            }
+
+            writeRecordHeader(archive, &entries[i]);
+            if (entries[i].streamed) {
+                streamDropToArchive(archive, &entries[i], copyBuffer);
+            }
+            else if (fwrite(entries[i].data, 1, entries[i].size, archive) != entries[i].size) {
+                fprintf(stderr, "Error writing to archive.\n");
+                exit(1);
+            }
+            writeRecordChecksum(archive, entries[i].crc);
+
+            free(entries[i].data);
+            entries[i].data = NULL;
+        }
+
+        start = nextStart;
+        end = nextEnd;
+        current = 1 - current;
+    }
+
+    if (fclose(archive) != 0) {
+        fprintf(stderr, "Error writing to archive.\n");
+        exit(1);
+    }
+
+    fprintf(stdout, "Exported %zu drops to %s\n", count, path);
+
+    size_t i;
+    for (i = 0; i < count; i++) {
+        free(entries[i].user);
+    }
+    free(entries);
+    free(copyBuffer);
+}
+
+// Reads the next record header and user from the archive into entry.
+// Pre-conditions: Archive must be positioned at the start of a record.
+// Post-conditions: Entry holds the record metadata. Exits if the archive is malformed.
+void readRecordHeader(FILE* archive, struct dropEntry* entry) {
+    unsigned char header[RECORD_HEADER_LEN];
+
+    if (fread(header, 1, RECORD_HEADER_LEN, archive) != RECORD_HEADER_LEN) {
+        fprintf(stderr, "Archive is truncated.\n");
+        exit(1);
+    }
+
+    size_t userLen = getUnsigned(header, 2);
+    memset(entry, 0, sizeof(struct dropEntry));
+    entry->userSeq = getUnsigned(header + 2, 4);
+    entry->prefix = getUnsigned(header + 6, 8);
+    entry->mtime.tv_sec = (time_t) getUnsigned(header + 14, 8);
+    entry->mtime.tv_nsec = (long) getUnsigned(header + 22, 4);
+    entry->size = getUnsigned(header + 26, 8);
+    entry->streamed = entry->size > STREAM_THRESHOLD;
+
+    entry->user = malloc(userLen + 1);
+    if (userLen == 0 || fread(entry->user, 1, userLen, archive) != userLen) {
+        fprintf(stderr, "Archive is truncated.\n");
+        exit(1);
+    }
+    entry->user[userLen] = '\0';
+
+    // Reject names that could escape the current directory
+    if (strchr(entry->user, '/') != NULL || memchr(entry->user, '\0', userLen) != NULL ||
+        entry->mtime.tv_nsec >= 1000000000L) {
+        fprintf(stderr, "Archive contains an invalid record.\n");
+        exit(1);
+    }
+}
+
+// Reads the checksum that closes a record from the archive.
+// Pre-conditions: Archive must be positioned after the drop contents.
+// Post-conditions: Returns the checksum. Exits if the archive is truncated.
+uint32_t readRecordChecksum(FILE* archive) {
+    unsigned char trailer[RECORD_CHECKSUM_LEN];
+
+    if (fread(trailer, 1, RECORD_CHECKSUM_LEN, archive) != RECORD_CHECKSUM_LEN) {
+        fprintf(stderr, "Archive is truncated.\n");
+        exit(1);
+    }
+
+    return (uint32_t) getUnsigned(trailer, RECORD_CHECKSUM_LEN);
+}
+
+// Copies a drop too large to buffer straight from the archive into a new drop file, checksumming it on the way.
+// Pre-conditions: Archive must be positioned at the drop contents of entry.
+// Post-conditions: Drop file is created with its checksum and modification time restored. Exits on error, removing
+// the drop file if its contents do not match the checksum in the archive.
+void streamDropFromArchive(FILE* archive, struct dropEntry* entry, char* copyBuffer) {
+    int fd = storeDrop(entry);
+    if (fd < 0) {
+        fprintf(stderr, "Could not create drop for %s.\n", entry->user);
+        exit(1);
+    }
+
+    unsigned long long left = entry->size;
+    while (left > 0) {
+        unsigned long long chunk = left < COPY_BUFFER_SIZE ? left : COPY_BUFFER_SIZE;
+        if (fread(copyBuffer, 1, chunk, archive) != chunk || writeFully(fd, copyBuffer, chunk) != 0) {
+            fprintf(stderr, "Error copying drop for %s.\n", entry->user);
+            exit(1);
+        }
+        entry->crc = crc32cUpdate(entry->crc, copyBuffer, chunk);
+        left = left - chunk;
+    }
+
+    if (readRecordChecksum(archive) != entry->crc) {
+        char name[512];
+        buildDropName(name, entry);
+        unlink(name);
+        fprintf(stderr, "Drop for %s does not match its checksum in the archive.\n", entry->user);
+        exit(1);
+    }
+    setDropChecksum(fd, entry->crc);
+
+    struct timespec times[2] = { entry->mtime, entry->mtime };
+    if (futimens(fd, times) != 0) {
+        fprintf(stderr, "Could not set the time of the drop for %s.\n", entry->user);
+        exit(1);
+    }
+    close(fd);
+}
+
+// Frees the drops of a stored batch, exiting if any of them could not be written.
+// Pre-conditions: Batch threads must have finished.
+// Post-conditions: Memory held by the batch is released.
+void releaseBatch(struct dropEntry* entries, size_t count) {
+    size_t i;
+    for (i = 0; i < count; i++) {
+        if (entries[i].corrupt) {
+            fprintf(stderr, "Drop for %s does not match its checksum in the archive.\n", entries[i].user);
+            exit(1);
+        }
+        if (entries[i].error) {
+            fprintf(stderr, "Could not create drop for %s.\n", entries[i].user);
+            exit(1);
+        }
+        free(entries[i].user);
+        free(entries[i].data);
+    }
+}
+
+// Imports all drops of the archive at path into the current directory. Worker threads write one batch of drops
+// while the next batch is read sequentially from the archive. Within each user, modification times are made
+// strictly increasing in archive order so otp_d delivers the drops in their original sequence.
+// Pre-conditions: Must be passed a readable archive path and a thread count of at least 1.
+// Post-conditions: Every drop of the archive exists as a <pid>_<user> file. Exits on error.
+void importDrops(char* path, int threadCount) {
+    FILE* archive = fopen(path, "rb");
+    if (archive == NULL) {
+        fprintf(stderr, "Could not open archive %s for reading.\n", path);
+        exit(1);
+    }
+    setvbuf(archive, NULL, _IOFBF, ARCHIVE_BUFFER_SIZE);
+
+    unsigned char header[PACK_MAGIC_LEN + 8];
+    if (fread(header, 1, sizeof(header), archive) != sizeof(header) ||
+        memcmp(header, PACK_MAGIC, PACK_MAGIC_LEN) != 0) {
+        fprintf(stderr, "%s is not an otp_pack archive.\n", path);
+        exit(1);
+    }
+    unsigned long long count = getUnsigned(header + PACK_MAGIC_LEN, 8);
+
+    char* copyBuffer = malloc(COPY_BUFFER_SIZE);
+    struct dropEntry* batches[2];
+    batches[0] = malloc(sizeof(struct dropEntry) * BATCH_MAX_DROPS);
+    batches[1] = malloc(sizeof(struct dropEntry) * BATCH_MAX_DROPS);
+    size_t batchCounts[2] = { 0, 0 };
+    struct batchJob jobs[2];
+    int running[2] = { 0, 0 };
+    int current = 0;
+
+    // User and modification time of the previous record. User names can be far longer than any fixed buffer.
+    char* previousUser = NULL;
+    struct timespec previousTime = { 0, 0 };
+
+    unsigned long long imported = 0;
+    while (imported < count) {
+        // Fill the current batch from the archive while the other batch is being written
+        unsigned long long bytes = 0;
+        batchCounts[current] = 0;
+
+        while (imported < count && batchCounts[current] < BATCH_MAX_DROPS && bytes < BATCH_MAX_BYTES) {
+            struct dropEntry* entry = &batches[current][batchCounts[current]];
+            readRecordHeader(archive, entry);
+
+            // Keep per-user delivery order explicit even when timestamps collide
+            int sameUser = previousUser != NULL && strcmp(previousUser, entry->user) == 0;
+            if (sameUser &&
+                (entry->mtime.tv_sec < previousTime.tv_sec ||
+                 (entry->mtime.tv_sec == previousTime.tv_sec && entry->mtime.tv_nsec <= previousTime.tv_nsec))) {
+                entry->mtime = previousTime;
+                entry->mtime.tv_nsec = entry->mtime.tv_nsec + 1;
+                if (entry->mtime.tv_nsec >= 1000000000L) {
+                    entry->mtime.tv_sec = entry->mtime.tv_sec + 1;
+                    entry->mtime.tv_nsec = 0;
+                }
+            }
+            if (!sameUser) {
+                free(previousUser);
+                previousUser = strdup(entry->user);
+            }
+            previousTime = entry->mtime;
+
+            if (entry->streamed) {
+                streamDropFromArchive(archive, entry, copyBuffer);
+            }
+            else {
+                entry->data = malloc(entry->size + 1);
+                if (entry->data == NULL || fread(entry->data, 1, entry->size, archive) != entry->size) {
+                    fprintf(stderr, "Archive is truncated.\n");
+                    exit(1);
+                }
+                entry->crc = readRecordChecksum(archive);
+                bytes = bytes + entry->size;
+            }
+
+            batchCounts[current]++;
+            imported++;
+        }
+
+        // Wait for the other batch to be written before reusing it on the next pass
+        if (running[1 - current]) {
+            finishBatch(&jobs[1 - current]);
+            releaseBatch(batches[1 - current], batchCounts[1 - current]);
+            running[1 - current] = 0;
+        }
+
+        startBatch(&jobs[current], batches[current], 0, batchCounts[current], threadCount, storeWorker);
+        running[current] = 1;
+        current = 1 - current;
+    }
+
+    int i;
+    for (i = 0; i < 2; i++) {
+        if (running[i]) {
+            finishBatch(&jobs[i]);
+            releaseBatch(batches[i], batchCounts[i]);
+        }
+    }
+
+    fclose(archive);
+    fprintf(stdout, "Imported %llu drops from %s\n", count, path);
+
+    free(batches[0]);
+    free(batches[1]);
+    free(copyBuffer);
+    free(previousUser);
+}
+
+// Main validates the command line arguments and runs the requested export or import in the current directory.
+int main(int argc, char* argv[]) {
+    // Check to see that correct number of arguments are included, if not throw error
+    if (argc < 3 || argc > 4) {
+        fprintf(stderr, "Usage: otp_pack export|import <archive> [threads]\n");
+        exit(1);
+    }
+
+    // Default to one worker thread per online processor
+    long threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc == 4) {
+        int i;
+        // Check if all values in argument are integers and output error/exit if not
+        for (i = 0; i < strlen(argv[3]); i++) {
+            if (!isdigit(argv[3][i])) {
+                fprintf(stderr, "Thread count argument can only be an integer value.\n");
+                exit(1);
+            }
+        }
+        threadCount = atoi(argv[3]);
+    }
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+    if (threadCount > MAX_THREADS) {
+        threadCount = MAX_THREADS;
+    }
+
+    // Fill the checksum tables before the worker threads share them
+    crc32cInitTable();
+
+    if (strcmp(argv[1], "export") == 0) {
+        exportDrops(argv[2], (int) threadCount);
+    }
+    else if (strcmp(argv[1], "import") == 0) {
+        importDrops(argv[2], (int) threadCount);
+    }
+    else {
+        fprintf(stderr, "Mode must be either export or import.\n");
+        exit(1);
+    }
+
+    return 0;
+}
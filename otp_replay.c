@@ -0,0 +1,400 @@
+// Author: Justin Tromp
+// Date: 05/25/2020
+// Description: otp_replay drives an otp_d with a request trace recorded by otp_d -T, so a server build can be
+// measured against the shape of real traffic. Every traced request is sent again with the same operation, size and
+// timing: at the original speed, speed times faster, or (speed 0) as fast as the connections allow. Users are
+// replaced by names derived from their hashes and messages by filler bytes. Requests are issued open loop: each is
+// due at its (scaled) arrival time, and its latency is measured from that time so a server falling behind shows
+// up as latency rather than as a slower replay. Throughput and latency percentiles per operation are reported, next
+// to the service times recorded in the trace.
+// Valid arguments: [-x speed] [-c connections] <trace_file> <port|host:port>
+// References: Previous Assignments
+// https://man7.org/linux/man-pages/man2/clock_nanosleep.2.html
+// https://man7.org/linux/man-pages/man3/pthread_create.3.html
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "trace.h"
+
+// Default and maximum number of requests in flight, and size of the filler buffer messages are sent from.
+#define DEFAULT_CONNECTIONS 64
+#define MAX_CONNECTIONS 1024
+#define FILLER_SIZE 65536
+
+// Outcome of one replayed request.
+struct replayResult {
+    long long latency;
+    long long bytes;
+    int outcome;
+};
+
+// Shared state of the replay. Next is the index of the next request to be claimed by a worker.
+struct replayJob {
+    struct traceRecord* records;
+    struct replayResult* results;
+    long count;
+    long next;
+    double speed;
+    long long start;
+    struct addrinfo* server;
+};
+
+char filler[FILLER_SIZE];
+
+// Returns the monotonic clock in microseconds.
+// Pre-conditions: None.
+// Post-conditions: Returns the current time.
+long long replayClock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Orders trace records by arrival for qsort.
+int compareArrivals(const void* first, const void* second) {
+    const struct traceRecord* a = first;
+    const struct traceRecord* b = second;
+
+    return a->arrival < b->arrival ? -1 : (a->arrival > b->arrival ? 1 : 0);
+}
+
+// Reads a trace written by otp_d and sorts it by arrival.
+// Pre-conditions: Must be passed the path of a trace and a location for the record count.
+// Post-conditions: Returns the records. Exits if the file is not a trace.
+struct traceRecord* loadTrace(char* path, long* count) {
+    FILE* trace = fopen(path, "r");
+    char magic[TRACE_MAGIC_LEN];
+    if (trace == NULL || fread(magic, 1, TRACE_MAGIC_LEN, trace) != TRACE_MAGIC_LEN ||
+        memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+        fprintf(stderr, "%s is not an otp_d trace.\n", path);
+        exit(1);
+    }
+
+    long capacity = 1024;
+    struct traceRecord* records = malloc(sizeof(struct traceRecord) * capacity);
+    unsigned char encoded[TRACE_RECORD_LEN];
+    *count = 0;
+    while (fread(encoded, 1, TRACE_RECORD_LEN, trace) == TRACE_RECORD_LEN) {
+        if (*count == capacity) {
+            capacity = capacity * 2;
+            records = realloc(records, sizeof(struct traceRecord) * capacity);
+        }
+        traceDecode(encoded, &records[*count]);
+        *count = *count + 1;
+    }
+    fclose(trace);
+
+    qsort(records, *count, sizeof(struct traceRecord), compareArrivals);
+
+    return records;
+}
+
+// Sends length filler bytes.
+// Pre-conditions: Must be passed a connected socket.
+// Post-conditions: Returns 0 if all of them were sent, otherwise -1.
+int sendFiller(int socket, long long length) {
+    while (length > 0) {
+        int chunk = length < FILLER_SIZE ? (int) length : FILLER_SIZE;
+        int sent = send(socket, filler, chunk, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return -1;
+        }
+        length = length - sent;
+    }
+
+    return 0;
+}
+
+// Reads a connection until otp_d closes it, keeping the start of the reply.
+// Pre-conditions: Must be passed a connected socket and a buffer of max bytes for the start of the reply.
+// Post-conditions: Returns the number of bytes read. The start of the reply is terminated in the buffer.
+long long receiveAll(int socket, char* start, int max) {
+    char buffer[FILLER_SIZE];
+    long long total = 0;
+    int valread;
+
+    memset(start, '\0', max);
+    while ((valread = recv(socket, buffer, FILLER_SIZE, 0)) > 0) {
+        if (total < max - 1) {
+            memcpy(start + total, buffer, total + valread < max - 1 ? valread : max - 1 - total);
+        }
+        total = total + valread;
+    }
+
+    return total;
+}
+
+// Sends one traced request to otp_d the way otp would and waits for otp_d to finish it. Posts, resumable posts and
+// fan-outs send as many filler bytes as the traced request moved, a fan-out to as many recipients as it had.
+// Pre-conditions: Must be passed the shared job, the record and its index.
+// Post-conditions: Returns the outcome (a TRACE outcome) and stores the bytes moved.
+int replayRequest(struct replayJob* job, struct traceRecord* record, long index, long long* bytes) {
+    char* commands[] = { "", "get", "post", "chunk", "fan" };
+    char user[1025];
+    char reply[64];
+
+    if (record->operation < TRACE_GET || record->operation > TRACE_FAN) {
+        return TRACE_FAILED;
+    }
+    snprintf(user, sizeof(user), "u%08x", record->userHash);
+    if (record->operation == TRACE_FAN) {
+        int length = 0;
+        int i;
+        for (i = 0; i < record->recipients && length < 1000; i++) {
+            length = length + snprintf(user + length, sizeof(user) - length, "%su%08x.%d", i > 0 ? "," : "",
+                                       record->userHash, i);
+        }
+    }
+
+    int clientSocket = socket(job->server->ai_family, SOCK_STREAM, 0);
+    if (clientSocket < 0 || connect(clientSocket, job->server->ai_addr, job->server->ai_addrlen) != 0) {
+        if (clientSocket >= 0) {
+            close(clientSocket);
+        }
+        return TRACE_FAILED;
+    }
+
+    // Handshake, each step is acknowledged before the next is sent
+    char* command = commands[record->operation];
+    if (send(clientSocket, command, strlen(command), MSG_NOSIGNAL) <= 0 || recv(clientSocket, reply, 16, 0) <= 0 ||
+        send(clientSocket, user, strlen(user), MSG_NOSIGNAL) <= 0 || recv(clientSocket, reply, 13, 0) <= 0) {
+        close(clientSocket);
+        return TRACE_FAILED;
+    }
+
+    int outcome = TRACE_FAILED;
+    if (record->operation == TRACE_GET) {
+        // An empty mailbox is answered with a lone "0", a drop with a 20 byte size field and the drop
+        *bytes = receiveAll(clientSocket, reply, sizeof(reply));
+        outcome = *bytes >= 20 ? TRACE_DELIVERED : (*bytes > 0 ? TRACE_EMPTY : TRACE_FAILED);
+    }
+    else if (record->operation == TRACE_CHUNK) {
+        char header[64];
+        int length = snprintf(header, sizeof(header), "r%08x%08lx %lld\n", (unsigned int) getpid(), index,
+                              (long long) record->bytes);
+        if (send(clientSocket, header, length, MSG_NOSIGNAL) == length && recv(clientSocket, reply, 63, 0) > 0) {
+            long long offset = 0;
+            if (sscanf(reply, "OFFSET %lld", &offset) == 1 && sendFiller(clientSocket, record->bytes - offset) == 0) {
+                *bytes = record->bytes - offset;
+                receiveAll(clientSocket, reply, sizeof(reply));
+                outcome = strncmp(reply, "COMPLETE", 8) == 0 ? TRACE_STORED : TRACE_FAILED;
+            }
+            else if (strncmp(reply, "QUOTA_EXCEEDED", 14) == 0) {
+                outcome = TRACE_REJECTED;
+            }
+        }
+    }
+    else {
+        // otp_d only replies to a post if it rejects it
+        int sent = sendFiller(clientSocket, record->bytes);
+        shutdown(clientSocket, SHUT_WR);
+        receiveAll(clientSocket, reply, sizeof(reply));
+        if (strncmp(reply, "QUOTA_EXCEEDED", 14) == 0 || strncmp(reply, "STORE_FULL", 10) == 0) {
+            outcome = TRACE_REJECTED;
+        }
+        else if (sent == 0) {
+            outcome = TRACE_STORED;
+        }
+        *bytes = record->bytes;
+    }
+
+    close(clientSocket);
+
+    return outcome;
+}
+
+// Worker thread: claims requests in arrival order, waits until each is due and replays it.
+// Pre-conditions: Must be passed the shared job.
+// Post-conditions: Results of every request the worker claimed are stored in the job.
+void* replayWorker(void* argument) {
+    struct replayJob* job = argument;
+
+    while (1) {
+        long index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (index >= job->count) {
+            break;
+        }
+
+        // Requests are due at their arrival relative to the first one, scaled by the speed
+        long long due = replayClock();
+        if (job->speed > 0) {
+            due = job->start + (long long) ((job->records[index].arrival - job->records[0].arrival) / job->speed);
+            struct timespec wake = { due / 1000000, (due % 1000000) * 1000 };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) != 0) {
+            }
+        }
+
+        struct replayResult* result = &job->results[index];
+        result->bytes = 0;
+        result->outcome = replayRequest(job, &job->records[index], index, &result->bytes);
+        result->latency = replayClock() - due;
+    }
+
+    return NULL;
+}
+
+// Orders latencies for qsort.
+int compareLatencies(const void* first, const void* second) {
+    long long a = *(const long long*) first;
+    long long b = *(const long long*) second;
+
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+// Outputs a line of latency percentiles in milliseconds.
+// Pre-conditions: Must be passed a label and count latencies in microseconds, which are sorted in place.
+// Post-conditions: Line is output, nothing if there are no latencies.
+void reportLatencies(char* label, long long* latencies, long count) {
+    if (count == 0) {
+        return;
+    }
+    qsort(latencies, count, sizeof(long long), compareLatencies);
+    fprintf(stdout, "%-14s %8ld %9.2f %9.2f %9.2f %9.2f %9.2f\n", label, count, latencies[count / 2] / 1000.0,
+            latencies[count * 90 / 100] / 1000.0, latencies[count * 99 / 100] / 1000.0,
+            latencies[count * 999 / 1000] / 1000.0, latencies[count - 1] / 1000.0);
+}
+
+// Outputs the report of a finished replay: throughput, latency per operation and for all requests next to the
+// recorded service times, and how many requests ended differently than in the trace.
+// Pre-conditions: Job must be finished and elapsed be its duration in microseconds.
+// Post-conditions: Report is output to stdout.
+void reportReplay(struct replayJob* job, long long elapsed) {
+    char* labels[] = { "", "get", "post", "chunk", "fan" };
+    long long* latencies = malloc(sizeof(long long) * (job->count > 0 ? job->count : 1));
+    long long bytes = 0;
+    long failed = 0;
+    long differing = 0;
+    long i;
+
+    for (i = 0; i < job->count; i++) {
+        int recorded = job->records[i].outcome;
+        bytes = bytes + job->results[i].bytes;
+        if (job->results[i].outcome == TRACE_FAILED) {
+            failed++;
+        }
+        if (recorded >= TRACE_STORED && recorded <= TRACE_REJECTED && recorded != job->results[i].outcome) {
+            differing++;
+        }
+    }
+
+    double seconds = elapsed / 1e6 > 0 ? elapsed / 1e6 : 1e-6;
+    fprintf(stdout, "Replayed %ld requests in %.2f s: %.1f requests/s, %.2f MB/s\n", job->count, seconds,
+            job->count / seconds, bytes / seconds / 1e6);
+    fprintf(stdout, "%-14s %8s %9s %9s %9s %9s %9s\n", "latency (ms)", "count", "p50", "p90", "p99", "p99.9", "max");
+
+    int operation;
+    for (operation = TRACE_GET; operation <= TRACE_FAN; operation++) {
+        long count = 0;
+        for (i = 0; i < job->count; i++) {
+            if (job->records[i].operation == operation) {
+                latencies[count++] = job->results[i].latency;
+            }
+        }
+        reportLatencies(labels[operation], latencies, count);
+    }
+    for (i = 0; i < job->count; i++) {
+        latencies[i] = job->results[i].latency;
+    }
+    reportLatencies("all", latencies, job->count);
+    for (i = 0; i < job->count; i++) {
+        latencies[i] = job->records[i].serviceTime;
+    }
+    reportLatencies("all (trace)", latencies, job->count);
+
+    fprintf(stdout, "Failed requests: %ld, outcomes differing from the trace: %ld\n", failed, differing);
+    free(latencies);
+}
+
+// Main reads the options, loads the trace and replays it against the otp_d at the given port or host:port.
+int main(int argc, char* argv[]) {
+    double speed = 1;
+    long connections = DEFAULT_CONNECTIONS;
+
+    int option;
+    while ((option = getopt(argc, argv, "x:c:")) != -1) {
+        switch (option) {
+            case 'x': {
+                char* end = NULL;
+                speed = strtod(optarg, &end);
+                if (*end != '\0' || speed < 0) {
+                    fprintf(stderr, "Speed must be a non-negative number, 0 replays as fast as possible.\n");
+                    exit(1);
+                }
+                break;
+            }
+            case 'c': {
+                connections = atol(optarg);
+                if (connections < 1 || connections > MAX_CONNECTIONS) {
+                    fprintf(stderr, "Connections must be between 1 and %d.\n", MAX_CONNECTIONS);
+                    exit(1);
+                }
+                break;
+            }
+            default: {
+                fprintf(stderr, "Usage: otp_replay [-x speed] [-c connections] <trace_file> <port|host:port>\n");
+                exit(1);
+            }
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "Usage: otp_replay [-x speed] [-c connections] <trace_file> <port|host:port>\n");
+        exit(1);
+    }
+
+    // Resolve the server once for every request
+    char host[256] = "localhost";
+    char* port = argv[optind + 1];
+    char* separator = strrchr(argv[optind + 1], ':');
+    if (separator != NULL && separator - argv[optind + 1] < (long) sizeof(host)) {
+        memcpy(host, argv[optind + 1], separator - argv[optind + 1]);
+        host[separator - argv[optind + 1]] = '\0';
+        port = separator + 1;
+    }
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct replayJob job;
+    memset(&job, 0, sizeof(job));
+    if (getaddrinfo(host, port, &hints, &job.server) != 0) {
+        fprintf(stderr, "Could not resolve %s.\n", argv[optind + 1]);
+        exit(1);
+    }
+
+    job.records = loadTrace(argv[optind], &job.count);
+    job.results = calloc(job.count > 0 ? job.count : 1, sizeof(struct replayResult));
+    job.speed = speed;
+    memset(filler, 'A', FILLER_SIZE);
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t* threads = malloc(sizeof(pthread_t) * connections);
+    job.start = replayClock();
+    long i;
+    for (i = 0; i < connections; i++) {
+        if (pthread_create(&threads[i], NULL, replayWorker, &job) != 0) {
+            fprintf(stderr, "Could not start replay threads.\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < connections; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    reportReplay(&job, replayClock() - job.start);
+
+    freeaddrinfo(job.server);
+    free(threads);
+    free(job.records);
+    free(job.results);
+
+    return 0;
+}
@@ -0,0 +1,75 @@
+// Author: Justin Tromp
+// Date: 05/25/2020
+// Description: SipHash-2-4 keyed hash, used by otp_d for the user hashes of its request trace and to authenticate
+// replication leaders to their followers.
+
+#ifndef SIPHASH_H
+#define SIPHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Rotates a 64 bit value left by bits.
+// Pre-conditions: bits must be between 1 and 63.
+// Post-conditions: Returns the rotated value.
+static inline uint64_t sipRotate(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// Runs rounds SipHash rounds over the state.
+// Pre-conditions: Must be passed the four state words.
+// Post-conditions: State is mixed.
+static inline void sipRounds(uint64_t* v, int rounds) {
+    int i;
+    for (i = 0; i < rounds; i++) {
+        v[0] += v[1];
+        v[1] = sipRotate(v[1], 13) ^ v[0];
+        v[0] = sipRotate(v[0], 32);
+        v[2] += v[3];
+        v[3] = sipRotate(v[3], 16) ^ v[2];
+        v[0] += v[3];
+        v[3] = sipRotate(v[3], 21) ^ v[0];
+        v[2] += v[1];
+        v[1] = sipRotate(v[1], 17) ^ v[2];
+        v[2] = sipRotate(v[2], 32);
+    }
+}
+
+// Hashes length bytes of data with SipHash-2-4 under the key k0, k1.
+// Pre-conditions: data must hold length bytes.
+// Post-conditions: Returns the 64 bit hash.
+static inline uint64_t sipHash(const void* data, size_t length, uint64_t k0, uint64_t k1) {
+    const unsigned char* bytes = data;
+    uint64_t v[4] = { k0 ^ 0x736f6d6570736575ull, k1 ^ 0x646f72616e646f6dull,
+                      k0 ^ 0x6c7967656e657261ull, k1 ^ 0x7465646279746573ull };
+    size_t offset = 0;
+    uint64_t word = 0;
+    int i;
+
+    // Whole 8 byte words, little-endian as SipHash defines them
+    for (offset = 0; offset + 8 <= length; offset = offset + 8) {
+        word = 0;
+        for (i = 7; i >= 0; i--) {
+            word = (word << 8) | bytes[offset + i];
+        }
+        v[3] ^= word;
+        sipRounds(v, 2);
+        v[0] ^= word;
+    }
+
+    // Last word holds the remaining bytes and the length in its top byte
+    word = (uint64_t) length << 56;
+    for (i = (int) (length - offset) - 1; i >= 0; i--) {
+        word |= (uint64_t) bytes[offset + i] << (8 * i);
+    }
+    v[3] ^= word;
+    sipRounds(v, 2);
+    v[0] ^= word;
+
+    v[2] ^= 0xff;
+    sipRounds(v, 4);
+
+    return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+#endif
@@ -0,0 +1,92 @@
+// Author: Justin Tromp
+// Date: 05/25/2020
+// Description: Request trace written by otp_d (-T) and read by otp_replay. A trace holds only the shape of the
+// traffic: when each request arrived, what it was, a hash of its user, how many bytes it moved and how it ended.
+// No user names or message contents are recorded. User hashes are keyed with a secret otp_d draws when it starts and
+// never writes out, so they group the requests of a user but cannot be matched against guessed names.
+// A trace file starts with TRACE_MAGIC and is followed by fixed size records. Every integer is stored big-endian so
+// traces can be replayed on any machine. Records are appended with a single write each and are ordered by the time
+// requests finished, otp_replay sorts them by arrival.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <string.h>
+#include "bigendian.h"
+#include "siphash.h"
+
+#define TRACE_MAGIC "OTPTRC01"
+#define TRACE_MAGIC_LEN 8
+
+// Record layout: arrival (microseconds since the epoch), bytes moved, service time (microseconds from arrival until
+// the request ended), user hash, recipients of a fan-out (1 otherwise), operation and outcome.
+#define TRACE_RECORD_LEN 32
+
+// Operations.
+#define TRACE_GET 1
+#define TRACE_POST 2
+#define TRACE_CHUNK 3
+#define TRACE_FAN 4
+
+// Outcomes. A request ends failed unless its process records another outcome before exiting.
+#define TRACE_STORED 1
+#define TRACE_DELIVERED 2
+#define TRACE_EMPTY 3
+#define TRACE_REJECTED 4
+#define TRACE_PAUSED 5
+#define TRACE_FAILED 6
+#define TRACE_EVICTED 7
+
+// A single traced request.
+struct traceRecord {
+    int64_t arrival;
+    int64_t bytes;
+    uint32_t serviceTime;
+    uint32_t userHash;
+    uint16_t recipients;
+    uint8_t operation;
+    uint8_t outcome;
+};
+
+// Key of the user hash, held only by the otp_d writing the trace.
+struct traceKey {
+    uint64_t k0;
+    uint64_t k1;
+};
+
+// Hashes a user name (or fan-out recipient list) with SipHash-2-4 under the trace key, keeping the low 32 bits.
+// Pre-conditions: Must be passed a string and the trace key.
+// Post-conditions: Returns the hash.
+static inline uint32_t traceUserHash(const char* user, const struct traceKey* key) {
+    return (uint32_t) sipHash(user, strlen(user), key->k0, key->k1);
+}
+
+// Encodes a record into TRACE_RECORD_LEN bytes.
+// Pre-conditions: Buffer must have TRACE_RECORD_LEN bytes available.
+// Post-conditions: Buffer holds the encoded record.
+static inline void traceEncode(unsigned char* buffer, const struct traceRecord* record) {
+    memset(buffer, 0, TRACE_RECORD_LEN);
+    putUnsigned(buffer, (uint64_t) record->arrival, 8);
+    putUnsigned(buffer + 8, (uint64_t) record->bytes, 8);
+    putUnsigned(buffer + 16, record->serviceTime, 4);
+    putUnsigned(buffer + 20, record->userHash, 4);
+    putUnsigned(buffer + 24, record->recipients, 2);
+    buffer[26] = record->operation;
+    buffer[27] = record->outcome;
+}
+
+// Decodes a record from TRACE_RECORD_LEN bytes.
+// Pre-conditions: Buffer must hold an encoded record.
+// Post-conditions: Record holds the decoded values.
+static inline void traceDecode(const unsigned char* buffer, struct traceRecord* record) {
+    record->arrival = (int64_t) getUnsigned(buffer, 8);
+    record->bytes = (int64_t) getUnsigned(buffer + 8, 8);
+    record->serviceTime = (uint32_t) getUnsigned(buffer + 16, 4);
+    record->userHash = (uint32_t) getUnsigned(buffer + 20, 4);
+    record->recipients = (uint16_t) getUnsigned(buffer + 24, 2);
+    record->operation = buffer[26];
+    record->outcome = buffer[27];
+}
+
+#endif